@@ -28,6 +28,7 @@
 #ifndef MAP_H
 #define MAP_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -75,10 +76,82 @@ typedef struct
   // Max distance at which we care about obstacles, for constructing
   // likelihood field
   double max_occ_dist;
+
+  // File mapping backing [cells] for maps loaded with map_load_bin();
+  // NULL when the cells were allocated with malloc
+  void *mapped;
+  size_t mapped_size;
   
 } map_t;
 
 
+// Header of the binary map format.  The cells follow at offset
+// sizeof(map_bin_header_t) as a raw map_cell_t array, so the file can be
+// memory-mapped directly.
+#define MAP_BIN_MAGIC "AMCLMAP"
+#define MAP_BIN_VERSION 1
+
+typedef struct
+{
+  char magic[8];
+
+  uint32_t version;
+
+  // sizeof(map_cell_t) of the writer; guards against layout changes
+  uint32_t cell_size;
+
+  int32_t size_x, size_y;
+  double scale;
+  double origin_x, origin_y;
+
+  // Distance used for the stored occ_dist values; 0 if the file carries
+  // no distance field
+  double max_occ_dist;
+
+  char reserved[8];
+
+} map_bin_header_t;
+
+
+// Compact index of the free cells in a map
+typedef struct
+{
+  // Number of free cells
+  int count;
+
+  // Cell indices (see MAP_INDEX) of the free cells, in increasing order
+  uint32_t *cells;
+
+  // Alias table for weighted sampling; NULL for uniform sampling
+  double *prob;
+  uint32_t *alias;
+
+} map_free_index_t;
+
+
+// Coarse grid recording, for each cell, which markers are in line of
+// sight and within range
+typedef struct
+{
+  // World position of the lower-left corner of cell (0, 0)
+  double origin_x, origin_y;
+
+  // Cell size (m)
+  double resolution;
+
+  // Grid dimensions (number of cells)
+  int size_x, size_y;
+
+  // Number of markers, and of 32-bit words per cell
+  int marker_count;
+  int words;
+
+  // One bitset per cell; bit m is set if marker m is visible
+  uint32_t *bits;
+
+} map_visibility_t;
+
+
 
 /**************************************************************************
  * Basic map functions
@@ -96,12 +169,91 @@ map_cell_t *map_get_cell(map_t *map, double ox, double oy, double oa);
 // Load an occupancy map
 int map_load_occ(map_t *map, const char *filename, double scale, int negate);
 
+// Load a map_server style YAML description and its PGM image, using the
+// same thresholds as map_server
+int map_load_yaml(map_t *map, const char *filename);
+
+// Save a map in the binary format
+int map_save_bin(map_t *map, const char *filename);
+
+// Memory-map a map saved with map_save_bin().  The mapping is private, so
+// later changes to the cells are not written back to the file.
+int map_load_bin(map_t *map, const char *filename);
+
+// Release the cell storage of a map, whichever way it was allocated
+void map_free_cells(map_t *map);
+
+// Crop the map to the bounding box of its known cells, enlarged by
+// [margin] meters.  The origin is adjusted so that world coordinates of
+// the retained cells are unchanged.  Returns -1 if the map has no known
+// cells.
+int map_crop(map_t *map, double margin);
+
 // Load a wifi signal strength map
 //int map_load_wifi(map_t *map, const char *filename, int index);
 
 // Update the cspace distances
 void map_update_cspace(map_t *map, double max_occ_dist);
 
+// Update the cspace distances around the window [min_i, max_i] x
+// [min_j, max_j] of cells whose occupancy changed
+void map_update_cspace_window(map_t *map, double max_occ_dist,
+                              int min_i, int min_j, int max_i, int max_j);
+
+
+/**************************************************************************
+ * Free space index
+ **************************************************************************/
+
+// Build the index of free cells for the given map
+map_free_index_t *map_free_index_alloc(map_t *map);
+
+// Destroy the index
+void map_free_index_free(map_free_index_t *index);
+
+// Refresh the index after the occupancy of the cells in the window
+// [min_i, max_i] x [min_j, max_j] changed; resets the weights
+void map_free_index_update(map_free_index_t *index, map_t *map,
+                           int min_i, int min_j, int max_i, int max_j);
+
+// Set one (non-negative) sampling weight per entry of index->cells; NULL
+// restores uniform sampling.  Returns -1 if the weights are invalid.
+int map_free_index_set_weights(map_free_index_t *index, const double *weights);
+
+// Draw a free cell in constant time; returns its cell index, or -1 if
+// the map has no free space
+int map_free_index_sample(map_free_index_t *index);
+
+
+/**************************************************************************
+ * Marker visibility
+ **************************************************************************/
+
+// Build the visibility grid with the given cell size.  [points] holds
+// [points_per_marker] (x, y) pairs per marker; a marker is visible from a
+// cell if any of its points is in line of sight and within [max_range]
+// of a free position in the cell.
+map_visibility_t *map_visibility_alloc(map_t *map, const double *points,
+                                       int marker_count, int points_per_marker,
+                                       double resolution, double max_range);
+
+// Recompute the grid cells within [max_range] of the map window
+// [min_i, max_i] x [min_j, max_j] of cells whose occupancy changed.  The
+// arguments must match those given to map_visibility_alloc().
+void map_visibility_update(map_visibility_t *vis, map_t *map, const double *points,
+                           int points_per_marker, double max_range,
+                           int min_i, int min_j, int max_i, int max_j);
+
+// Destroy the visibility grid
+void map_visibility_free(map_visibility_t *vis);
+
+// Get the visibility bitset at the given world position; NULL outside
+// the grid
+const uint32_t *map_visibility_get(map_visibility_t *vis, double x, double y);
+
+// Test marker m in a bitset returned by map_visibility_get()
+#define MAP_VISIBLE(bits, m) (((bits)[(m) >> 5] >> ((m) & 31)) & 1)
+
 
 /**************************************************************************
  * Range functions
@@ -129,6 +281,9 @@ void map_draw_wifi(map_t *map, struct _rtk_fig_t *fig, int index);
  * Map manipulation macros
  **************************************************************************/
 
+// (origin_x, origin_y) is the world position of cell (size_x/2, size_y/2);
+// map_crop() moves it along with the retained window.
+
 // Convert from map index to world coords
 #define MAP_WXGX(map, i) (map->origin_x + ((i) - map->size_x / 2) * map->scale)
 #define MAP_WYGY(map, j) (map->origin_y + ((j) - map->size_y / 2) * map->scale)
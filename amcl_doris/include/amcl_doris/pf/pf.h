@@ -141,6 +141,10 @@ pf_t *pf_alloc(int min_samples, int max_samples,
                double alpha_slow, double alpha_fast,
                pf_init_model_fn_t random_pose_fn, void *random_pose_data);
 
+// Seed the random generator, now and in every filter created from now on
+// (by default new filters are seeded from the clock)
+void pf_seed(long seed);
+
 // Free an existing filter
 void pf_free(pf_t *pf);
 
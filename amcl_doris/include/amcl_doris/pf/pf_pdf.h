@@ -75,6 +75,15 @@ void pf_pdf_gaussian_free(pf_pdf_gaussian_t *pdf);
 //   http://www.taygeta.com/random/gaussian.html
 double pf_ran_gaussian(double sigma);
 
+// Seed an independent generator (erand48 state) from the main one, so that
+// blocks of variates can be drawn in parallel and still be repeatable.
+void pf_ran_seed(unsigned short state[3]);
+
+// Fill z with n standard normal variates from the generator [state].  All
+// the uniforms are drawn first and then transformed in one loop with the
+// trigonometric Box-Muller form, both outputs of each pair being used.
+void pf_ran_gaussian_fill(unsigned short state[3], double *z, int n);
+
 // Generate a sample from the the pdf.
 pf_vector_t pf_pdf_gaussian_sample(pf_pdf_gaussian_t *pdf);
 
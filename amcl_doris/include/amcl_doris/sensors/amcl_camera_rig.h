@@ -0,0 +1,99 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+///////////////////////////////////////////////////////////////////////////
+//
+// Desc: Rig of pinhole cameras stitched side by side in one image
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef AMCL_CAMERA_RIG_H
+#define AMCL_CAMERA_RIG_H
+
+#include <vector>
+#include <tf/tf.h>
+
+namespace amcl
+{
+
+// Number of azimuth bins of the camera selection table
+#define CAMERA_RIG_BINS 3600
+
+
+// Pinhole cameras around a common rig frame (z forward, x right, y
+// down).  A point is imaged by the camera whose optical axis is closest
+// in azimuth, atan2(x, z), and lands in that camera's slice of the
+// stitched image.
+class AMCLCameraRig
+{
+  public: AMCLCameraRig();
+
+  // Remove all cameras
+  public: void Clear();
+
+  // Add a camera with the given pose in the rig frame, the shared 3x4
+  // pinhole projection matrix (row major) and the horizontal offset of
+  // its slice in the stitched image
+  public: void AddCamera(const tf::Transform& pose, const double P[12], double u_offset);
+
+  // Offset used for a camera that doesn't give one: slices of width
+  // image_width/count ordered by azimuth, the forward camera at 0
+  public: static double DefaultOffset(const tf::Transform& pose, int count, double image_width);
+
+  // Build the azimuth to camera table; call after adding the cameras
+  public: void Compile();
+
+  // Project n rig frame points given as separate coordinate arrays into
+  // u, v.  No allocation is done.
+  public: void Project(const double* x, const double* y, const double* z, int n,
+                       double* u, double* v) const;
+
+  // Whether a rig frame point is in front of the camera that projects it
+  public: bool InFront(double x, double y, double z) const;
+
+  // Bearing of pixel (u, v): the unit direction b of its ray in the rig
+  // frame and the centre o of the camera that sees it, the one whose
+  // principal point is closest in u
+  public: void Unproject(double u, double v, double b[3], double o[3]) const;
+
+  // Number of cameras
+  public: int Size() const { return this->azimuth.size(); }
+
+  // Camera that projects a rig frame point, from its azimuth
+  private: int Select(double x, double z) const;
+
+  // Projection matrices from the rig frame, offsets included (12 per
+  // camera)
+  private: std::vector<double> mats;
+
+  // Inverse of the left 3x3 block of each projection matrix (9 per
+  // camera) and the camera centre in the rig frame (3 per camera)
+  private: std::vector<double> inv;
+  private: std::vector<double> centers;
+
+  // Column of the principal point of each camera in the stitched image
+  private: std::vector<double> center_u;
+
+  // Azimuth of the optical axis of each camera
+  private: std::vector<double> azimuth;
+
+  // Camera for each azimuth bin over [0, 2pi)
+  private: std::vector<int> table;
+};
+
+}
+
+#endif
@@ -92,6 +92,9 @@ class AMCLLaser : public AMCLSensor
   // filter has been updated.
   public: virtual bool UpdateSensor(pf_t *pf, AMCLSensorData *data);
 
+  // Apply the configured model to the sample weights
+  public: virtual double Weight(AMCLSensorData *data, pf_sample_set_t *set);
+
   // Set the laser's pose after construction
   public: void SetLaserPose(pf_vector_t& laser_pose) 
           {this->laser_pose = laser_pose;}
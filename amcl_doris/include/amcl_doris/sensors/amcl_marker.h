@@ -31,6 +31,9 @@
 
 #include <vector>
 #include "amcl_sensor.h"
+#include "amcl_marker_map.h"
+#include "amcl_omni_camera.h"
+#include "amcl_camera_rig.h"
 #include "../map/map.h"
 
 #include <geometry_msgs/Point32.h>
@@ -41,17 +44,52 @@
 #include <visualization_msgs/Marker.h>
 #include <tf/tf.h>
 #include <detector/marcador.h>
+#include <detector/camera_calibration.h>
 #include <opencv2/ccalib/omnidir.hpp>
 
 
 namespace amcl
 {
 
+// Particles weighted together by one thread
+#define MARKER_BLOCK 64
+
+// Spacing in pixels of the bearing table of the omnidirectional camera
+#define MARKER_BEARING_TABLE_STEP 4
+
+// Most markers the miss model looks at per particle, closest first, and
+// the cell size in metres of the marker index it uses
+#define MARKER_MISS_MARKERS 16
+#define MARKER_MISS_RESOLUTION 0.5
+
+// A marker is only expected when seen within this cosine of its normal
+// and with all corners this many pixels inside the image
+#define MARKER_MISS_MIN_COS 0.35
+#define MARKER_MISS_MARGIN 10
+
 typedef enum
 {
-  MARKER_MODEL_LIKELIHOOD
+  MARKER_MODEL_LIKELIHOOD,
+  MARKER_MODEL_BEARING
 } marker_model_t;
 
+// Largest mean angle in radians between the observed corner rays and a
+// pose hypothesis for the hypothesis to be kept
+#define MARKER_HYPOTHESIS_MAX_ERROR 0.05
+
+// Robot pose recovered from detected markers
+typedef struct
+{
+  pf_vector_t pose;
+
+  // With a single small marker the angle it is seen from is poorly
+  // constrained: turning the pose about the marker centre keeps its
+  // bearing and range.  pivot is that centre; single is false for poses
+  // fitted to several markers.
+  double pivot_x, pivot_y;
+  bool single;
+} marker_hypothesis_t;
+
 // Laser sensor data
 class AMCLMarkerData : public AMCLSensorData
 {
@@ -79,33 +117,108 @@ class AMCLMarker : public AMCLSensor
                                        double landa,
                                        double marker_coeff);
 
+  // Compare bearings instead of image points: detected corners are
+  // unprojected once per update and each particle only needs the angle
+  // to the expected corner directions
+  public: void SetModelBearing(double z_rand, double landa);
+
+  // Negative information: every marker a particle should see but that
+  // wasn't detected multiplies its weight by miss_prob (1 turns it off).
+  // Expected markers come from the position index of the marker map, so
+  // its range is the detection range; they must be in line of sight,
+  // not seen edge on and have all corners inside the image.
+  public: void SetMissModel(double miss_prob);
+
 
   // Update the filter based on the sensor model.  Returns true if the
   // filter has been updated.
   public: virtual bool UpdateSensor(pf_t *pf, AMCLSensorData *data);
 
+  // Apply the marker model to the sample weights
+  public: virtual double Weight(AMCLSensorData *data, pf_sample_set_t *set);
+
   // Determine the probability for the given pose
   private: static double ObservationLikelihood(AMCLMarkerData *data,
                                               pf_sample_set_t* set);
-  private:std::vector<geometry_msgs::Point> CalculateRelativePose (Marcador Marca, geometry_msgs::Pose CamaraMundo);
-  private: void LoadCameraInfo(void);
-  private: std::vector<cv::Point2d> projectPoints(std::vector<geometry_msgs::Point> cam_center_coord);
-  private:std::vector<float> calculateError(std::vector<cv::Point2f> projection_detected, std::vector<cv::Point2d> projection_map);
+  private: double BinnedLikelihood(pf_sample_set_t* set, const std::vector<int>& detected_index,
+                                   const std::vector<std::vector<cv::Point2f> >& detected,
+                                   const std::vector<unsigned char>& seen);
+  private: bool MissModel(void) const;
+  private: double MissFactor(double x, double y, double co, double si,
+                             const uint32_t* visible, const std::vector<unsigned char>& seen) const;
+  private: bool InImage(int marker, double x, double y, double co, double si) const;
+  private: void LoadPoses(pf_sample_set_t* set);
+  private: void LoadPoses(const std::vector<pf_vector_t>& poses);
+  private: void ReservePoses(size_t n);
+  private: void TransformCorners(int marker, int begin, int end);
+  private: void LoadCameraExtrinsics(void);
+  private: double ProjectionError(const std::vector<cv::Point2f>& projection_detected,
+                                  const double* u, const double* v);
+  private: void ObservedBearings(const std::vector<cv::Point2f>& corners,
+                                 double* bearing, double* origin);
+  private: double BearingError(const double* bearing, const double* origin,
+                               int marker, int particle);
+
+  // Robot poses that explain the detections: one per marker found in the
+  // map and one fitted to all of them when there are several.  Vertical
+  // edges of the markers are ranged from the elevation of their corners
+  // and the planar pose is aligned to them.  Poses that don't reproduce
+  // the observed corner rays are dropped.
+  public: void PoseHypotheses(std::vector<Marcador>& observation,
+                              std::vector<marker_hypothesis_t>& hypotheses);
+  private: int EdgePoints(int marker, const double* bearing, const double* origin,
+                          std::vector<double>& robot_xy, std::vector<double>& world_xy) const;
+  private: bool CheckHypothesis(const pf_vector_t& pose, const std::vector<int>& markers,
+                                const std::vector<double>& bearing, const std::vector<double>& origin);
+
+  // Where the corners of a map marker should appear in the image seen
+  // from the given robot pose
+  public: void ExpectedCorners(const pf_vector_t& pose, int marker,
+                               std::vector<cv::Point2f>& corners);
   public: marker_model_t model_type;
 
   // Current data timestamp
   private: double time;
   public:float  marker_width, num_cam,marker_height,image_width,image_height;
 
-  // The marker map
-  public: std::vector<Marcador> map;
+  // The marker map (not owned)
+  public: const AMCLMarkerMap *map;
+
+  // Which markers of [map] are visible from where (not owned); NULL
+  // projects every detected marker
+  public: map_visibility_t *visibility;
+
+  // Project once per kd-tree pose bin and correct each particle to first
+  // order (projection likelihood only)
+  public: bool bin_evaluation;
 
   //Camera parameters
-  public:std::vector<geometry_msgs::TransformStamped> tf_cameras;
+  // Intrinsics: pinhole for the simulated rig, unified model for the
+  // omnidirectional camera.  Call before SetCameraRig.
+  public: void SetCalibration(const CameraCalibration& calibration);
+  // Pose of the camera (optical axes) in the robot frame; replaces the
+  // built-in one of each mode
+  public: void SetCameraExtrinsics(const tf::Transform& robot_to_camera);
+  public: void SetCameraRig(const std::vector<geometry_msgs::Pose>& cameras, const std::vector<double>& u_offsets);
   private:image_geometry::PinholeCameraModel pin_model;
-  private:sensor_msgs::CameraInfo cam_inf_ed;
-  private: cv::Mat camMatrix, distCoeff;
-  double xi;
+  // Simulated pinhole cameras, built by SetCameraRig
+  private: AMCLCameraRig rig;
+  // Omnidirectional camera, built by SetCalibration
+  private: AMCLOmniCamera omni;
+
+  // Camera in the robot frame: p_cam = cam_rot * (p_robot - cam_origin)
+  private: double cam_rot[9];
+  private: double cam_origin[3];
+
+  // Particle poses, one array per component, filled in by LoadPoses
+  private: std::vector<double> pose_x, pose_y, pose_cos, pose_sin;
+
+  // Marker corners in the camera frame of each particle, filled in by
+  // TransformCorners (entry MARKER_CORNERS*particle+corner)
+  private: std::vector<double> cam_x, cam_y, cam_z;
+
+  // Their projection in the image, same layout
+  private: std::vector<double> img_u, img_v;
 
   //temp data that is kept before observations are integrated to each particle (requried for beam skipping)
   private: int max_samples;
@@ -129,6 +242,8 @@ class AMCLMarker : public AMCLSensor
   private: double lambda_short;
   // Threshold for outlier rejection (unused)
   private: double chi_outlier;
+  // Weight factor of each expected marker that wasn't detected
+  private: double miss_prob;
    //Landa for exponential model of marker hits.
   private:double landa;
 };
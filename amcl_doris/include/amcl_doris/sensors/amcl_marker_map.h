@@ -0,0 +1,126 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+///////////////////////////////////////////////////////////////////////////
+//
+// Desc: Flat lookup table of the marker map, for data association
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef AMCL_MARKER_MAP_H
+#define AMCL_MARKER_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include <detector/marcador.h>
+
+
+namespace amcl
+{
+
+// Map, sector and marker IDs are 5 bits each
+#define MARKER_ID_BITS 5
+#define MARKER_KEY_COUNT (1 << (3 * MARKER_ID_BITS))
+
+// Number of corners stored per marker
+#define MARKER_CORNERS 4
+
+
+// Marker map compiled once into flat arrays.  Marker m keeps its
+// position in the list it was built from, and its corners are entries
+// [MARKER_CORNERS*m, MARKER_CORNERS*(m+1)) of the corner arrays.  The
+// arrays are only written by Build, so the key index stays consistent
+// with them.
+class AMCLMarkerMap
+{
+  public: AMCLMarkerMap();
+
+  // Build the table.  Returns the number of markers that can't be looked
+  // up because their IDs are out of range or already used.
+  public: int Build(std::vector<Marcador>& markers);
+
+  // Pack the IDs of a marker into its key; -1 if out of range
+  public: static int Key(int map, int sector, int id);
+
+  // Index of the marker with the given IDs; -1 if it isn't in the map
+  public: int Find(int map, int sector, int id) const
+  {
+    int key = Key(map, sector, id);
+    return key < 0 ? -1 : this->index[key];
+  }
+
+  // Number of markers
+  public: int Size() const { return this->count; }
+
+  // Index the markers by position on a grid of the given resolution:
+  // each cell keeps the (at most max_markers) closest markers whose
+  // centre is within range of some point of the cell.  Call after Build.
+  public: void BuildIndex(double range, double resolution, int max_markers);
+
+  // Markers that may be within the index range of (x, y), closest
+  // first; *count is 0 outside the indexed area or without an index
+  public: const int32_t *Near(double x, double y, int *count) const;
+
+  // Range given to BuildIndex, 0 without an index
+  public: double IndexRange() const { return this->index_range; }
+
+  // Packed key of marker m
+  public: int MarkerKey(int m) const { return this->keys[m]; }
+
+  // World coordinates of the corners, MARKER_CORNERS * Size() of each;
+  // NULL for an empty table
+  public: const double *CornerX() const { return this->corner_x.empty() ? NULL : &this->corner_x[0]; }
+  public: const double *CornerY() const { return this->corner_y.empty() ? NULL : &this->corner_y[0]; }
+  public: const double *CornerZ() const { return this->corner_z.empty() ? NULL : &this->corner_z[0]; }
+
+  // Centre of each marker and the unit normal of its plane, Size() of each
+  public: const double *CenterX() const { return this->center_x.empty() ? NULL : &this->center_x[0]; }
+  public: const double *CenterY() const { return this->center_y.empty() ? NULL : &this->center_y[0]; }
+  public: const double *CenterZ() const { return this->center_z.empty() ? NULL : &this->center_z[0]; }
+  public: const double *NormalX() const { return this->normal_x.empty() ? NULL : &this->normal_x[0]; }
+  public: const double *NormalY() const { return this->normal_y.empty() ? NULL : &this->normal_y[0]; }
+  public: const double *NormalZ() const { return this->normal_z.empty() ? NULL : &this->normal_z[0]; }
+
+  private: int count;
+
+  // Marker index for each key, -1 if unused
+  private: std::vector<int32_t> index;
+
+  // Packed key of each marker
+  private: std::vector<int32_t> keys;
+
+  // World coordinates of the corners
+  private: std::vector<double> corner_x, corner_y, corner_z;
+
+  // Centre of each marker and the unit normal of its plane, the cross
+  // product of the first and last edges out of corner 0
+  private: std::vector<double> center_x, center_y, center_z;
+  private: std::vector<double> normal_x, normal_y, normal_z;
+
+  // Position index: grid geometry and index_max marker slots per cell,
+  // the first near_count[cell] of them used
+  private: double index_range, index_resolution;
+  private: double index_origin_x, index_origin_y;
+  private: int index_size_x, index_size_y, index_max;
+  private: std::vector<int32_t> near;
+  private: std::vector<int32_t> near_count;
+};
+
+}
+
+#endif
@@ -35,6 +35,9 @@
 namespace amcl
 {
 
+// Particles moved together, with one random generator
+#define ODOM_BLOCK 256
+
 typedef enum
 {
   ODOM_MODEL_DIFF,
@@ -82,6 +85,9 @@ class AMCLOdom : public AMCLSensor
   // has been updated.
   public: virtual bool UpdateAction(pf_t *pf, AMCLSensorData *data);
 
+  // Move blocks of particles on several threads
+  public: bool parallel;
+
   // Current data timestamp
   private: double time;
   
@@ -0,0 +1,81 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+///////////////////////////////////////////////////////////////////////////
+//
+// Desc: History of odometry poses, to look up the pose at a sensor stamp
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef AMCL_ODOM_BUFFER_H
+#define AMCL_ODOM_BUFFER_H
+
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+#include "../pf/pf_vector.h"
+
+namespace amcl
+{
+
+// Ring of the latest odometry poses.  One thread adds poses in time
+// order while others look them up without locks: a reader checks after
+// the search that the writer has not reused the entries it read, and
+// only searches the newer half of the ring so that it rarely has to.
+// Entry fields are relaxed atomics, so a read racing with a reuse gets
+// a stale or mixed entry that the check throws away rather than
+// undefined behaviour.
+class AMCLOdomBuffer
+{
+  // Buffer of at least the given capacity (rounded up to a power of two)
+  public: AMCLOdomBuffer(int capacity = 1024);
+
+  // Add the odometry pose at a time; times must increase
+  public: void Add(double time, const pf_vector_t& pose);
+
+  // Pose at a time, interpolated between the poses around it.  A time
+  // newer than the newest pose by up to tolerance gets the newest pose.
+  // Returns false if the time is outside the buffered history.
+  public: bool Lookup(double time, double tolerance, pf_vector_t& pose) const;
+
+  // Number of poses added
+  public: uint64_t Count() const;
+
+  private: struct Entry
+  {
+    double time;
+    pf_vector_t pose;
+  };
+
+  private: struct Slot
+  {
+    std::atomic<double> time, x, y, a;
+  };
+
+  // Entry at a position, read field by field
+  private: Entry Load(uint64_t i) const;
+
+  private: std::vector<Slot> ring;
+  private: uint64_t mask;
+
+  // Poses added; the newest is at (head - 1) & mask
+  private: std::atomic<uint64_t> head;
+};
+
+}
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+///////////////////////////////////////////////////////////////////////////
+//
+// Desc: Unified (Mei) omnidirectional camera model projection
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef AMCL_OMNI_CAMERA_H
+#define AMCL_OMNI_CAMERA_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace amcl
+{
+
+// Projection of camera frame points with the unified camera model, as
+// cv::omnidir::projectPoints does with zero rvec/tvec: the point is moved
+// to the unit sphere, projected from (0, 0, -xi), distorted with
+// (k1, k2, p1, p2) and mapped to pixels with the camera matrix.
+class AMCLOmniCamera
+{
+  public: AMCLOmniCamera();
+
+  // Take the intrinsics from a 3x3 camera matrix, the mirror parameter
+  // and 4 distortion coefficients (CV_32F or CV_64F)
+  public: void SetIntrinsics(const cv::Mat& K, double xi, const cv::Mat& D);
+
+  // Project n points given as separate coordinate arrays into u, v.  No
+  // allocation is done.
+  public: void Project(const double* x, const double* y, const double* z, int n,
+                       double* u, double* v) const;
+
+  // Whether a camera frame point is on the side of the sphere that the
+  // model projects (z / |p| > -xi)
+  public: bool InFront(double x, double y, double z) const;
+
+  // Unit bearing on the mirror sphere of pixel (u, v), the inverse of
+  // Project.  Distortion is removed iteratively, as
+  // cv::omnidir::undistortPoints does, unless the pixel falls inside the
+  // bearing table, which is then interpolated.
+  public: void Unproject(double u, double v, double b[3]) const;
+
+  // Tabulate the bearings of a width x height image every step pixels.
+  // Call again after changing the intrinsics.  The intrinsics come from
+  // the detector's CameraCalibration, but the table stays here: only the
+  // marker model unprojects pixels.
+  public: void BuildBearingTable(int width, int height, int step);
+
+  // Camera matrix
+  public: double fx, fy, cx, cy, skew;
+
+  // Mirror parameter
+  public: double xi;
+
+  // Radial and tangential distortion
+  public: double k1, k2, p1, p2;
+
+  private: void UnprojectExact(double u, double v, double b[3]) const;
+
+  // Bearing table, 3 values per node, row major
+  private: std::vector<double> table;
+  private: int table_step, table_cols, table_rows;
+};
+
+}
+
+#endif
@@ -28,6 +28,7 @@
 #ifndef AMCL_SENSOR_H
 #define AMCL_SENSOR_H
 
+#include <vector>
 #include "../pf/pf.h"
 
 namespace amcl
@@ -58,6 +59,15 @@ class AMCLSensor
   // filter has been updated.
   public: virtual bool UpdateSensor(pf_t *pf, AMCLSensorData *data);
 
+  // Multiply the sample weights by the likelihood of the data and return
+  // their total.  The default leaves the weights unchanged.
+  public: virtual double Weight(AMCLSensorData *data, pf_sample_set_t *set);
+
+  // Update the filter with several measurements in one sensor pass: the
+  // weights go through the Weight() of each measurement's sensor in turn
+  // and are normalised once.
+  public: static void UpdateSensors(pf_t *pf, std::vector<AMCLSensorData*>& data);
+
   // Flag is true if this is the action sensor
   public: bool is_action;
 
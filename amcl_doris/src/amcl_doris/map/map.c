@@ -30,8 +30,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
-#include "amcl/map/map.h"
+#include "amcl_doris/map/map.h"
 
 
 // Create a new map
@@ -52,6 +53,9 @@ map_t *map_alloc(void)
   
   // Allocate storage for main map
   map->cells = (map_cell_t*) NULL;
+  map->max_occ_dist = 0;
+  map->mapped = NULL;
+  map->mapped_size = 0;
   
   return map;
 }
@@ -60,12 +64,26 @@ map_t *map_alloc(void)
 // Destroy a map
 void map_free(map_t *map)
 {
-  free(map->cells);
+  map_free_cells(map);
   free(map);
   return;
 }
 
 
+// Release the cell storage
+void map_free_cells(map_t *map)
+{
+  if (map->mapped != NULL)
+    munmap(map->mapped, map->mapped_size);
+  else
+    free(map->cells);
+  map->mapped = NULL;
+  map->mapped_size = 0;
+  map->cells = NULL;
+  return;
+}
+
+
 // Get the cell at the given point
 map_cell_t *map_get_cell(map_t *map, double ox, double oy, double oa)
 {
@@ -82,3 +100,62 @@ map_cell_t *map_get_cell(map_t *map, double ox, double oy, double oa)
   return cell;
 }
 
+
+// Crop the map to the bounding box of its known cells, plus a margin.
+// The origin is shifted so that MAP_WXGX/MAP_GXWX give the same world
+// coordinates for every retained cell.
+int map_crop(map_t *map, double margin)
+{
+  int i, j, pad;
+  int min_i, max_i, min_j, max_j;
+  int size_x, size_y;
+  map_cell_t *cells;
+
+  min_i = map->size_x;
+  min_j = map->size_y;
+  max_i = max_j = -1;
+  for (j = 0; j < map->size_y; j++)
+  {
+    for (i = 0; i < map->size_x; i++)
+    {
+      if (map->cells[MAP_INDEX(map, i, j)].occ_state == 0)
+        continue;
+      if (i < min_i) min_i = i;
+      if (i > max_i) max_i = i;
+      if (j < min_j) min_j = j;
+      if (j > max_j) max_j = j;
+    }
+  }
+
+  // Nothing known; leave the map alone
+  if (max_i < 0)
+    return -1;
+
+  pad = (int) ceil(margin / map->scale);
+  min_i = (min_i - pad > 0) ? min_i - pad : 0;
+  min_j = (min_j - pad > 0) ? min_j - pad : 0;
+  max_i = (max_i + pad < map->size_x - 1) ? max_i + pad : map->size_x - 1;
+  max_j = (max_j + pad < map->size_y - 1) ? max_j + pad : map->size_y - 1;
+
+  size_x = max_i - min_i + 1;
+  size_y = max_j - min_j + 1;
+  if (size_x == map->size_x && size_y == map->size_y)
+    return 0;
+
+  cells = (map_cell_t*) malloc(sizeof(map_cell_t) * size_x * size_y);
+  for (j = 0; j < size_y; j++)
+    memcpy(cells + j * size_x,
+           map->cells + MAP_INDEX(map, min_i, min_j + j),
+           sizeof(map_cell_t) * size_x);
+
+  // Keep the world position of the new centre cell
+  map->origin_x = MAP_WXGX(map, min_i + size_x / 2);
+  map->origin_y = MAP_WYGY(map, min_j + size_y / 2);
+
+  map_free_cells(map);
+  map->cells = cells;
+  map->size_x = size_x;
+  map->size_y = size_y;
+
+  return 0;
+}
@@ -19,11 +19,12 @@
  *
  */
 
+#include <algorithm>
 #include <queue>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
-#include "amcl/map/map.h"
+#include "amcl_doris/map/map.h"
 
 class CellData
 {
@@ -175,6 +176,137 @@ void map_update_cspace(map_t *map, double max_occ_dist)
   delete[] marked;
 }
 
+// Window used by map_update_cspace_window; cells are marked relative to
+// its lower-left corner
+struct CspaceWindow
+{
+  int min_i, min_j, max_i, max_j;
+  unsigned char* marked;
+
+  unsigned char& mark(int i, int j)
+  {
+    return marked[(i - min_i) + (j - min_j) * (max_i - min_i + 1)];
+  }
+};
+
+static void enqueue_window(map_t* map, int i, int j,
+                           int src_i, int src_j,
+                           std::priority_queue<CellData>& Q,
+                           CachedDistanceMap* cdm,
+                           CspaceWindow& w)
+{
+  if(i < w.min_i || i > w.max_i || j < w.min_j || j > w.max_j)
+    return;
+  if(w.mark(i, j))
+    return;
+
+  int di = abs(i - src_i);
+  int dj = abs(j - src_j);
+  double distance = cdm->distances_[di][dj];
+
+  if(distance > cdm->cell_radius_)
+    return;
+
+  map->cells[MAP_INDEX(map, i, j)].occ_dist = distance * map->scale;
+
+  CellData cell;
+  cell.map_ = map;
+  cell.i_ = i;
+  cell.j_ = j;
+  cell.src_i_ = src_i;
+  cell.src_j_ = src_j;
+
+  Q.push(cell);
+
+  w.mark(i, j) = 1;
+}
+
+// Update the cspace distance values of the cells within max_occ_dist of
+// the window [min_i, max_i] x [min_j, max_j], after the occupancy of
+// cells in that window changed.  The distances must have been computed
+// with map_update_cspace() for the same max_occ_dist.
+void map_update_cspace_window(map_t *map, double max_occ_dist,
+                              int min_i, int min_j, int max_i, int max_j)
+{
+  std::priority_queue<CellData> Q;
+
+  CachedDistanceMap* cdm = get_distance_map(map->scale, max_occ_dist);
+  int r = cdm->cell_radius_ + 1;
+
+  // Cells whose distance may change...
+  int a_min_i = std::max(min_i - r, 0);
+  int a_min_j = std::max(min_j - r, 0);
+  int a_max_i = std::min(max_i + r, map->size_x - 1);
+  int a_max_j = std::min(max_j + r, map->size_y - 1);
+
+  // ...and the obstacles that can reach them
+  CspaceWindow w;
+  w.min_i = std::max(a_min_i - r, 0);
+  w.min_j = std::max(a_min_j - r, 0);
+  w.max_i = std::min(a_max_i + r, map->size_x - 1);
+  w.max_j = std::min(a_max_j + r, map->size_y - 1);
+  if(w.min_i > w.max_i || w.min_j > w.max_j)
+    return;
+
+  int wx = w.max_i - w.min_i + 1;
+  int wy = w.max_j - w.min_j + 1;
+  w.marked = new unsigned char[wx*wy];
+  memset(w.marked, 0, sizeof(unsigned char) * wx*wy);
+
+  // Only the inner window is written back; keep the rest as it was
+  double* saved = new double[wx*wy];
+  for(int j=w.min_j; j<=w.max_j; j++)
+    for(int i=w.min_i; i<=w.max_i; i++)
+      saved[(i - w.min_i) + (j - w.min_j) * wx] = map->cells[MAP_INDEX(map, i, j)].occ_dist;
+
+  CellData cell;
+  cell.map_ = map;
+  for(int i=w.min_i; i<=w.max_i; i++)
+  {
+    cell.src_i_ = cell.i_ = i;
+    for(int j=w.min_j; j<=w.max_j; j++)
+    {
+      if(map->cells[MAP_INDEX(map, i, j)].occ_state == +1)
+      {
+	map->cells[MAP_INDEX(map, i, j)].occ_dist = 0.0;
+	cell.src_j_ = cell.j_ = j;
+	w.mark(i, j) = 1;
+	Q.push(cell);
+      }
+      else
+	map->cells[MAP_INDEX(map, i, j)].occ_dist = max_occ_dist;
+    }
+  }
+
+  while(!Q.empty())
+  {
+    CellData current_cell = Q.top();
+    int ci = current_cell.i_, cj = current_cell.j_;
+    enqueue_window(map, ci-1, cj,
+                   current_cell.src_i_, current_cell.src_j_,
+                   Q, cdm, w);
+    enqueue_window(map, ci, cj-1,
+                   current_cell.src_i_, current_cell.src_j_,
+                   Q, cdm, w);
+    enqueue_window(map, ci+1, cj,
+                   current_cell.src_i_, current_cell.src_j_,
+                   Q, cdm, w);
+    enqueue_window(map, ci, cj+1,
+                   current_cell.src_i_, current_cell.src_j_,
+                   Q, cdm, w);
+
+    Q.pop();
+  }
+
+  for(int j=w.min_j; j<=w.max_j; j++)
+    for(int i=w.min_i; i<=w.max_i; i++)
+      if(i < a_min_i || i > a_max_i || j < a_min_j || j > a_max_j)
+        map->cells[MAP_INDEX(map, i, j)].occ_dist = saved[(i - w.min_i) + (j - w.min_j) * wx];
+
+  delete[] saved;
+  delete[] w.marked;
+}
+
 #if 0
 // TODO: replace this with a more efficient implementation.  Not crucial,
 // because we only do it once, at startup.
@@ -33,7 +33,7 @@
 #include <string.h>
 
 #include <rtk.h>
-#include "amcl/map/map.h"
+#include "amcl_doris/map/map.h"
 
 
 ////////////////////////////////////////////////////////////////////////////
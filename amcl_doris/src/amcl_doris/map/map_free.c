@@ -0,0 +1,237 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+/**************************************************************************
+ * Desc: Compact index of the free cells of a map, used to draw uniform
+ *       (or weighted) pose samples in constant time.
+**************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "amcl_doris/map/map.h"
+
+
+// Build the index of free cells.  Rows are counted and filled in
+// parallel; the result is ordered by cell index.
+map_free_index_t *map_free_index_alloc(map_t *map)
+{
+  map_free_index_t *index;
+  int *row_count;
+  int j, total;
+
+  index = (map_free_index_t*) calloc(1, sizeof(map_free_index_t));
+  row_count = (int*) calloc(map->size_y + 1, sizeof(int));
+
+  // Count the free cells in each row
+  #pragma omp parallel for schedule(static)
+  for (j = 0; j < map->size_y; j++)
+  {
+    int i, n = 0;
+    for (i = 0; i < map->size_x; i++)
+      if (map->cells[MAP_INDEX(map, i, j)].occ_state == -1)
+        n++;
+    row_count[j + 1] = n;
+  }
+
+  // Row offsets
+  for (j = 0; j < map->size_y; j++)
+    row_count[j + 1] += row_count[j];
+  total = row_count[map->size_y];
+
+  index->count = total;
+  index->cells = (uint32_t*) malloc(sizeof(uint32_t) * (total > 0 ? total : 1));
+
+  // Fill in the cell indices
+  #pragma omp parallel for schedule(static)
+  for (j = 0; j < map->size_y; j++)
+  {
+    int i, k = row_count[j];
+    for (i = 0; i < map->size_x; i++)
+      if (map->cells[MAP_INDEX(map, i, j)].occ_state == -1)
+        index->cells[k++] = (uint32_t) MAP_INDEX(map, i, j);
+  }
+
+  free(row_count);
+  return index;
+}
+
+
+// Refresh the index after the occupancy of the cells in the window
+// [min_i, max_i] x [min_j, max_j] changed.  Entries outside the window
+// are merged with the free cells found inside it, keeping the order.
+// Any sampling weights are dropped.
+void map_free_index_update(map_free_index_t *index, map_t *map,
+                           int min_i, int min_j, int max_i, int max_j)
+{
+  uint32_t *box, *cells;
+  int nbox, i, j, k, n, b;
+
+  if (min_i < 0) min_i = 0;
+  if (min_j < 0) min_j = 0;
+  if (max_i > map->size_x - 1) max_i = map->size_x - 1;
+  if (max_j > map->size_y - 1) max_j = map->size_y - 1;
+  if (min_i > max_i || min_j > max_j)
+    return;
+
+  // Free cells inside the window, in index order
+  box = (uint32_t*) malloc(sizeof(uint32_t) * (max_i - min_i + 1) * (max_j - min_j + 1));
+  nbox = 0;
+  for (j = min_j; j <= max_j; j++)
+    for (i = min_i; i <= max_i; i++)
+      if (map->cells[MAP_INDEX(map, i, j)].occ_state == -1)
+        box[nbox++] = (uint32_t) MAP_INDEX(map, i, j);
+
+  // Merge with the old entries lying outside the window
+  cells = (uint32_t*) malloc(sizeof(uint32_t) * (index->count + nbox > 0 ? index->count + nbox : 1));
+  n = 0;
+  b = 0;
+  for (k = 0; k < index->count; k++)
+  {
+    uint32_t c = index->cells[k];
+    i = c % map->size_x;
+    j = c / map->size_x;
+    if (i >= min_i && i <= max_i && j >= min_j && j <= max_j)
+      continue;
+    while (b < nbox && box[b] < c)
+      cells[n++] = box[b++];
+    cells[n++] = c;
+  }
+  while (b < nbox)
+    cells[n++] = box[b++];
+
+  free(box);
+  free(index->cells);
+  index->cells = cells;
+  index->count = n;
+  map_free_index_set_weights(index, NULL);
+  return;
+}
+
+
+// Destroy the index
+void map_free_index_free(map_free_index_t *index)
+{
+  if (index == NULL)
+    return;
+  free(index->cells);
+  free(index->prob);
+  free(index->alias);
+  free(index);
+  return;
+}
+
+
+// Build the alias table (Vose's method) from one weight per free cell.
+int map_free_index_set_weights(map_free_index_t *index, const double *weights)
+{
+  int n, k, s, l;
+  int small_count, large_count;
+  int *small, *large;
+  double total;
+  double *scaled;
+
+  free(index->prob);
+  free(index->alias);
+  index->prob = NULL;
+  index->alias = NULL;
+
+  n = index->count;
+  if (weights == NULL || n == 0)
+    return 0;
+
+  total = 0.0;
+  for (k = 0; k < n; k++)
+  {
+    if (weights[k] < 0.0)
+      return -1;
+    total += weights[k];
+  }
+  if (total <= 0.0)
+    return -1;
+
+  index->prob = (double*) malloc(sizeof(double) * n);
+  index->alias = (uint32_t*) malloc(sizeof(uint32_t) * n);
+  scaled = (double*) malloc(sizeof(double) * n);
+  small = (int*) malloc(sizeof(int) * n);
+  large = (int*) malloc(sizeof(int) * n);
+
+  small_count = large_count = 0;
+  for (k = 0; k < n; k++)
+  {
+    scaled[k] = weights[k] * n / total;
+    if (scaled[k] < 1.0)
+      small[small_count++] = k;
+    else
+      large[large_count++] = k;
+  }
+
+  while (small_count > 0 && large_count > 0)
+  {
+    s = small[--small_count];
+    l = large[--large_count];
+
+    index->prob[s] = scaled[s];
+    index->alias[s] = l;
+
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+    if (scaled[l] < 1.0)
+      small[small_count++] = l;
+    else
+      large[large_count++] = l;
+  }
+
+  // Whatever is left is (up to rounding) exactly one
+  while (large_count > 0)
+  {
+    l = large[--large_count];
+    index->prob[l] = 1.0;
+    index->alias[l] = l;
+  }
+  while (small_count > 0)
+  {
+    s = small[--small_count];
+    index->prob[s] = 1.0;
+    index->alias[s] = s;
+  }
+
+  free(scaled);
+  free(small);
+  free(large);
+  return 0;
+}
+
+
+// Draw a free cell
+int map_free_index_sample(map_free_index_t *index)
+{
+  double u;
+  int k;
+
+  if (index == NULL || index->count == 0)
+    return -1;
+
+  // One uniform variate gives both the column and the coin flip
+  u = drand48() * index->count;
+  k = (int) u;
+  if (k >= index->count)
+    k = index->count - 1;
+
+  if (index->prob != NULL && (u - k) >= index->prob[k])
+    k = index->alias[k];
+
+  return (int) index->cells[k];
+}
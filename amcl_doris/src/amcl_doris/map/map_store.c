@@ -30,8 +30,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include "amcl/map/map.h"
+#include "amcl_doris/map/map.h"
 
 
 ////////////////////////////////////////////////////////////////////////////
@@ -133,6 +137,112 @@ int map_load_occ(map_t *map, const char *filename, double scale, int negate)
 }
 
 
+////////////////////////////////////////////////////////////////////////////
+// Save a map in the binary format
+int map_save_bin(map_t *map, const char *filename)
+{
+  FILE *file;
+  map_bin_header_t header;
+  size_t count;
+
+  file = fopen(filename, "wb");
+  if (file == NULL)
+  {
+    fprintf(stderr, "%s: %s\n", strerror(errno), filename);
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, MAP_BIN_MAGIC, sizeof(header.magic));
+  header.version = MAP_BIN_VERSION;
+  header.cell_size = sizeof(map_cell_t);
+  header.size_x = map->size_x;
+  header.size_y = map->size_y;
+  header.scale = map->scale;
+  header.origin_x = map->origin_x;
+  header.origin_y = map->origin_y;
+  header.max_occ_dist = map->max_occ_dist;
+
+  count = (size_t) map->size_x * map->size_y;
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fwrite(map->cells, sizeof(map_cell_t), count, file) != count)
+  {
+    fprintf(stderr, "failed to write map: %s\n", filename);
+    fclose(file);
+    return -1;
+  }
+
+  fclose(file);
+  return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Memory-map a binary map
+int map_load_bin(map_t *map, const char *filename)
+{
+  int fd;
+  struct stat st;
+  void *base;
+  map_bin_header_t *header;
+  size_t count;
+
+  if (map->cells != NULL)
+  {
+    fprintf(stderr, "map already holds data\n");
+    return -1;
+  }
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: %s\n", strerror(errno), filename);
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(map_bin_header_t))
+  {
+    fprintf(stderr, "truncated map file: %s\n", filename);
+    close(fd);
+    return -1;
+  }
+
+  // Private mapping: the distance field may be rewritten in memory
+  base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+  {
+    fprintf(stderr, "%s: %s\n", strerror(errno), filename);
+    return -1;
+  }
+
+  header = (map_bin_header_t*) base;
+  count = (size_t) header->size_x * header->size_y;
+  if (strncmp(header->magic, MAP_BIN_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != MAP_BIN_VERSION ||
+      header->cell_size != sizeof(map_cell_t) ||
+      header->size_x <= 0 || header->size_y <= 0 ||
+      (size_t) st.st_size < sizeof(map_bin_header_t) + count * sizeof(map_cell_t))
+  {
+    fprintf(stderr, "incorrect map format; must be a binary map version %d: %s\n",
+            MAP_BIN_VERSION, filename);
+    munmap(base, st.st_size);
+    return -1;
+  }
+
+  map->size_x = header->size_x;
+  map->size_y = header->size_y;
+  map->scale = header->scale;
+  map->origin_x = header->origin_x;
+  map->origin_y = header->origin_y;
+  map->max_occ_dist = header->max_occ_dist;
+  map->cells = (map_cell_t*) ((char*) base + sizeof(map_bin_header_t));
+  map->mapped = base;
+  map->mapped_size = st.st_size;
+
+  return 0;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////
 // Load a wifi signal strength map
 /*
@@ -0,0 +1,193 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+/**************************************************************************
+ * Desc: Coarse grid recording which map markers can be seen from where
+**************************************************************************/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "amcl_doris/map/map.h"
+
+// Number of viewpoints tried in each coarse cell (centre and the four
+// inner quarter points)
+#define MAP_VIS_VIEWPOINTS 5
+
+
+// Test the line of sight from (ox, oy) to (tx, ty).  Markers are usually
+// mounted on walls, so the ray may stop up to [tol] short of the target.
+static int map_visibility_ray(map_t *map, double ox, double oy,
+                              double tx, double ty, double tol)
+{
+  double d, r;
+
+  d = hypot(tx - ox, ty - oy);
+  if (d <= tol)
+    return 1;
+  r = map_calc_range(map, ox, oy, atan2(ty - oy, tx - ox), d);
+  return (r >= d - tol);
+}
+
+
+// Fill in the bitset of coarse cell k
+static void map_visibility_cell(map_visibility_t *vis, map_t *map, int k,
+                                const double *points, int points_per_marker,
+                                double max_range)
+{
+  double vx[MAP_VIS_VIEWPOINTS], vy[MAP_VIS_VIEWPOINTS];
+  double cx, cy, q, tol;
+  int nview, v, m, c, i, j;
+  uint32_t *bits;
+
+  bits = vis->bits + (size_t) k * vis->words;
+  memset(bits, 0, sizeof(uint32_t) * vis->words);
+  cx = vis->origin_x + ((k % vis->size_x) + 0.5) * vis->resolution;
+  cy = vis->origin_y + ((k / vis->size_x) + 0.5) * vis->resolution;
+  q = vis->resolution / 4;
+  tol = 2 * map->scale;
+
+  // Viewpoints in free space; particles only live there
+  nview = 0;
+  for (v = 0; v < MAP_VIS_VIEWPOINTS; v++)
+  {
+    double x = cx + (v == 1 ? -q : v == 2 ? q : 0);
+    double y = cy + (v == 3 ? -q : v == 4 ? q : 0);
+    i = MAP_GXWX(map, x);
+    j = MAP_GYWY(map, y);
+    if (MAP_VALID(map, i, j) && map->cells[MAP_INDEX(map, i, j)].occ_state == -1)
+    {
+      vx[nview] = x;
+      vy[nview] = y;
+      nview++;
+    }
+  }
+
+  // Without free space to look from, don't rule anything out
+  if (nview == 0)
+  {
+    for (m = 0; m < vis->marker_count; m++)
+      bits[m >> 5] |= (uint32_t) 1 << (m & 31);
+    return;
+  }
+
+  for (m = 0; m < vis->marker_count; m++)
+  {
+    const double *pts = points + 2 * m * points_per_marker;
+    int visible = 0;
+
+    for (v = 0; v < nview && !visible; v++)
+    {
+      for (c = 0; c < points_per_marker && !visible; c++)
+      {
+        if (hypot(pts[2*c] - vx[v], pts[2*c+1] - vy[v]) > max_range)
+          continue;
+        visible = map_visibility_ray(map, vx[v], vy[v], pts[2*c], pts[2*c+1], tol);
+      }
+    }
+    if (visible)
+      bits[m >> 5] |= (uint32_t) 1 << (m & 31);
+  }
+}
+
+
+// Build the visibility grid
+map_visibility_t *map_visibility_alloc(map_t *map, const double *points,
+                                       int marker_count, int points_per_marker,
+                                       double resolution, double max_range)
+{
+  map_visibility_t *vis;
+  int ncells, k;
+
+  vis = (map_visibility_t*) calloc(1, sizeof(map_visibility_t));
+  vis->resolution = resolution;
+  vis->origin_x = MAP_WXGX(map, 0) - map->scale / 2;
+  vis->origin_y = MAP_WYGY(map, 0) - map->scale / 2;
+  vis->size_x = (int) ceil(map->size_x * map->scale / resolution);
+  vis->size_y = (int) ceil(map->size_y * map->scale / resolution);
+  vis->marker_count = marker_count;
+  vis->words = (marker_count + 31) / 32;
+
+  ncells = vis->size_x * vis->size_y;
+  vis->bits = (uint32_t*) calloc((size_t) ncells * (vis->words > 0 ? vis->words : 1),
+                                 sizeof(uint32_t));
+
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (k = 0; k < ncells; k++)
+    map_visibility_cell(vis, map, k, points, points_per_marker, max_range);
+
+  return vis;
+}
+
+
+// Recompute the cells from which a ray of at most max_range can cross
+// the changed window
+void map_visibility_update(map_visibility_t *vis, map_t *map, const double *points,
+                           int points_per_marker, double max_range,
+                           int min_i, int min_j, int max_i, int max_j)
+{
+  int ci0, cj0, ci1, cj1, ni, k;
+  double reach;
+
+  if (vis == NULL)
+    return;
+
+  reach = max_range + map->scale;
+  ci0 = (int) floor((MAP_WXGX(map, min_i) - reach - vis->origin_x) / vis->resolution);
+  cj0 = (int) floor((MAP_WYGY(map, min_j) - reach - vis->origin_y) / vis->resolution);
+  ci1 = (int) floor((MAP_WXGX(map, max_i) + reach - vis->origin_x) / vis->resolution);
+  cj1 = (int) floor((MAP_WYGY(map, max_j) + reach - vis->origin_y) / vis->resolution);
+  if (ci0 < 0) ci0 = 0;
+  if (cj0 < 0) cj0 = 0;
+  if (ci1 > vis->size_x - 1) ci1 = vis->size_x - 1;
+  if (cj1 > vis->size_y - 1) cj1 = vis->size_y - 1;
+  if (ci0 > ci1 || cj0 > cj1)
+    return;
+
+  ni = ci1 - ci0 + 1;
+
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (k = 0; k < ni * (cj1 - cj0 + 1); k++)
+    map_visibility_cell(vis, map, (ci0 + k % ni) + (cj0 + k / ni) * vis->size_x,
+                        points, points_per_marker, max_range);
+}
+
+
+// Destroy the visibility grid
+void map_visibility_free(map_visibility_t *vis)
+{
+  if (vis == NULL)
+    return;
+  free(vis->bits);
+  free(vis);
+  return;
+}
+
+
+// Get the visibility bitset at the given world position
+const uint32_t *map_visibility_get(map_visibility_t *vis, double x, double y)
+{
+  int i, j;
+
+  if (vis == NULL)
+    return NULL;
+  i = (int) floor((x - vis->origin_x) / vis->resolution);
+  j = (int) floor((y - vis->origin_y) / vis->resolution);
+  if (i < 0 || i >= vis->size_x || j < 0 || j >= vis->size_y)
+    return NULL;
+  return vis->bits + (size_t) (i + j * vis->size_x) * vis->words;
+}
@@ -0,0 +1,173 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+/**************************************************************************
+ * Desc: Load map_server style YAML/PGM maps without a running map_server
+**************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <yaml-cpp/yaml.h>
+
+#include "amcl_doris/map/map.h"
+
+// Read a binary (P5) or plain (P2) 8-bit PGM image, top row first
+static bool read_pgm(const std::string& filename, int& width, int& height,
+                     std::vector<unsigned char>& pixels)
+{
+  std::ifstream file(filename.c_str(), std::ios::binary);
+  if(!file)
+  {
+    fprintf(stderr, "cannot open map image: %s\n", filename.c_str());
+    return false;
+  }
+
+  std::string magic;
+  file >> magic;
+  if(magic != "P5" && magic != "P2")
+  {
+    fprintf(stderr, "incorrect image format; must be PGM: %s\n", filename.c_str());
+    return false;
+  }
+
+  // Header fields, skipping comments
+  int fields[3];
+  for(int k = 0; k < 3; k++)
+  {
+    file >> std::ws;
+    while(file.peek() == '#')
+    {
+      std::string comment;
+      std::getline(file, comment);
+      file >> std::ws;
+    }
+    file >> fields[k];
+  }
+  width = fields[0];
+  height = fields[1];
+  int depth = fields[2];
+  if(!file || width <= 0 || height <= 0 || depth <= 0 || depth > 255)
+  {
+    fprintf(stderr, "failed to read image dimensions: %s\n", filename.c_str());
+    return false;
+  }
+
+  pixels.resize((size_t)width * height);
+  if(magic == "P5")
+  {
+    file.get();
+    file.read((char*)&pixels[0], pixels.size());
+  }
+  else
+  {
+    for(size_t k = 0; k < pixels.size(); k++)
+    {
+      int value;
+      file >> value;
+      pixels[k] = (unsigned char)value;
+    }
+  }
+  if(!file)
+  {
+    fprintf(stderr, "truncated map image: %s\n", filename.c_str());
+    return false;
+  }
+
+  // Rescale to 0..255 as map_server does
+  if(depth != 255)
+    for(size_t k = 0; k < pixels.size(); k++)
+      pixels[k] = (unsigned char)(pixels[k] * 255 / depth);
+
+  return true;
+}
+
+int map_load_yaml(map_t *map, const char *filename)
+{
+  std::string image;
+  double resolution, occupied_thresh, free_thresh;
+  double origin[2];
+  int negate;
+
+  try
+  {
+    YAML::Node doc = YAML::LoadFile(filename);
+    image = doc["image"].as<std::string>();
+    resolution = doc["resolution"].as<double>();
+    origin[0] = doc["origin"][0].as<double>();
+    origin[1] = doc["origin"][1].as<double>();
+    negate = doc["negate"].as<int>();
+    occupied_thresh = doc["occupied_thresh"].as<double>();
+    free_thresh = doc["free_thresh"].as<double>();
+  }
+  catch(YAML::Exception& e)
+  {
+    fprintf(stderr, "failed to parse map description %s: %s\n", filename, e.what());
+    return -1;
+  }
+
+  // Relative image paths are relative to the YAML file
+  if(image.empty())
+    return -1;
+  if(image[0] != '/')
+  {
+    std::string path(filename);
+    size_t slash = path.rfind('/');
+    if(slash != std::string::npos)
+      image = path.substr(0, slash + 1) + image;
+  }
+
+  int width, height;
+  std::vector<unsigned char> pixels;
+  if(!read_pgm(image, width, height, pixels))
+    return -1;
+
+  if(map->cells != NULL)
+    map_free_cells(map);
+  map->size_x = width;
+  map->size_y = height;
+  map->scale = resolution;
+  map->origin_x = origin[0] + (map->size_x / 2) * map->scale;
+  map->origin_y = origin[1] + (map->size_y / 2) * map->scale;
+  map->max_occ_dist = 0;
+  map->cells = (map_cell_t*)calloc((size_t)width * height, sizeof(map_cell_t));
+
+  // Trinary interpretation, as in map_server; the image is stored top row
+  // first while the map grows upwards
+  for(int row = 0; row < height; row++)
+  {
+    for(int i = 0; i < width; i++)
+    {
+      double value = pixels[(size_t)row * width + i];
+      if(negate)
+        value = 255 - value;
+      double occ = (255 - value) / 255.0;
+
+      map_cell_t *cell = map->cells + MAP_INDEX(map, i, height - row - 1);
+      if(occ > occupied_thresh)
+        cell->occ_state = +1;
+      else if(occ < free_thresh)
+        cell->occ_state = -1;
+      else
+        cell->occ_state = 0;
+    }
+  }
+
+  return 0;
+}
@@ -30,15 +30,18 @@
 #include <stdlib.h>
 #include <time.h>
 
-#include "amcl/pf/pf.h"
-#include "amcl/pf/pf_pdf.h"
-#include "amcl/pf/pf_kdtree.h"
+#include "amcl_doris/pf/pf.h"
+#include "amcl_doris/pf/pf_pdf.h"
+#include "amcl_doris/pf/pf_kdtree.h"
 
 
 // Compute the required number of samples, given that there are k bins
 // with samples in them.
 static int pf_resample_limit(pf_t *pf, int k);
 
+// Seed of new filters; negative to use the clock
+static long pf_alloc_seed = -1;
+
 
 
 // Create a new filter
@@ -51,7 +54,7 @@ pf_t *pf_alloc(int min_samples, int max_samples,
   pf_sample_set_t *set;
   pf_sample_t *sample;
 
-  srand48(time(NULL));
+  srand48(pf_alloc_seed < 0 ? time(NULL) : pf_alloc_seed);
 
   pf = calloc(1, sizeof(pf_t));
 
@@ -110,6 +113,14 @@ pf_t *pf_alloc(int min_samples, int max_samples,
   return pf;
 }
 
+// Seed the random generator
+void pf_seed(long seed)
+{
+  pf_alloc_seed = seed;
+  srand48(seed);
+}
+
+
 // Free an existing filter
 void pf_free(pf_t *pf)
 {
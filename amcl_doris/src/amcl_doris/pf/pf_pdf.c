@@ -32,7 +32,7 @@
 //#include <gsl/gsl_rng.h>
 //#include <gsl/gsl_randist.h>
 
-#include "amcl/pf/pf_pdf.h"
+#include "amcl_doris/pf/pf_pdf.h"
 
 // Random number generator seed value
 static unsigned int pf_pdf_seed;
@@ -145,6 +145,45 @@ double pf_ran_gaussian(double sigma)
   return(sigma * x2 * sqrt(-2.0*log(w)/w));
 }
 
+// Seed an independent generator from the main one
+void pf_ran_seed(unsigned short state[3])
+{
+  int i;
+  for (i = 0; i < 3; i++)
+    state[i] = (unsigned short) (drand48() * 65536.0);
+  return;
+}
+
+// Fill z with n standard normal variates
+void pf_ran_gaussian_fill(unsigned short state[3], double *z, int n)
+{
+  int i, pairs;
+  double last[2];
+
+  // Uniforms in (0, 1] for the radius and [0, 1) for the angle
+  pairs = n / 2;
+  for (i = 0; i < 2 * pairs; i++)
+    z[i] = (i % 2 == 0) ? 1.0 - erand48(state) : erand48(state);
+
+  #pragma omp simd
+  for (i = 0; i < pairs; i++)
+  {
+    double r = sqrt(-2.0 * log(z[2*i]));
+    double t = 2 * M_PI * z[2*i+1];
+    z[2*i] = r * cos(t);
+    z[2*i+1] = r * sin(t);
+  }
+
+  // Odd count
+  if (n % 2)
+  {
+    last[0] = 1.0 - erand48(state);
+    last[1] = erand48(state);
+    z[n-1] = sqrt(-2.0 * log(last[0])) * cos(2 * M_PI * last[1]);
+  }
+  return;
+}
+
 #if 0
 
 /**************************************************************************
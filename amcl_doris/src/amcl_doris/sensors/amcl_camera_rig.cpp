@@ -0,0 +1,198 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+///////////////////////////////////////////////////////////////////////////
+//
+// Desc: Rig of pinhole cameras stitched side by side in one image
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <algorithm>
+
+#include "amcl_doris/sensors/amcl_camera_rig.h"
+
+using namespace amcl;
+
+// Azimuth of the optical axis of a camera, in [0, 2pi)
+static double axis_azimuth(const tf::Transform& pose)
+{
+  tf::Vector3 axis = pose.getBasis() * tf::Vector3(0, 0, 1);
+  double a = atan2(axis.x(), axis.z());
+  return a < 0 ? a + 2*M_PI : a;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Default constructor
+AMCLCameraRig::AMCLCameraRig()
+{
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Remove all cameras
+void AMCLCameraRig::Clear()
+{
+  this->mats.clear();
+  this->inv.clear();
+  this->centers.clear();
+  this->center_u.clear();
+  this->azimuth.clear();
+  this->table.clear();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Add a camera
+void AMCLCameraRig::AddCamera(const tf::Transform& pose, const double P[12], double u_offset)
+{
+  // Rig frame to camera frame
+  tf::Transform inv = pose.inverse();
+  const tf::Matrix3x3& R = inv.getBasis();
+  const tf::Vector3& t = inv.getOrigin();
+  double E[12] = { R[0][0], R[0][1], R[0][2], t.x(),
+                   R[1][0], R[1][1], R[1][2], t.y(),
+                   R[2][0], R[2][1], R[2][2], t.z() };
+
+  // M = P * E, with the slice offset folded into the first row
+  double M[12];
+  for(int r = 0; r < 3; r++)
+  {
+    for(int c = 0; c < 4; c++)
+    {
+      M[4*r+c] = P[4*r+0]*E[c] + P[4*r+1]*E[4+c] + P[4*r+2]*E[8+c];
+      if(c == 3)
+        M[4*r+c] += P[4*r+3];
+    }
+  }
+  for(int c = 0; c < 4; c++)
+    M[c] += u_offset * M[8+c];
+
+  this->mats.insert(this->mats.end(), M, M + 12);
+  this->azimuth.push_back(axis_azimuth(pose));
+
+  // Back projection of pixels; M*[p;1] = w*[u;v;1] with w > 0 in front
+  // of the camera, so the ray of (u, v) is A^-1 [u;v;1] from the centre
+  tf::Matrix3x3 A(M[0], M[1], M[2], M[4], M[5], M[6], M[8], M[9], M[10]);
+  tf::Matrix3x3 Ai = A.inverse();
+  for(int r = 0; r < 3; r++)
+    for(int c = 0; c < 3; c++)
+      this->inv.push_back(Ai[r][c]);
+  tf::Vector3 center = -(Ai * tf::Vector3(M[3], M[7], M[11]));
+  this->centers.push_back(center.x());
+  this->centers.push_back(center.y());
+  this->centers.push_back(center.z());
+
+  tf::Vector3 p = center + pose.getBasis() * tf::Vector3(0, 0, 1);
+  double w = M[8]*p.x() + M[9]*p.y() + M[10]*p.z() + M[11];
+  this->center_u.push_back((M[0]*p.x() + M[1]*p.y() + M[2]*p.z() + M[3]) / w);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Default slice offset of a camera
+double AMCLCameraRig::DefaultOffset(const tf::Transform& pose, int count, double image_width)
+{
+  double a = axis_azimuth(pose);
+  if(a > M_PI)
+    a -= 2*M_PI;
+  return floor(a / (2*M_PI / count) + 0.5) * image_width / count;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Build the camera selection table
+void AMCLCameraRig::Compile()
+{
+  this->table.assign(CAMERA_RIG_BINS, 0);
+  for(int b = 0; b < CAMERA_RIG_BINS; b++)
+  {
+    double a = (b + 0.5) * 2*M_PI / CAMERA_RIG_BINS;
+    double best = HUGE_VAL;
+    for(size_t k = 0; k < this->azimuth.size(); k++)
+    {
+      double d = fabs(a - this->azimuth[k]);
+      d = std::min(d, 2*M_PI - d);
+      if(d < best)
+      {
+        best = d;
+        this->table[b] = k;
+      }
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Camera that projects a point
+int AMCLCameraRig::Select(double x, double z) const
+{
+  double a = atan2(x, z);
+  if(a < 0)
+    a += 2*M_PI;
+  int b = (int)(a * (CAMERA_RIG_BINS / (2*M_PI)));
+  if(b >= CAMERA_RIG_BINS)
+    b = CAMERA_RIG_BINS - 1;
+  return this->table[b];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Project a batch of points
+void AMCLCameraRig::Project(const double* x, const double* y, const double* z, int n,
+                            double* u, double* v) const
+{
+  for(int i = 0; i < n; i++)
+  {
+    const double* M = &this->mats[12 * this->Select(x[i], z[i])];
+    double w = M[8]*x[i] + M[9]*y[i] + M[10]*z[i] + M[11];
+    u[i] = (M[0]*x[i] + M[1]*y[i] + M[2]*z[i] + M[3]) / w;
+    v[i] = (M[4]*x[i] + M[5]*y[i] + M[6]*z[i] + M[7]) / w;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Point in front of its camera
+bool AMCLCameraRig::InFront(double x, double y, double z) const
+{
+  const double* M = &this->mats[12 * this->Select(x, z)];
+  return M[8]*x + M[9]*y + M[10]*z + M[11] > 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Bearing of a pixel
+void AMCLCameraRig::Unproject(double u, double v, double b[3], double o[3]) const
+{
+  int k = 0;
+  for(size_t i = 1; i < this->center_u.size(); i++)
+    if(fabs(u - this->center_u[i]) < fabs(u - this->center_u[k]))
+      k = i;
+
+  const double* A = &this->inv[9 * k];
+  double x = A[0]*u + A[1]*v + A[2];
+  double y = A[3]*u + A[4]*v + A[5];
+  double z = A[6]*u + A[7]*v + A[8];
+  double norm = sqrt(x*x + y*y + z*z);
+  b[0] = x / norm;
+  b[1] = y / norm;
+  b[2] = z / norm;
+  o[0] = this->centers[3*k + 0];
+  o[1] = this->centers[3*k + 1];
+  o[2] = this->centers[3*k + 2];
+}
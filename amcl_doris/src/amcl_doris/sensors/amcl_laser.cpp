@@ -99,7 +99,10 @@ AMCLLaser::SetModelLikelihoodField(double z_hit,
   this->sigma_hit = sigma_hit;
   this->laser_coeff=laser_coeff;
 
-  map_update_cspace(this->map, max_occ_dist);
+  // Maps loaded with a stored distance field (or shared with a previous
+  // laser) don't need the transform again
+  if(this->map->max_occ_dist != max_occ_dist)
+    map_update_cspace(this->map, max_occ_dist);
 }
 
 void 
@@ -120,7 +123,10 @@ AMCLLaser::SetModelLikelihoodFieldProb(double z_hit,
   this->beam_skip_distance = beam_skip_distance;
   this->beam_skip_threshold = beam_skip_threshold;
   this->beam_skip_error_threshold = beam_skip_error_threshold;
-  map_update_cspace(this->map, max_occ_dist);
+  // Maps loaded with a stored distance field (or shared with a previous
+  // laser) don't need the transform again
+  if(this->map->max_occ_dist != max_occ_dist)
+    map_update_cspace(this->map, max_occ_dist);
 }
 
 
@@ -145,6 +151,22 @@ bool AMCLLaser::UpdateSensor(pf_t *pf, AMCLSensorData *data)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Apply the configured model to the sample weights
+double AMCLLaser::Weight(AMCLSensorData *data, pf_sample_set_t *set)
+{
+  if (this->max_beams < 2)
+    return AMCLSensor::Weight(data, set);
+
+  if(this->model_type == LASER_MODEL_LIKELIHOOD_FIELD)
+    return LikelihoodFieldModel((AMCLLaserData*) data, set);
+  else if(this->model_type == LASER_MODEL_LIKELIHOOD_FIELD_PROB)
+    return LikelihoodFieldModelProb((AMCLLaserData*) data, set);
+  else
+    return BeamModel((AMCLLaserData*) data, set);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Determine the probability for the given pose
 double AMCLLaser::BeamModel(AMCLLaserData *data, pf_sample_set_t* set)
@@ -33,6 +33,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <vector>
+#include <algorithm>
 
 #include "amcl_doris/sensors/amcl_marker.h"
 
@@ -45,7 +46,11 @@ AMCLMarker::AMCLMarker(int simulation) : AMCLSensor()
 {
 
   this->simulation=simulation;
-  this->LoadCameraInfo();
+  this->map=NULL;
+  this->visibility=NULL;
+  this->bin_evaluation=false;
+  this->miss_prob=1.0;
+  this->LoadCameraExtrinsics();
 
 
   return;
@@ -75,6 +80,20 @@ AMCLMarker::SetModelLikelihoodField(double z_hit,
   this->marker_coeff=marker_coeff;
 }
 
+void
+AMCLMarker::SetModelBearing(double z_rand, double landa)
+{
+  this->model_type = MARKER_MODEL_BEARING;
+  this->z_rand = z_rand;
+  this->landa=landa;
+}
+
+void
+AMCLMarker::SetMissModel(double miss_prob)
+{
+  this->miss_prob=miss_prob;
+}
+
 
 
 
@@ -88,12 +107,22 @@ AMCLMarker::SetModelLikelihoodField(double z_hit,
 bool AMCLMarker::UpdateSensor(pf_t *pf, AMCLSensorData *data)
 {
   // Apply the camera sensor model
- if(this->model_type == MARKER_MODEL_LIKELIHOOD)
-     cout<<"llego"<<endl;
-    pf_update_sensor(pf, (pf_sensor_model_fn_t) ObservationLikelihood, data);
+  pf_update_sensor(pf, (pf_sensor_model_fn_t) ObservationLikelihood, data);
   return true;
 }
 
+/**
+ * @brief AMCLMarker::Weight apply the marker model to the sample weights,
+ * for updates that fuse several sensors
+ * @param data : detected markers
+ * @param set : set of samples
+ * @return total weight of sample set
+ */
+double AMCLMarker::Weight(AMCLSensorData *data, pf_sample_set_t *set)
+{
+  return ObservationLikelihood((AMCLMarkerData*) data, set);
+}
+
 
 
 /**
@@ -101,296 +130,809 @@ bool AMCLMarker::UpdateSensor(pf_t *pf, AMCLSensorData *data)
  * @param data: detected markers
  * @param set: set of samples
  * @return total weight of sample set
+ *
+ * Particles are split in blocks of MARKER_BLOCK that are weighted in
+ * parallel; each block goes through all the detections, so a particle's
+ * weight is always accumulated in the same order.
  */
 double AMCLMarker::ObservationLikelihood(AMCLMarkerData *data, pf_sample_set_t* set)
 {
-  //Initializing parameters
   AMCLMarker *self;
-  pf_sample_t *sample;
-  pf_vector_t pose;
-  pf_vector_t hit;
-  double total_weight;
-  double pz,p;
-  std::vector<float> z;
   self = (AMCLMarker*) data->sensor;
   std::vector<Marcador> observation=data->markers_obs;
-  total_weight = 0.0;
-  int i;
-  std::vector<Marcador> detected_from_map;
-  float gaussian_norm=1/(sqrt(2*M_PI*self->sigma_hit*self->sigma_hit));
-  //Find detected markers in the map
-  for(int k=0;k<observation.size();k++){
-        for (int j=0; j<self->map.size();j++){
 
-            if(self->map[j].getMarkerID()==observation[k].getMarkerID() && self->map[j].getSectorID()==observation[k].getSectorID() && self->map[j].getMapID()==observation[k].getMapID()){
-                detected_from_map.push_back(self->map[j]);
-                cout<<observation[k].getMarkerID()<<endl;
-            }
+  //Find detected markers in the map; unknown ones are dropped
+  std::vector<int> detected_index;
+  std::vector<std::vector<cv::Point2f> > detected;
+  for(int k=0;k<observation.size();k++){
+        int m=-1;
+        if(self->map!=NULL)
+            m=self->map->Find(observation[k].getMapID(),observation[k].getSectorID(),observation[k].getMarkerID());
+        if(m<0)
+            continue;
+        detected_index.push_back(m);
+        detected.push_back(observation[k].getMarkerPoints());
+  }
 
-        }
+  //Without cameras in the rig nothing can be projected
+  if(self->simulation == 1 && self->rig.Size() == 0){
+      detected_index.clear();
+      detected.clear();
   }
-  cout<<"llego"<<endl;
-  cout<<detected_from_map.size()<<endl;
-  for (i=0;i< set->sample_count; i++){
-      sample=set-> samples + i;
-      pose = sample->pose;
-      p=1.0;
-
-      //Initialize parameters
-      double z_hit_denom = 2 * self->sigma_hit * self->sigma_hit;
-      //sqrt(2) beacuse of the normalization with height and width of image.
-      double z_rand_mult=1.0/sqrt(2);
-
-
-      geometry_msgs::Pose sample_pose;
-      tf::Quaternion quat;
-      geometry_msgs::Quaternion quat_msg;
-      sample_pose.position.x=pose.v[0];
-      sample_pose.position.y=pose.v[1];
-      sample_pose.position.z=0.0;
-
-      pose.v[2]=fmod(pose.v[2],2*M_PI);
-      if (pose.v[2]<0){
-          pose.v[2]=pose.v[2]+2*M_PI;
-      }
-      quat.setRPY(0,0,pose.v[2]);
-      tf::quaternionTFToMsg(quat,quat_msg);
-      sample_pose.orientation=quat_msg;
-
-      for (int j=0;j<observation.size();j++){
-
-          //Calculate projection of marker corners
-           std::vector<geometry_msgs::Point> relative_to_cam=self->CalculateRelativePose(detected_from_map[j],sample_pose);
-           std::vector<cv::Point2d> projection;
-
-           //Porject points to image
-           if (self->simulation == 1){
-                projection=self->projectPoints(relative_to_cam);
-           }
-           if(self->simulation == 0){
-               cout<<"aqui1"<<endl;
-               std::vector<cv::Point3f>rel;
-               for (int k=0; k< relative_to_cam.size(); k++){
-                    cv::Point3d Coord;
-                    Coord.x=relative_to_cam[k].x;
-                    Coord.y=relative_to_cam[k].y;
-                    Coord.z=relative_to_cam[k].z;
-                    rel.push_back(Coord);
-               }
-               std::vector<cv::Point2f> imagePoints;
-               cv::Mat rvec(3,1,cv::DataType<double>::type);
-               cv::Mat tvec(3,1,cv::DataType<double>::type);
-               rvec.at<double>(0)=0.0;
-               rvec.at<double>(1)=0.0;
-               rvec.at<double>(2)=0.0;
-               tvec.at<double>(0)=0.0;
-               tvec.at<double>(1)=0.0;
-               tvec.at<double>(2)=0.0;
-
-                cv::omnidir::projectPoints(rel,imagePoints,rvec,tvec,self->camMatrix,self->xi,self->distCoeff);
-                for(int i=0; i<imagePoints.size();i++){
-                    projection.push_back( cv::Point2d( (double)imagePoints[i].x, (double)imagePoints[i].y  ) );
-                }
-           }
 
-            //Caculate error
-            std::vector<cv::Point2f> Puntos=observation[j].getMarkerPoints();
-            z=self->calculateError(observation[j].getMarkerPoints(),projection);
-            float ztot=std::accumulate(z.begin(), z.end(), 0.0);
+  //Markers that may still count as missed
+  std::vector<unsigned char> seen;
+  bool negative=self->MissModel();
+  if(negative){
+      seen.assign(self->map->Size(),0);
+      for (int j=0;j<detected_index.size();j++)
+          seen[detected_index[j]]=1;
+  }
 
-            //Calculate weight
-            pz=0.0;
-            pz+=self->landa*exp(-self->landa*ztot);
-            p+=pz*pz*pz;
+  //Particles sharing a pose bin are projected once
+  if(self->bin_evaluation && self->model_type == MARKER_MODEL_LIKELIHOOD && set->kdtree != NULL)
+      return self->BinnedLikelihood(set,detected_index,detected,seen);
+
+  //Bearing model: the detections are unprojected once and each particle
+  //is scored by the angles to the corners it expects
+  std::vector<double> bearing(3*MARKER_CORNERS*detected.size());
+  std::vector<double> origin(3*MARKER_CORNERS*detected.size());
+  if(self->model_type == MARKER_MODEL_BEARING){
+      for (int j=0;j<detected.size();j++)
+          self->ObservedBearings(detected[j],&bearing[3*MARKER_CORNERS*j],&origin[3*MARKER_CORNERS*j]);
+  }
 
+  self->LoadPoses(set);
+  int n=set->sample_count;
+  int blocks=(n+MARKER_BLOCK-1)/MARKER_BLOCK;
+  std::vector<double> block_weight(blocks,0.0);
+
+  #pragma omp parallel for schedule(static)
+  for (int b=0;b<blocks;b++){
+      int begin=b*MARKER_BLOCK;
+      int end=std::min(n,begin+MARKER_BLOCK);
+
+      //Accumulated weight and markers in line of sight
+      double p_sample[MARKER_BLOCK];
+      const uint32_t* visible[MARKER_BLOCK];
+      for (int i=begin;i<end;i++){
+          p_sample[i-begin]=1.0;
+          visible[i-begin]=map_visibility_get(self->visibility,self->pose_x[i],self->pose_y[i]);
       }
 
-      //Updating particle
-      sample->weight *= p;
-      total_weight += sample->weight;
+      for (int j=0;j<detected.size();j++){
+          int m=detected_index[j];
+
+          //Corners of this marker in the camera frame of every particle of
+          //the block, projected at once
+          if(self->model_type == MARKER_MODEL_LIKELIHOOD){
+              self->TransformCorners(m,begin,end);
+              int k=MARKER_CORNERS*begin;
+              if(self->simulation == 0){
+                  self->omni.Project(&self->cam_x[k],&self->cam_y[k],&self->cam_z[k],
+                                     MARKER_CORNERS*(end-begin),
+                                     &self->img_u[k],&self->img_v[k]);
+              }
+              if(self->simulation == 1){
+                  self->rig.Project(&self->cam_x[k],&self->cam_y[k],&self->cam_z[k],
+                                    MARKER_CORNERS*(end-begin),
+                                    &self->img_u[k],&self->img_v[k]);
+              }
+          }
+
+          for (int i=begin;i<end;i++){
+              double pz;
+              //A marker that can't be seen from here only gets the random
+              //component
+              if(visible[i-begin]!=NULL && !MAP_VISIBLE(visible[i-begin],m)){
+                  pz=self->z_rand;
+              }else{
+                  double ztot;
+                  //A full turn weighs as much as the image width does in
+                  //the projection model
+                  if(self->model_type == MARKER_MODEL_BEARING)
+                      ztot=self->BearingError(&bearing[3*MARKER_CORNERS*j],&origin[3*MARKER_CORNERS*j],m,i)/(2*M_PI);
+                  else
+                      ztot=self->ProjectionError(detected[j],&self->img_u[MARKER_CORNERS*i],
+                                                 &self->img_v[MARKER_CORNERS*i]);
+                  pz=self->landa*exp(-self->landa*ztot);
+              }
+              p_sample[i-begin]+=pz*pz*pz;
+          }
+      }
 
+      //Expected markers that weren't detected
+      if(negative){
+          for (int i=begin;i<end;i++)
+              p_sample[i-begin]*=self->MissFactor(self->pose_x[i],self->pose_y[i],self->pose_cos[i],
+                                                  self->pose_sin[i],visible[i-begin],seen);
+      }
 
+      //Updating particles
+      double w=0.0;
+      for (int i=begin;i<end;i++){
+          pf_sample_t *sample=set->samples+i;
+          sample->weight*=p_sample[i-begin];
+          w+=sample->weight;
+      }
+      block_weight[b]=w;
   }
+
+  //Summed in block order so the total doesn't depend on the threads
+  double total_weight=0.0;
+  for (int b=0;b<blocks;b++)
+      total_weight+=block_weight[b];
   return(total_weight);
+}
+
+
+// Pose bin of a particle
+struct MarkerBin
+{
+  int key[3];
+  int index;
+};
+
+static bool marker_bin_less(const MarkerBin& a, const MarkerBin& b)
+{
+  for (int d=0;d<3;d++){
+      if(a.key[d]!=b.key[d])
+          return a.key[d]<b.key[d];
   }
+  return a.index<b.index;
+}
+
+static bool marker_bin_same(const MarkerBin& a, const MarkerBin& b)
+{
+  return a.key[0]==b.key[0] && a.key[1]==b.key[1] && a.key[2]==b.key[2];
+}
+
+/**
+ * @brief AMCLMarker::BinnedLikelihood projection likelihood evaluated once
+ * per occupied pose bin (the kd-tree cells of the sample set).  Each marker
+ * is projected at the mean pose of the bin and at that pose nudged along
+ * x, y and yaw; every particle of the bin gets the corners moved by the
+ * resulting Jacobian times its offset from the mean.  Bins with a single
+ * particle are projected exactly.
+ * @param set : set of samples
+ * @param detected_index : markers of the map that were detected
+ * @param detected : their corners in the image
+ * @param seen : detected flag of each map marker, empty without the miss
+ * model
+ * @return total weight of sample set
+ */
+double AMCLMarker::BinnedLikelihood(pf_sample_set_t* set, const std::vector<int>& detected_index,
+                                    const std::vector<std::vector<cv::Point2f> >& detected,
+                                    const std::vector<unsigned char>& seen){
+    int n=set->sample_count;
+    const double *size=set->kdtree->size;
+    const double step[3]={1e-3,1e-3,1e-3};
+
+    //Bin of each particle, as pf_kdtree_insert computes it
+    std::vector<MarkerBin> order(n);
+    for (int i=0;i<n;i++){
+        const pf_vector_t &pose=set->samples[i].pose;
+        for (int d=0;d<3;d++)
+            order[i].key[d]=floor(pose.v[d]/size[d]);
+        order[i].index=i;
+    }
+    std::sort(order.begin(),order.end(),marker_bin_less);
+
+    //Poses to project: the mean of each bin, followed by the mean nudged
+    //along x, y and yaw when the bin has more than one particle
+    std::vector<pf_vector_t> eval;
+    std::vector<int> eval_of(n);
+    std::vector<pf_vector_t> offset(n);
+    std::vector<unsigned char> linear(n);
+    for (int g=0;g<n;){
+        int h=g+1;
+        while(h<n && marker_bin_same(order[g],order[h]))
+            h++;
+        const pf_vector_t &first=set->samples[order[g].index].pose;
+        pf_vector_t mean=pf_vector_zero();
+        for (int k=g;k<h;k++){
+            const pf_vector_t &pose=set->samples[order[k].index].pose;
+            mean.v[0]+=pose.v[0];
+            mean.v[1]+=pose.v[1];
+            mean.v[2]+=atan2(sin(pose.v[2]-first.v[2]),cos(pose.v[2]-first.v[2]));
+        }
+        for (int d=0;d<3;d++)
+            mean.v[d]/=(h-g);
+        mean.v[2]+=first.v[2];
+
+        int e=eval.size();
+        eval.push_back(mean);
+        if(h-g>1){
+            for (int d=0;d<3;d++){
+                pf_vector_t nudged=mean;
+                nudged.v[d]+=step[d];
+                eval.push_back(nudged);
+            }
+        }
+        for (int k=g;k<h;k++){
+            int i=order[k].index;
+            const pf_vector_t &pose=set->samples[i].pose;
+            eval_of[i]=e;
+            linear[i]=(h-g>1);
+            offset[i].v[0]=pose.v[0]-mean.v[0];
+            offset[i].v[1]=pose.v[1]-mean.v[1];
+            offset[i].v[2]=atan2(sin(pose.v[2]-mean.v[2]),cos(pose.v[2]-mean.v[2]));
+        }
+        g=h;
+    }
+
+    this->LoadPoses(eval);
+    int ne=eval.size();
+    int eval_blocks=(ne+MARKER_BLOCK-1)/MARKER_BLOCK;
+
+    std::vector<double> p_sample(n,1.0);
+    std::vector<const uint32_t*> visible(n);
+    for (int i=0;i<n;i++){
+        const pf_vector_t &pose=set->samples[i].pose;
+        visible[i]=map_visibility_get(this->visibility,pose.v[0],pose.v[1]);
+    }
+
+    for (int j=0;j<detected.size();j++){
+        int m=detected_index[j];
+
+        #pragma omp parallel for schedule(static)
+        for (int b=0;b<eval_blocks;b++){
+            int begin=b*MARKER_BLOCK;
+            int end=std::min(ne,begin+MARKER_BLOCK);
+            int k=MARKER_CORNERS*begin;
+            this->TransformCorners(m,begin,end);
+            if(this->simulation == 0)
+                this->omni.Project(&cam_x[k],&cam_y[k],&cam_z[k],MARKER_CORNERS*(end-begin),&img_u[k],&img_v[k]);
+            else
+                this->rig.Project(&cam_x[k],&cam_y[k],&cam_z[k],MARKER_CORNERS*(end-begin),&img_u[k],&img_v[k]);
+        }
+
+        #pragma omp parallel for schedule(static)
+        for (int i=0;i<n;i++){
+            double pz;
+            if(visible[i]!=NULL && !MAP_VISIBLE(visible[i],m)){
+                pz=this->z_rand;
+            }else{
+                const double *u0=&img_u[MARKER_CORNERS*eval_of[i]];
+                const double *v0=&img_v[MARKER_CORNERS*eval_of[i]];
+                double u[MARKER_CORNERS],v[MARKER_CORNERS];
+                for (int c=0;c<MARKER_CORNERS;c++){
+                    u[c]=u0[c];
+                    v[c]=v0[c];
+                    if(!linear[i])
+                        continue;
+                    for (int d=0;d<3;d++){
+                        double s=offset[i].v[d]/step[d];
+                        u[c]+=(u0[MARKER_CORNERS*(d+1)+c]-u0[c])*s;
+                        v[c]+=(v0[MARKER_CORNERS*(d+1)+c]-v0[c])*s;
+                    }
+                }
+                double ztot=this->ProjectionError(detected[j],u,v);
+                pz=this->landa*exp(-this->landa*ztot);
+            }
+            p_sample[i]+=pz*pz*pz;
+        }
+    }
+
+    //The miss model is cheap enough to run on every particle
+    if(!seen.empty()){
+        #pragma omp parallel for schedule(static)
+        for (int i=0;i<n;i++){
+            const pf_vector_t &pose=set->samples[i].pose;
+            p_sample[i]*=this->MissFactor(pose.v[0],pose.v[1],cos(pose.v[2]),sin(pose.v[2]),visible[i],seen);
+        }
+    }
+
+    //Updating particles, summed in block order as in ObservationLikelihood
+    int blocks=(n+MARKER_BLOCK-1)/MARKER_BLOCK;
+    double total_weight=0.0;
+    for (int b=0;b<blocks;b++){
+        double w=0.0;
+        for (int i=b*MARKER_BLOCK;i<std::min(n,(b+1)*MARKER_BLOCK);i++){
+            pf_sample_t *sample=set->samples+i;
+            sample->weight*=p_sample[i];
+            w+=sample->weight;
+        }
+        total_weight+=w;
+    }
+    return(total_weight);
+}
+
+
+/**
+ * @brief AMCLMarker::MissModel whether negative information is used; it
+ * needs a miss probability below 1, the position index of the marker map
+ * and something to project with
+ */
+bool AMCLMarker::MissModel(void) const{
+    if(this->miss_prob>=1.0 || this->map==NULL || this->map->IndexRange()<=0.0)
+        return false;
+    return !(this->simulation==1 && this->rig.Size()==0);
+}
 
+/**
+ * @brief AMCLMarker::MissFactor weight factor for the markers that a
+ * particle should see but weren't detected.  Only the markers that the
+ * index lists near the particle are checked, so the cost per particle is
+ * bounded by MARKER_MISS_MARKERS.  The map doesn't say which face of a
+ * marker is printed, so back faces are left to the line of sight test.
+ * @param x, y, co, si : particle position and cosine and sine of its yaw
+ * @param visible : visibility bitset at the particle, NULL if unknown
+ * @param seen : detected flag of each map marker
+ * @return miss_prob to the number of missed markers
+ */
+double AMCLMarker::MissFactor(double x, double y, double co, double si,
+                              const uint32_t* visible, const std::vector<unsigned char>& seen) const{
+    int count;
+    const int32_t *near=this->map->Near(x,y,&count);
+    double range=this->map->IndexRange();
+    //Camera position in the world
+    double camx=x+co*cam_origin[0]-si*cam_origin[1];
+    double camy=y+si*cam_origin[0]+co*cam_origin[1];
+    double factor=1.0;
+    for (int k=0;k<count;k++){
+        int m=near[k];
+        if(seen[m] || (visible!=NULL && !MAP_VISIBLE(visible,m)))
+            continue;
+        double dx=this->map->CenterX()[m]-x;
+        double dy=this->map->CenterY()[m]-y;
+        if(dx*dx+dy*dy>range*range)
+            continue;
+        //Not seen edge on
+        double vx=camx-this->map->CenterX()[m];
+        double vy=camy-this->map->CenterY()[m];
+        double vz=cam_origin[2]-this->map->CenterZ()[m];
+        double d=sqrt(vx*vx+vy*vy+vz*vz);
+        double facing=vx*this->map->NormalX()[m]+vy*this->map->NormalY()[m]+vz*this->map->NormalZ()[m];
+        if(fabs(facing)<MARKER_MISS_MIN_COS*d)
+            continue;
+        if(this->InImage(m,x,y,co,si))
+            factor*=this->miss_prob;
+    }
+    return factor;
+}
+
+/**
+ * @brief AMCLMarker::InImage whether all corners of a map marker project
+ * well inside the image from a pose.  Same transform as TransformCorners,
+ * for one pose and without touching the shared buffers.
+ * @param marker : index of the marker in the marker map
+ * @param x, y, co, si : robot position and cosine and sine of its yaw
+ */
+bool AMCLMarker::InImage(int marker, double x, double y, double co, double si) const{
+    const double *wx=&this->map->CornerX()[MARKER_CORNERS*marker];
+    const double *wy=&this->map->CornerY()[MARKER_CORNERS*marker];
+    const double *wz=&this->map->CornerZ()[MARKER_CORNERS*marker];
+    const double *R=cam_rot;
+    double X[MARKER_CORNERS],Y[MARKER_CORNERS],Z[MARKER_CORNERS];
+    double u[MARKER_CORNERS],v[MARKER_CORNERS];
+    for (int c=0;c<MARKER_CORNERS;c++){
+        double dx=wx[c]-x;
+        double dy=wy[c]-y;
+        double rx=co*dx+si*dy-cam_origin[0];
+        double ry=-si*dx+co*dy-cam_origin[1];
+        double dz=wz[c]-cam_origin[2];
+        X[c]=R[0]*rx+R[1]*ry+R[2]*dz;
+        Y[c]=R[3]*rx+R[4]*ry+R[5]*dz;
+        Z[c]=R[6]*rx+R[7]*ry+R[8]*dz;
+        bool front=(this->simulation==0) ? omni.InFront(X[c],Y[c],Z[c]) : rig.InFront(X[c],Y[c],Z[c]);
+        if(!front)
+            return false;
+    }
+    if (this->simulation==0)
+        omni.Project(X,Y,Z,MARKER_CORNERS,u,v);
+    else
+        rig.Project(X,Y,Z,MARKER_CORNERS,u,v);
+    for (int c=0;c<MARKER_CORNERS;c++){
+        if(!(u[c]>=MARKER_MISS_MARGIN && u[c]<image_width-MARKER_MISS_MARGIN &&
+             v[c]>=MARKER_MISS_MARGIN && v[c]<image_height-MARKER_MISS_MARGIN))
+            return false;
+    }
+    return true;
+}
 
 /**
- * @brief AMCLMarker::calculateError
+ * @brief AMCLMarker::ProjectionError
  * @param projection_detected : corners of detected markers
- * @param projection_map: reference corners present in the map
- * @return error between detected and the projection of saved markers
+ * @param u, v : projection of the map marker, one entry per corner
+ * @return error between detected and the projection of saved markers,
+ * summed over the corners
  */
-std::vector<float> AMCLMarker::calculateError(std::vector<cv::Point2f> projection_detected, std::vector<cv::Point2d> projection_map){
-    std::vector<float> errorv;
-    for (int i=0;i<4;i++){
-        float errorx,errory;
-        float error=0.0;
-        errorx=abs(projection_map[i].x-projection_detected[i].x)/image_width;
-        errory=abs(projection_map[i].y-projection_detected[i].y)/image_height;
+double AMCLMarker::ProjectionError(const std::vector<cv::Point2f>& projection_detected,
+                                   const double* u, const double* v){
+    double error=0.0;
+    for (int i=0;i<MARKER_CORNERS;i++){
+        double errorx,errory;
+        errorx=(u[i]-projection_detected[i].x)/image_width;
+        errory=(v[i]-projection_detected[i].y)/image_height;
         error+=sqrt((errorx*errorx)+(errory*errory));
-        errorv.push_back(error);
     }
-    return errorv;
+    return error;
 
 }
 
 /**
- * @brief AMCLMarker::projectPoints
- * @param cam_center_coord
- * @return projection of the given marker's corners into the camera image.
+ * @brief AMCLMarker::ObservedBearings rays of the detected corners in the
+ * robot frame
+ * @param corners : corners of the detected marker in the image
+ * @param bearing : unit direction of each corner (3 per corner)
+ * @param origin : centre of the camera that saw each corner (3 per corner)
  */
-std::vector<cv::Point2d> AMCLMarker::projectPoints(std::vector<geometry_msgs::Point> cam_center_coord){
-   geometry_msgs::PointStamped cam_center_coord_st,cam_trans_coord_st;
-    std::vector<cv::Point2d> Pixels;
-    for (int i=0;i<cam_center_coord.size();i++){
-         cam_center_coord_st.point=cam_center_coord[i];
-    float angulo;
-    angulo = atan2(double(cam_center_coord[i].x),double(cam_center_coord[i].z));
-    angulo=fmod(angulo,2*M_PI);
-    if (angulo<0){
-            angulo=angulo+(2*M_PI);
-        }
-    cv::Point2d Pixel,offset;
-    offset.x=image_width/num_cam;
-    offset.y=0;
-    cv::Point3d Coord;
-    if (angulo>M_PI and angulo<5.2333333){
-           //camera2
-            tf2::doTransform(cam_center_coord_st,cam_trans_coord_st,tf_cameras[1]);
-            Coord.x=cam_trans_coord_st.point.x;
-            Coord.y=cam_trans_coord_st.point.y;
-            Coord.z=cam_trans_coord_st.point.z;
-            Pixel=this->pin_model.project3dToPixel(Coord);
-            Pixel=Pixel-offset;
-
-        }else{
-            //CAM3
-            if(angulo>M_PI/3 and angulo<M_PI){
-                tf2::doTransform(cam_center_coord_st,cam_trans_coord_st,tf_cameras[2]);
-                Coord.x=cam_trans_coord_st.point.x;
-                Coord.y=cam_trans_coord_st.point.y;
-                Coord.z=cam_trans_coord_st.point.z;
-                Pixel=this->pin_model.project3dToPixel(Coord);
-                Pixel=Pixel+offset;
-                }else{//CAM1
-                tf2::doTransform(cam_center_coord_st,cam_trans_coord_st,tf_cameras[0]);
-                Coord.x=cam_trans_coord_st.point.x;
-                Coord.y=cam_trans_coord_st.point.y;
-                Coord.z=cam_trans_coord_st.point.z;
-                Pixel=this->pin_model.project3dToPixel(Coord);
-                }
+void AMCLMarker::ObservedBearings(const std::vector<cv::Point2f>& corners,
+                                  double* bearing, double* origin){
+    const double *R=cam_rot;
+    for (int c=0;c<MARKER_CORNERS;c++){
+        double b[3]={0,0,1},o[3]={0,0,0};
+        if (this->simulation==0)
+            omni.Unproject(corners[c].x,corners[c].y,b);
+        else
+            rig.Unproject(corners[c].x,corners[c].y,b,o);
+        //p_robot = cam_rot^T * p_cam + cam_origin
+        for (int r=0;r<3;r++){
+            bearing[3*c+r]=R[r]*b[0]+R[3+r]*b[1]+R[6+r]*b[2];
+            origin[3*c+r]=R[r]*o[0]+R[3+r]*o[1]+R[6+r]*o[2]+cam_origin[r];
         }
-     Pixels.push_back(Pixel);
+    }
+}
+
+/**
+ * @brief AMCLMarker::BearingError angle between the observed rays and the
+ * corners of a map marker seen from a particle, summed over the corners.
+ * Only the planar world to robot transform is done per particle.
+ * @param bearing, origin : observed rays, from ObservedBearings
+ * @param marker : index of the marker in the marker map
+ * @param particle : particle, as loaded by LoadPoses
+ * @return error in radians
+ */
+double AMCLMarker::BearingError(const double* bearing, const double* origin,
+                                int marker, int particle){
+    const double *wx=&this->map->CornerX()[MARKER_CORNERS*marker];
+    const double *wy=&this->map->CornerY()[MARKER_CORNERS*marker];
+    const double *wz=&this->map->CornerZ()[MARKER_CORNERS*marker];
+    double co=pose_cos[particle];
+    double si=pose_sin[particle];
+    double error=0.0;
+    for (int c=0;c<MARKER_CORNERS;c++){
+        double dx=wx[c]-pose_x[particle];
+        double dy=wy[c]-pose_y[particle];
+        const double *o=&origin[3*c];
+        const double *b=&bearing[3*c];
+        double ex=co*dx+si*dy-o[0];
+        double ey=-si*dx+co*dy-o[1];
+        double ez=wz[c]-o[2];
+        double cx=ey*b[2]-ez*b[1];
+        double cy=ez*b[0]-ex*b[2];
+        double cz=ex*b[1]-ey*b[0];
+        error+=atan2(sqrt(cx*cx+cy*cy+cz*cz),ex*b[0]+ey*b[1]+ez*b[2]);
+    }
+    return error;
+}
+
+// Planar pose taking the robot frame points p onto the world points q,
+// least squares (2D Procrustes)
+static pf_vector_t fit_planar_pose(const std::vector<double>& p, const std::vector<double>& q)
+{
+  int n=p.size()/2;
+  double pmx=0,pmy=0,qmx=0,qmy=0;
+  for (int i=0;i<n;i++){
+      pmx+=p[2*i]/n;
+      pmy+=p[2*i+1]/n;
+      qmx+=q[2*i]/n;
+      qmy+=q[2*i+1]/n;
+  }
+  double dot=0,cross=0;
+  for (int i=0;i<n;i++){
+      double px=p[2*i]-pmx,py=p[2*i+1]-pmy;
+      double qx=q[2*i]-qmx,qy=q[2*i+1]-qmy;
+      dot+=px*qx+py*qy;
+      cross+=px*qy-py*qx;
+  }
+  pf_vector_t pose=pf_vector_zero();
+  pose.v[2]=atan2(cross,dot);
+  pose.v[0]=qmx-(cos(pose.v[2])*pmx-sin(pose.v[2])*pmy);
+  pose.v[1]=qmy-(sin(pose.v[2])*pmx+cos(pose.v[2])*pmy);
+  return pose;
+}
+
+/**
+ * @brief AMCLMarker::PoseHypotheses robot poses recovered from the
+ * detections, for sensor resetting
+ * @param observation : detected markers
+ * @param hypotheses : poses that reproduce the observed corner rays
+ */
+void AMCLMarker::PoseHypotheses(std::vector<Marcador>& observation,
+                                std::vector<marker_hypothesis_t>& hypotheses){
+    hypotheses.clear();
+    if(this->map==NULL || (this->simulation==1 && this->rig.Size()==0))
+        return;
+
+    std::vector<int> markers;
+    std::vector<double> bearing,origin;
+    std::vector<double> robot_all,world_all;
+    for (int k=0;k<observation.size();k++){
+        int m=this->map->Find(observation[k].getMapID(),observation[k].getSectorID(),observation[k].getMarkerID());
+        if(m<0)
+            continue;
+        std::vector<cv::Point2f> corners=observation[k].getMarkerPoints();
+        if(corners.size()<MARKER_CORNERS)
+            continue;
+        std::vector<double> b(3*MARKER_CORNERS),o(3*MARKER_CORNERS);
+        this->ObservedBearings(corners,&b[0],&o[0]);
+
+        std::vector<double> robot_xy,world_xy;
+        if(this->EdgePoints(m,&b[0],&o[0],robot_xy,world_xy)<2)
+            continue;
+        std::vector<int> one(1,m);
+        marker_hypothesis_t h;
+        h.pose=fit_planar_pose(robot_xy,world_xy);
+        h.pivot_x=this->map->CenterX()[m];
+        h.pivot_y=this->map->CenterY()[m];
+        h.single=true;
+        if(this->CheckHypothesis(h.pose,one,b,o))
+            hypotheses.push_back(h);
+
+        markers.push_back(m);
+        bearing.insert(bearing.end(),b.begin(),b.end());
+        origin.insert(origin.end(),o.begin(),o.end());
+        robot_all.insert(robot_all.end(),robot_xy.begin(),robot_xy.end());
+        world_all.insert(world_all.end(),world_xy.begin(),world_xy.end());
+    }
+
+    //All the markers together pin down the viewing angle
+    if(markers.size()>1){
+        marker_hypothesis_t h;
+        h.pose=fit_planar_pose(robot_all,world_all);
+        h.pivot_x=h.pose.v[0];
+        h.pivot_y=h.pose.v[1];
+        h.single=false;
+        if(this->CheckHypothesis(h.pose,markers,bearing,origin))
+            hypotheses.push_back(h);
+    }
+}
+
+/**
+ * @brief AMCLMarker::EdgePoints range the vertical edges of a marker.
+ * Each corner is paired with the corner horizontally closest to it in the
+ * map; if they are one above the other, the difference of the tangents of
+ * their elevations gives the horizontal distance to the edge.
+ * @param marker : index of the marker in the marker map
+ * @param bearing, origin : observed rays of its corners, from
+ * ObservedBearings
+ * @param robot_xy : edge positions in the robot frame (2 per edge)
+ * @param world_xy : the same edges in the map (2 per edge)
+ * @return number of edges found
+ */
+int AMCLMarker::EdgePoints(int marker, const double* bearing, const double* origin,
+                           std::vector<double>& robot_xy, std::vector<double>& world_xy) const{
+    const double *wx=&this->map->CornerX()[MARKER_CORNERS*marker];
+    const double *wy=&this->map->CornerY()[MARKER_CORNERS*marker];
+    const double *wz=&this->map->CornerZ()[MARKER_CORNERS*marker];
+    int edges=0;
+    bool used[MARKER_CORNERS]={false};
+    for (int c=0;c<MARKER_CORNERS;c++){
+        if(used[c])
+            continue;
+        int k=-1;
+        double best=HUGE_VAL;
+        for (int j=0;j<MARKER_CORNERS;j++){
+            double d=hypot(wx[j]-wx[c],wy[j]-wy[c]);
+            if(j!=c && !used[j] && d<best){
+                best=d;
+                k=j;
+            }
         }
-    return Pixels;
+        if(k<0)
+            continue;
+        //Not an upright edge
+        double dz=wz[c]-wz[k];
+        if(fabs(dz)<=2*best)
+            continue;
+        const double *bc=&bearing[3*c],*bk=&bearing[3*k];
+        double hc=hypot(bc[0],bc[1]),hk=hypot(bk[0],bk[1]);
+        if(hc<=0 || hk<=0)
+            continue;
+        double dt=bc[2]/hc-bk[2]/hk;
+        double d=(dz-(origin[3*c+2]-origin[3*k+2]))/dt;
+        if(!(d>0) || std::isinf(d))
+            continue;
+        used[c]=used[k]=true;
+        robot_xy.push_back((origin[3*c]+origin[3*k])/2+d*(bc[0]/hc+bk[0]/hk)/2);
+        robot_xy.push_back((origin[3*c+1]+origin[3*k+1])/2+d*(bc[1]/hc+bk[1]/hk)/2);
+        world_xy.push_back((wx[c]+wx[k])/2);
+        world_xy.push_back((wy[c]+wy[k])/2);
+        edges++;
+    }
+    return edges;
+}
 
+/**
+ * @brief AMCLMarker::CheckHypothesis compare a pose with the observed rays
+ * @param pose : robot pose
+ * @param markers : map markers the rays belong to
+ * @param bearing, origin : their rays, MARKER_CORNERS per marker
+ * @return true if the mean angle per corner is below
+ * MARKER_HYPOTHESIS_MAX_ERROR
+ */
+bool AMCLMarker::CheckHypothesis(const pf_vector_t& pose, const std::vector<int>& markers,
+                                 const std::vector<double>& bearing, const std::vector<double>& origin){
+    this->LoadPoses(std::vector<pf_vector_t>(1,pose));
+    double error=0.0;
+    for (int j=0;j<markers.size();j++)
+        error+=this->BearingError(&bearing[3*MARKER_CORNERS*j],&origin[3*MARKER_CORNERS*j],markers[j],0);
+    return error<MARKER_HYPOTHESIS_MAX_ERROR*MARKER_CORNERS*markers.size();
+}
+
+/**
+ * @brief AMCLMarker::ExpectedCorners projection of a map marker
+ * @param pose : robot pose
+ * @param marker : index of the marker in the marker map
+ * @param corners : image points of its corners
+ */
+void AMCLMarker::ExpectedCorners(const pf_vector_t& pose, int marker,
+                                 std::vector<cv::Point2f>& corners){
+    this->LoadPoses(std::vector<pf_vector_t>(1,pose));
+    this->TransformCorners(marker,0,1);
+    if (this->simulation==0)
+        omni.Project(&cam_x[0],&cam_y[0],&cam_z[0],MARKER_CORNERS,&img_u[0],&img_v[0]);
+    else
+        rig.Project(&cam_x[0],&cam_y[0],&cam_z[0],MARKER_CORNERS,&img_u[0],&img_v[0]);
+    corners.resize(MARKER_CORNERS);
+    for (int c=0;c<MARKER_CORNERS;c++)
+        corners[c]=cv::Point2f(img_u[c],img_v[c]);
 }
 
 /**
- * @brief AMCLMarker::LoadCameraInfo loading camera parameters
+ * @brief AMCLMarker::SetCalibration take the camera intrinsics; the
+ * bearing table of the omnidirectional camera is built here, once
+ * @param calibration : calibration loaded from file
  */
-void AMCLMarker::LoadCameraInfo(void){
-
-    //Simulated Camera Parameters
-    sensor_msgs::CameraInfo cam_inf_ed;
-    cam_inf_ed.header.frame_id="Cam1";
-    cam_inf_ed.height=679;
-    cam_inf_ed.width=604;
-    cam_inf_ed.distortion_model="plumb_bob";
-    double Da[5]={-0.2601958609577983, 0.05505240192232372, 0.0, -0.0045449850126361765, 0.0};
-    boost::array<double, 9ul> K={ {174.746839097, 0.0, 906.0, 0.0, 174.746839097, 339.5, 0.0, 0.0, 1.0} } ;
-    boost::array<double, 9ul> R={ {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0} };
-    boost::array<double, 12ul> P={ {174.64077512103418, 0.0, 906.0, 0.0, 0.0, 174.64077512103418, 339.5, 0.0, 0.0, 0.0, 1.0, 0.0} };
-    std::vector<double> D(Da,Da +(sizeof(Da)/sizeof(Da[0])));
-    cam_inf_ed.D=D;
-    cam_inf_ed.K=K;
-    cam_inf_ed.R=R;
-    cam_inf_ed.P=P;
-    cam_inf_ed.binning_x=0.0;
-    cam_inf_ed.binning_y=0.0;
-    cam_inf_ed.roi.height=0;
-    cam_inf_ed.roi.width=0;
-
-    //Real omnicamera parameters
-    camMatrix = cv::Mat(3, 3, CV_32F);
-    camMatrix.at<float>(0, 0) = 8.5101024687735935e+02;
-    camMatrix.at<float>(0, 1) = -2.2255059056366439e-01;
-    camMatrix.at<float>(0, 2) = 6.5571465382877625e+02;
-    camMatrix.at<float>(1, 0) = 0.0;
-    camMatrix.at<float>(1, 1) = 8.5170243585411265e+02;
-    camMatrix.at<float>(1, 2) = 5.1216084358475405e+02;
-    camMatrix.at<float>(2, 0) = 0.0;
-    camMatrix.at<float>(2, 1) = 0.0;
-    camMatrix.at<float>(2, 2) = 1.0;
-
-    distCoeff = cv::Mat(4, 1, CV_32F);
-    distCoeff.at<float>(0, 0) = -4.2648301140911193e-01;
-    distCoeff.at<float>(1, 0) = 3.1105618959437248e-01;
-    distCoeff.at<float>(2, 0) = -1.3775384616268102e-02;
-    distCoeff.at<float>(3, 0) = -1.9560559208606078e-03;
-
-    xi=1.5861076761699640e+00;
-
-    this->pin_model.fromCameraInfo(cam_inf_ed);
+void AMCLMarker::SetCalibration(const CameraCalibration& calibration){
+    if (calibration.omni){
+        omni.SetIntrinsics(calibration.cameraMatrix(),calibration.xi,calibration.distortion());
+        omni.BuildBearingTable(calibration.info.width,calibration.info.height,MARKER_BEARING_TABLE_STEP);
+    }else{
+        this->pin_model.fromCameraInfo(calibration.info);
+    }
+}
 
+/**
+ * @brief AMCLMarker::SetCameraRig build the simulated camera rig
+ * @param cameras : pose of each camera relative to the camera link
+ * @param u_offsets : horizontal offset of each camera in the stitched
+ * image; NaN for the default
+ */
+void AMCLMarker::SetCameraRig(const std::vector<geometry_msgs::Pose>& cameras, const std::vector<double>& u_offsets){
+    //All cameras share the simulated pinhole model
+    cv::Matx34d P=this->pin_model.projectionMatrix();
+    rig.Clear();
+    for (int i=0;i<cameras.size();i++){
+        tf::Transform pose;
+        tf::poseMsgToTF(cameras[i],pose);
+        double offset=AMCLCameraRig::DefaultOffset(pose,cameras.size(),image_width);
+        if (i<u_offsets.size() && !std::isnan(u_offsets[i]))
+            offset=u_offsets[i];
+        rig.AddCamera(pose,P.val,offset);
+    }
+    rig.Compile();
 }
 
 /**
- * @brief AMCLMarker::CalculateRelativePose
- * @param Marca : object of class marcador
- * @param CamaraMundo : pose of camera in world frame
- * @return pose of corners in camera frame.
+ * @brief AMCLMarker::LoadCameraExtrinsics built-in pose of the camera in
+ * the robot frame for each mode
  */
-std::vector<geometry_msgs::Point> AMCLMarker::CalculateRelativePose (Marcador Marca, geometry_msgs::Pose CamaraMundo){
-    //Pose CAM;
-    tf::Transform MundTrob, invMundTrob,RobTCam,invRobotTCam;
+void AMCLMarker::LoadCameraExtrinsics(void){
     tf::Quaternion RotCam;
-    //From Robot base to camera
-   if (this->simulation==1){
-     RotCam.setRPY(-M_PI/2,0,-M_PI/2);
-     RobTCam.setOrigin(tf::Vector3(0,0,1.3925));
-   }
-    if (this->simulation == 0)
-
-    {
+    tf::Vector3 origin;
+    if (this->simulation==1){
+        RotCam.setRPY(-M_PI/2,0,-M_PI/2);
+        origin=tf::Vector3(0,0,1.3925);
+    }else{
         RotCam.setRPY(0,0,-M_PI/2+M_PI);
-        RobTCam.setOrigin(tf::Vector3(-0.26,0,1.415));
+        origin=tf::Vector3(-0.26,0,1.415);
     }
-    RobTCam.setRotation(RotCam);
-    tf::Quaternion QMundRCam (CamaraMundo.orientation.x,CamaraMundo.orientation.y,CamaraMundo.orientation.z,CamaraMundo.orientation.w);
-    tf::Vector3 Trasl1 (CamaraMundo.position.x,CamaraMundo.position.y,CamaraMundo.position.z);
-
-    //From World to Robot
-    MundTrob.setRotation(QMundRCam);
-    MundTrob.setOrigin(Trasl1);
-
-    //Inverse the transformation--> inverse form world to camera.
-    invRobotTCam=RobTCam.inverse();
-    invMundTrob = MundTrob.inverse();
-    geometry_msgs::TransformStamped MundTrobSt, RobotTCamSt;
-    MundTrobSt.header.frame_id="ground_plane__link";
-    MundTrobSt.child_frame_id="EstimatedPose";
-    RobotTCamSt.header.frame_id="EstimatedPose";
-    RobotTCamSt.child_frame_id="camera_link";
-    transformTFToMsg(MundTrob,MundTrobSt.transform);
-    transformTFToMsg(RobTCam,RobotTCamSt.transform);
-
-    //Pose Transformation
-    geometry_msgs::TransformStamped invMundTrobStamped,invRobotTCamSt;
-    transformTFToMsg(invMundTrob,invMundTrobStamped.transform);
-    transformTFToMsg(invRobotTCam,invRobotTCamSt.transform);
-    std::vector<geometry_msgs::Point> RelativaCorners,PoseWorld;
-    PoseWorld=Marca.getPoseWorld();
-    for (int i=0;i<4;i++){
-            geometry_msgs::PointStamped CornerRelPose,Inter,WorldPose;
-            WorldPose.point=PoseWorld[i];
-             tf2::doTransform(WorldPose,Inter,invMundTrobStamped);
-             tf2::doTransform(Inter,CornerRelPose,invRobotTCamSt);
-             RelativaCorners.push_back(CornerRelPose.point);
+    this->SetCameraExtrinsics(tf::Transform(RotCam,origin));
+}
 
+/**
+ * @brief AMCLMarker::SetCameraExtrinsics pose of the camera in the robot
+ * frame; stored as the rotation from robot to camera axes and the camera
+ * origin, so that p_cam = cam_rot * (p_robot - cam_origin).
+ * @param robot_to_camera : camera frame (z forward, x right, y down)
+ * relative to the robot
+ */
+void AMCLMarker::SetCameraExtrinsics(const tf::Transform& robot_to_camera){
+    const tf::Matrix3x3 &RobRCam=robot_to_camera.getBasis();
+    const tf::Vector3 &origin=robot_to_camera.getOrigin();
+    for (int r=0;r<3;r++){
+        for (int c=0;c<3;c++){
+            cam_rot[3*r+c]=RobRCam[c][r];
         }
-    return RelativaCorners;
+        cam_origin[r]=origin[r];
+    }
 }
 
+/**
+ * @brief AMCLMarker::LoadPoses copy poses into pose_x, pose_y, pose_cos
+ * and pose_sin, and size the per corner buffers
+ * @param set : set of samples
+ */
+void AMCLMarker::LoadPoses(pf_sample_set_t* set){
+    this->ReservePoses(set->sample_count);
+    for (int i=0;i<set->sample_count;i++){
+        const pf_vector_t &pose=set->samples[i].pose;
+        pose_x[i]=pose.v[0];
+        pose_y[i]=pose.v[1];
+        pose_cos[i]=cos(pose.v[2]);
+        pose_sin[i]=sin(pose.v[2]);
+    }
+}
 
+void AMCLMarker::LoadPoses(const std::vector<pf_vector_t>& poses){
+    this->ReservePoses(poses.size());
+    for (size_t i=0;i<poses.size();i++){
+        pose_x[i]=poses[i].v[0];
+        pose_y[i]=poses[i].v[1];
+        pose_cos[i]=cos(poses[i].v[2]);
+        pose_sin[i]=sin(poses[i].v[2]);
+    }
+}
+
+void AMCLMarker::ReservePoses(size_t n){
+    if (pose_x.size()<n){
+        pose_x.resize(n);
+        pose_y.resize(n);
+        pose_cos.resize(n);
+        pose_sin.resize(n);
+    }
+    if (cam_x.size()<MARKER_CORNERS*n){
+        cam_x.resize(MARKER_CORNERS*n);
+        cam_y.resize(MARKER_CORNERS*n);
+        cam_z.resize(MARKER_CORNERS*n);
+        img_u.resize(MARKER_CORNERS*n);
+        img_v.resize(MARKER_CORNERS*n);
+    }
+}
+
+/**
+ * @brief AMCLMarker::TransformCorners corners of a map marker in the
+ * camera frame of a range of particles.  The robot moves on the floor
+ * plane, so the world to robot transform is a rotation about z and a
+ * translation.
+ * @param marker : index of the marker in the marker map
+ * @param begin, end : particles, as loaded by LoadPoses
+ * Results go to cam_x/cam_y/cam_z, entry MARKER_CORNERS*particle+corner.
+ */
+void AMCLMarker::TransformCorners(int marker, int begin, int end){
+    const double *wx=&this->map->CornerX()[MARKER_CORNERS*marker];
+    const double *wy=&this->map->CornerY()[MARKER_CORNERS*marker];
+    const double *wz=&this->map->CornerZ()[MARKER_CORNERS*marker];
+    const double *R=cam_rot;
+    const double *px=&pose_x[0];
+    const double *py=&pose_y[0];
+    const double *pc=&pose_cos[0];
+    const double *ps=&pose_sin[0];
+    double *X=&cam_x[0];
+    double *Y=&cam_y[0];
+    double *Z=&cam_z[0];
+    double ox=cam_origin[0];
+    double oy=cam_origin[1];
+
+    for (int c=0;c<MARKER_CORNERS;c++){
+        //Height above the camera does not depend on the particle
+        double dz=wz[c]-cam_origin[2];
+        double mx=wx[c];
+        double my=wy[c];
+        #pragma omp simd
+        for (int i=begin;i<end;i++){
+            double dx=mx-px[i];
+            double dy=my-py[i];
+            //World to robot, then relative to the camera origin
+            double rx=pc[i]*dx+ps[i]*dy-ox;
+            double ry=-ps[i]*dx+pc[i]*dy-oy;
+            int k=MARKER_CORNERS*i+c;
+            X[k]=R[0]*rx+R[1]*ry+R[2]*dz;
+            Y[k]=R[3]*rx+R[4]*ry+R[5]*dz;
+            Z[k]=R[6]*rx+R[7]*ry+R[8]*dz;
+        }
+    }
+}
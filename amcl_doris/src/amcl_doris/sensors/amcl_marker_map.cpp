@@ -0,0 +1,194 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+///////////////////////////////////////////////////////////////////////////
+//
+// Desc: Flat lookup table of the marker map, for data association
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <algorithm>
+#include <utility>
+
+#include "amcl_doris/sensors/amcl_marker_map.h"
+
+using namespace amcl;
+
+////////////////////////////////////////////////////////////////////////////////
+// Default constructor
+AMCLMarkerMap::AMCLMarkerMap() : count(0), index(MARKER_KEY_COUNT, -1),
+  index_range(0.0), index_resolution(0.0), index_origin_x(0.0), index_origin_y(0.0),
+  index_size_x(0), index_size_y(0), index_max(0)
+{
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Pack the IDs of a marker into its key
+int AMCLMarkerMap::Key(int map, int sector, int id)
+{
+  const int limit = 1 << MARKER_ID_BITS;
+  if(map < 0 || map >= limit || sector < 0 || sector >= limit || id < 0 || id >= limit)
+    return -1;
+  return (map << (2 * MARKER_ID_BITS)) | (sector << MARKER_ID_BITS) | id;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Build the table
+int AMCLMarkerMap::Build(std::vector<Marcador>& markers)
+{
+  int unreachable = 0;
+
+  this->count = markers.size();
+  this->index.assign(MARKER_KEY_COUNT, -1);
+  this->keys.resize(this->count);
+  this->corner_x.assign(MARKER_CORNERS * this->count, 0.0);
+  this->corner_y.assign(MARKER_CORNERS * this->count, 0.0);
+  this->corner_z.assign(MARKER_CORNERS * this->count, 0.0);
+  this->center_x.assign(this->count, 0.0);
+  this->center_y.assign(this->count, 0.0);
+  this->center_z.assign(this->count, 0.0);
+  this->normal_x.assign(this->count, 0.0);
+  this->normal_y.assign(this->count, 0.0);
+  this->normal_z.assign(this->count, 0.0);
+
+  // A new map invalidates the position index
+  this->index_range = 0.0;
+  this->index_size_x = this->index_size_y = 0;
+  this->near.clear();
+  this->near_count.clear();
+
+  for(int m = 0; m < this->count; m++)
+  {
+    std::vector<geometry_msgs::Point> corners = markers[m].getPoseWorld();
+    for(int c = 0; c < MARKER_CORNERS && c < (int)corners.size(); c++)
+    {
+      this->corner_x[MARKER_CORNERS * m + c] = corners[c].x;
+      this->corner_y[MARKER_CORNERS * m + c] = corners[c].y;
+      this->corner_z[MARKER_CORNERS * m + c] = corners[c].z;
+    }
+
+    const double *x = &this->corner_x[MARKER_CORNERS * m];
+    const double *y = &this->corner_y[MARKER_CORNERS * m];
+    const double *z = &this->corner_z[MARKER_CORNERS * m];
+    for(int c = 0; c < MARKER_CORNERS; c++)
+    {
+      this->center_x[m] += x[c] / MARKER_CORNERS;
+      this->center_y[m] += y[c] / MARKER_CORNERS;
+      this->center_z[m] += z[c] / MARKER_CORNERS;
+    }
+    double ax = x[1] - x[0], ay = y[1] - y[0], az = z[1] - z[0];
+    double bx = x[MARKER_CORNERS-1] - x[0], by = y[MARKER_CORNERS-1] - y[0], bz = z[MARKER_CORNERS-1] - z[0];
+    double nx = ay*bz - az*by, ny = az*bx - ax*bz, nz = ax*by - ay*bx;
+    double norm = sqrt(nx*nx + ny*ny + nz*nz);
+    if(norm > 0)
+    {
+      this->normal_x[m] = nx / norm;
+      this->normal_y[m] = ny / norm;
+      this->normal_z[m] = nz / norm;
+    }
+
+    int key = Key(markers[m].getMapID(), markers[m].getSectorID(), markers[m].getMarkerID());
+    this->keys[m] = key;
+    if(key < 0 || this->index[key] >= 0)
+      unreachable++;
+    else
+      this->index[key] = m;
+  }
+
+  return unreachable;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Build the position index
+void AMCLMarkerMap::BuildIndex(double range, double resolution, int max_markers)
+{
+  this->index_range = 0.0;
+  this->index_size_x = this->index_size_y = 0;
+  this->near.clear();
+  this->near_count.clear();
+  if(this->count == 0 || range <= 0 || resolution <= 0 || max_markers <= 0)
+    return;
+
+  // Grid over the marker centres grown by the range
+  double min_x = this->center_x[0], max_x = min_x;
+  double min_y = this->center_y[0], max_y = min_y;
+  for(int m = 1; m < this->count; m++)
+  {
+    min_x = std::min(min_x, this->center_x[m]);
+    max_x = std::max(max_x, this->center_x[m]);
+    min_y = std::min(min_y, this->center_y[m]);
+    max_y = std::max(max_y, this->center_y[m]);
+  }
+  this->index_range = range;
+  this->index_resolution = resolution;
+  this->index_origin_x = min_x - range;
+  this->index_origin_y = min_y - range;
+  this->index_size_x = (int) ceil((max_x - min_x + 2 * range) / resolution) + 1;
+  this->index_size_y = (int) ceil((max_y - min_y + 2 * range) / resolution) + 1;
+  this->index_max = max_markers;
+  this->near.assign((size_t) this->index_size_x * this->index_size_y * max_markers, -1);
+  this->near_count.assign((size_t) this->index_size_x * this->index_size_y, 0);
+
+  std::vector<std::pair<double, int> > found;
+  for(int j = 0; j < this->index_size_y; j++)
+  {
+    for(int i = 0; i < this->index_size_x; i++)
+    {
+      double x0 = this->index_origin_x + i * resolution;
+      double y0 = this->index_origin_y + j * resolution;
+      double cx = x0 + resolution / 2, cy = y0 + resolution / 2;
+
+      found.clear();
+      for(int m = 0; m < this->count; m++)
+      {
+        // Distance from the cell to the marker
+        double dx = std::max(0.0, std::max(x0 - this->center_x[m], this->center_x[m] - x0 - resolution));
+        double dy = std::max(0.0, std::max(y0 - this->center_y[m], this->center_y[m] - y0 - resolution));
+        if(dx*dx + dy*dy > range*range)
+          continue;
+        found.push_back(std::make_pair(hypot(this->center_x[m] - cx, this->center_y[m] - cy), m));
+      }
+      std::sort(found.begin(), found.end());
+
+      int k = j * this->index_size_x + i;
+      int n = std::min((int) found.size(), max_markers);
+      for(int f = 0; f < n; f++)
+        this->near[(size_t) k * max_markers + f] = found[f].second;
+      this->near_count[k] = n;
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Markers near a position
+const int32_t *AMCLMarkerMap::Near(double x, double y, int *count) const
+{
+  *count = 0;
+  if(this->near_count.empty())
+    return NULL;
+  int i = (int) floor((x - this->index_origin_x) / this->index_resolution);
+  int j = (int) floor((y - this->index_origin_y) / this->index_resolution);
+  if(i < 0 || i >= this->index_size_x || j < 0 || j >= this->index_size_y)
+    return NULL;
+  int k = j * this->index_size_x + i;
+  *count = this->near_count[k];
+  return &this->near[(size_t) k * this->index_max];
+}
@@ -28,6 +28,7 @@
 ///////////////////////////////////////////////////////////////////////////
 
 #include <algorithm>
+#include <vector>
 
 #include <sys/types.h> // required by Darwin
 #include <math.h>
@@ -62,6 +63,7 @@ angle_diff(double a, double b)
 AMCLOdom::AMCLOdom() : AMCLSensor()
 {
   this->time = 0.0;
+  this->parallel = false;
 }
 
 void
@@ -108,8 +110,22 @@ AMCLOdom::SetModel( odom_model_t type,
   this->alpha5 = alpha5;
 }
 
+// Wrap an angle difference to [-pi, pi); angle_diff() without the
+// trigonometry, for the per particle loops
+static inline double
+wrap(double d)
+{
+  return d - 2*M_PI*floor((d + M_PI) / (2*M_PI));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Apply the action model
+//
+// Everything that depends only on the odometry delta is computed once.
+// Particles are then moved in blocks of ODOM_BLOCK: each block has its own
+// random generator, seeded in order from the main one, draws all its
+// normal variates at once and updates poses copied into one array per
+// component.  Blocks can run on several threads with the same result.
 bool AMCLOdom::UpdateAction(pf_t *pf, AMCLSensorData *data)
 {
   AMCLOdomData *ndata;
@@ -121,64 +137,27 @@ bool AMCLOdom::UpdateAction(pf_t *pf, AMCLSensorData *data)
   set = pf->sets + pf->current_set;
   pf_vector_t old_pose = pf_vector_sub(ndata->pose, ndata->delta);
 
-  switch( this->model_type )
-  {
-  case ODOM_MODEL_OMNI:
-  {
-    double delta_trans, delta_rot, delta_bearing;
-    double delta_trans_hat, delta_rot_hat, delta_strafe_hat;
+  // Mean motion and deviation of its three noise terms: rot1, trans and
+  // rot2 for the diff models, trans, rot and strafe for the omni ones
+  bool diff = (this->model_type == ODOM_MODEL_DIFF ||
+               this->model_type == ODOM_MODEL_DIFF_CORRECTED);
+  double delta_trans = sqrt(ndata->delta.v[0]*ndata->delta.v[0] +
+                            ndata->delta.v[1]*ndata->delta.v[1]);
+  double delta_rot1 = 0.0, delta_rot2 = 0.0, delta_rot = 0.0, delta_bearing = 0.0;
+  double stddev[3];
 
-    delta_trans = sqrt(ndata->delta.v[0]*ndata->delta.v[0] +
-                       ndata->delta.v[1]*ndata->delta.v[1]);
-    delta_rot = ndata->delta.v[2];
-
-    // Precompute a couple of things
-    double trans_hat_stddev = (alpha3 * (delta_trans*delta_trans) +
-                               alpha1 * (delta_rot*delta_rot));
-    double rot_hat_stddev = (alpha4 * (delta_rot*delta_rot) +
-                             alpha2 * (delta_trans*delta_trans));
-    double strafe_hat_stddev = (alpha1 * (delta_rot*delta_rot) +
-                                alpha5 * (delta_trans*delta_trans));
-
-    for (int i = 0; i < set->sample_count; i++)
-    {
-      pf_sample_t* sample = set->samples + i;
-
-      delta_bearing = angle_diff(atan2(ndata->delta.v[1], ndata->delta.v[0]),
-                                 old_pose.v[2]) + sample->pose.v[2];
-      double cs_bearing = cos(delta_bearing);
-      double sn_bearing = sin(delta_bearing);
-
-      // Sample pose differences
-      delta_trans_hat = delta_trans + pf_ran_gaussian(trans_hat_stddev);
-      delta_rot_hat = delta_rot + pf_ran_gaussian(rot_hat_stddev);
-      delta_strafe_hat = 0 + pf_ran_gaussian(strafe_hat_stddev);
-      // Apply sampled update to particle pose
-      sample->pose.v[0] += (delta_trans_hat * cs_bearing + 
-                            delta_strafe_hat * sn_bearing);
-      sample->pose.v[1] += (delta_trans_hat * sn_bearing - 
-                            delta_strafe_hat * cs_bearing);
-      sample->pose.v[2] += delta_rot_hat ;
-    }
-  }
-  break;
-  case ODOM_MODEL_DIFF:
+  if(diff)
   {
     // Implement sample_motion_odometry (Prob Rob p 136)
-    double delta_rot1, delta_trans, delta_rot2;
-    double delta_rot1_hat, delta_trans_hat, delta_rot2_hat;
     double delta_rot1_noise, delta_rot2_noise;
 
     // Avoid computing a bearing from two poses that are extremely near each
     // other (happens on in-place rotation).
-    if(sqrt(ndata->delta.v[1]*ndata->delta.v[1] + 
-            ndata->delta.v[0]*ndata->delta.v[0]) < 0.01)
+    if(delta_trans < 0.01)
       delta_rot1 = 0.0;
     else
       delta_rot1 = angle_diff(atan2(ndata->delta.v[1], ndata->delta.v[0]),
                               old_pose.v[2]);
-    delta_trans = sqrt(ndata->delta.v[0]*ndata->delta.v[0] +
-                       ndata->delta.v[1]*ndata->delta.v[1]);
     delta_rot2 = angle_diff(ndata->delta.v[2], delta_rot1);
 
     // We want to treat backward and forward motion symmetrically for the
@@ -189,122 +168,102 @@ bool AMCLOdom::UpdateAction(pf_t *pf, AMCLSensorData *data)
     delta_rot2_noise = std::min(fabs(angle_diff(delta_rot2,0.0)),
                                 fabs(angle_diff(delta_rot2,M_PI)));
 
-    for (int i = 0; i < set->sample_count; i++)
-    {
-      pf_sample_t* sample = set->samples + i;
-
-      // Sample pose differences
-      delta_rot1_hat = angle_diff(delta_rot1,
-                                  pf_ran_gaussian(this->alpha1*delta_rot1_noise*delta_rot1_noise +
-                                                  this->alpha2*delta_trans*delta_trans));
-      delta_trans_hat = delta_trans - 
-              pf_ran_gaussian(this->alpha3*delta_trans*delta_trans +
-                              this->alpha4*delta_rot1_noise*delta_rot1_noise +
-                              this->alpha4*delta_rot2_noise*delta_rot2_noise);
-      delta_rot2_hat = angle_diff(delta_rot2,
-                                  pf_ran_gaussian(this->alpha1*delta_rot2_noise*delta_rot2_noise +
-                                                  this->alpha2*delta_trans*delta_trans));
-
-      // Apply sampled update to particle pose
-      sample->pose.v[0] += delta_trans_hat * 
-              cos(sample->pose.v[2] + delta_rot1_hat);
-      sample->pose.v[1] += delta_trans_hat * 
-              sin(sample->pose.v[2] + delta_rot1_hat);
-      sample->pose.v[2] += delta_rot1_hat + delta_rot2_hat;
-    }
+    stddev[0] = this->alpha1*delta_rot1_noise*delta_rot1_noise +
+            this->alpha2*delta_trans*delta_trans;
+    stddev[1] = this->alpha3*delta_trans*delta_trans +
+            this->alpha4*delta_rot1_noise*delta_rot1_noise +
+            this->alpha4*delta_rot2_noise*delta_rot2_noise;
+    stddev[2] = this->alpha1*delta_rot2_noise*delta_rot2_noise +
+            this->alpha2*delta_trans*delta_trans;
   }
-  break;
-  case ODOM_MODEL_OMNI_CORRECTED:
+  else
   {
-    double delta_trans, delta_rot, delta_bearing;
-    double delta_trans_hat, delta_rot_hat, delta_strafe_hat;
-
-    delta_trans = sqrt(ndata->delta.v[0]*ndata->delta.v[0] +
-                       ndata->delta.v[1]*ndata->delta.v[1]);
     delta_rot = ndata->delta.v[2];
 
-    // Precompute a couple of things
-    double trans_hat_stddev = sqrt( alpha3 * (delta_trans*delta_trans) +
-                                    alpha1 * (delta_rot*delta_rot) );
-    double rot_hat_stddev = sqrt( alpha4 * (delta_rot*delta_rot) +
-                                  alpha2 * (delta_trans*delta_trans) );
-    double strafe_hat_stddev = sqrt( alpha1 * (delta_rot*delta_rot) +
-                                     alpha5 * (delta_trans*delta_trans) );
+    // Direction of travel relative to the heading; the same for every
+    // particle
+    delta_bearing = angle_diff(atan2(ndata->delta.v[1], ndata->delta.v[0]),
+                               old_pose.v[2]);
 
-    for (int i = 0; i < set->sample_count; i++)
-    {
-      pf_sample_t* sample = set->samples + i;
-
-      delta_bearing = angle_diff(atan2(ndata->delta.v[1], ndata->delta.v[0]),
-                                 old_pose.v[2]) + sample->pose.v[2];
-      double cs_bearing = cos(delta_bearing);
-      double sn_bearing = sin(delta_bearing);
-
-      // Sample pose differences
-      delta_trans_hat = delta_trans + pf_ran_gaussian(trans_hat_stddev);
-      delta_rot_hat = delta_rot + pf_ran_gaussian(rot_hat_stddev);
-      delta_strafe_hat = 0 + pf_ran_gaussian(strafe_hat_stddev);
-      // Apply sampled update to particle pose
-      sample->pose.v[0] += (delta_trans_hat * cs_bearing + 
-                            delta_strafe_hat * sn_bearing);
-      sample->pose.v[1] += (delta_trans_hat * sn_bearing - 
-                            delta_strafe_hat * cs_bearing);
-      sample->pose.v[2] += delta_rot_hat ;
-    }
+    stddev[0] = alpha3 * (delta_trans*delta_trans) + alpha1 * (delta_rot*delta_rot);
+    stddev[1] = alpha4 * (delta_rot*delta_rot) + alpha2 * (delta_trans*delta_trans);
+    stddev[2] = alpha1 * (delta_rot*delta_rot) + alpha5 * (delta_trans*delta_trans);
   }
-  break;
-  case ODOM_MODEL_DIFF_CORRECTED:
+
+  // The corrected models take the terms above as variances
+  if(this->model_type == ODOM_MODEL_DIFF_CORRECTED ||
+     this->model_type == ODOM_MODEL_OMNI_CORRECTED)
   {
-    // Implement sample_motion_odometry (Prob Rob p 136)
-    double delta_rot1, delta_trans, delta_rot2;
-    double delta_rot1_hat, delta_trans_hat, delta_rot2_hat;
-    double delta_rot1_noise, delta_rot2_noise;
+    for (int k = 0; k < 3; k++)
+      stddev[k] = sqrt(stddev[k]);
+  }
 
-    // Avoid computing a bearing from two poses that are extremely near each
-    // other (happens on in-place rotation).
-    if(sqrt(ndata->delta.v[1]*ndata->delta.v[1] + 
-            ndata->delta.v[0]*ndata->delta.v[0]) < 0.01)
-      delta_rot1 = 0.0;
-    else
-      delta_rot1 = angle_diff(atan2(ndata->delta.v[1], ndata->delta.v[0]),
-                              old_pose.v[2]);
-    delta_trans = sqrt(ndata->delta.v[0]*ndata->delta.v[0] +
-                       ndata->delta.v[1]*ndata->delta.v[1]);
-    delta_rot2 = angle_diff(ndata->delta.v[2], delta_rot1);
+  int n = set->sample_count;
+  int blocks = (n + ODOM_BLOCK - 1) / ODOM_BLOCK;
+  std::vector<unsigned short> seeds(3 * blocks);
+  for (int b = 0; b < blocks; b++)
+    pf_ran_seed(&seeds[3 * b]);
 
-    // We want to treat backward and forward motion symmetrically for the
-    // noise model to be applied below.  The standard model seems to assume
-    // forward motion.
-    delta_rot1_noise = std::min(fabs(angle_diff(delta_rot1,0.0)),
-                                fabs(angle_diff(delta_rot1,M_PI)));
-    delta_rot2_noise = std::min(fabs(angle_diff(delta_rot2,0.0)),
-                                fabs(angle_diff(delta_rot2,M_PI)));
+  #pragma omp parallel for schedule(static) if(this->parallel)
+  for (int b = 0; b < blocks; b++)
+  {
+    int begin = b * ODOM_BLOCK;
+    int count = std::min(n, begin + ODOM_BLOCK) - begin;
+    double g[3 * ODOM_BLOCK];
+    double x[ODOM_BLOCK], y[ODOM_BLOCK], th[ODOM_BLOCK];
 
-    for (int i = 0; i < set->sample_count; i++)
+    pf_ran_gaussian_fill(&seeds[3 * b], g, 3 * count);
+    for (int i = 0; i < count; i++)
     {
-      pf_sample_t* sample = set->samples + i;
+      const pf_vector_t& pose = set->samples[begin + i].pose;
+      x[i] = pose.v[0];
+      y[i] = pose.v[1];
+      th[i] = pose.v[2];
+    }
 
-      // Sample pose differences
-      delta_rot1_hat = angle_diff(delta_rot1,
-                                  pf_ran_gaussian(sqrt(this->alpha1*delta_rot1_noise*delta_rot1_noise +
-                                                       this->alpha2*delta_trans*delta_trans)));
-      delta_trans_hat = delta_trans - 
-              pf_ran_gaussian(sqrt(this->alpha3*delta_trans*delta_trans +
-                                   this->alpha4*delta_rot1_noise*delta_rot1_noise +
-                                   this->alpha4*delta_rot2_noise*delta_rot2_noise));
-      delta_rot2_hat = angle_diff(delta_rot2,
-                                  pf_ran_gaussian(sqrt(this->alpha1*delta_rot2_noise*delta_rot2_noise +
-                                                       this->alpha2*delta_trans*delta_trans)));
+    if(diff)
+    {
+      #pragma omp simd
+      for (int i = 0; i < count; i++)
+      {
+        // Sample pose differences
+        double delta_rot1_hat = wrap(delta_rot1 - stddev[0] * g[i]);
+        double delta_trans_hat = delta_trans - stddev[1] * g[count + i];
+        double delta_rot2_hat = wrap(delta_rot2 - stddev[2] * g[2*count + i]);
+
+        // Apply sampled update to particle pose
+        x[i] += delta_trans_hat * cos(th[i] + delta_rot1_hat);
+        y[i] += delta_trans_hat * sin(th[i] + delta_rot1_hat);
+        th[i] += delta_rot1_hat + delta_rot2_hat;
+      }
+    }
+    else
+    {
+      #pragma omp simd
+      for (int i = 0; i < count; i++)
+      {
+        double cs_bearing = cos(delta_bearing + th[i]);
+        double sn_bearing = sin(delta_bearing + th[i]);
+
+        // Sample pose differences
+        double delta_trans_hat = delta_trans + stddev[0] * g[i];
+        double delta_rot_hat = delta_rot + stddev[1] * g[count + i];
+        double delta_strafe_hat = stddev[2] * g[2*count + i];
+
+        // Apply sampled update to particle pose
+        x[i] += (delta_trans_hat * cs_bearing + delta_strafe_hat * sn_bearing);
+        y[i] += (delta_trans_hat * sn_bearing - delta_strafe_hat * cs_bearing);
+        th[i] += delta_rot_hat;
+      }
+    }
 
-      // Apply sampled update to particle pose
-      sample->pose.v[0] += delta_trans_hat * 
-              cos(sample->pose.v[2] + delta_rot1_hat);
-      sample->pose.v[1] += delta_trans_hat * 
-              sin(sample->pose.v[2] + delta_rot1_hat);
-      sample->pose.v[2] += delta_rot1_hat + delta_rot2_hat;
+    for (int i = 0; i < count; i++)
+    {
+      pf_vector_t& pose = set->samples[begin + i].pose;
+      pose.v[0] = x[i];
+      pose.v[1] = y[i];
+      pose.v[2] = th[i];
     }
   }
-  break;
-  }
   return true;
 }
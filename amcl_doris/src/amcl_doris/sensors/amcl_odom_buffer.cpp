@@ -0,0 +1,142 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+///////////////////////////////////////////////////////////////////////////
+//
+// Desc: History of odometry poses, to look up the pose at a sensor stamp
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <algorithm>
+
+#include "amcl_doris/sensors/amcl_odom_buffer.h"
+
+using namespace amcl;
+
+// Attempts of a lookup that races with the writer
+#define ODOM_BUFFER_RETRIES 4
+
+////////////////////////////////////////////////////////////////////////////////
+// Default constructor
+AMCLOdomBuffer::AMCLOdomBuffer(int capacity) : head(0)
+{
+  uint64_t size = 2;
+  while(size < (uint64_t)capacity)
+    size *= 2;
+  this->ring = std::vector<Slot>(size);
+  this->mask = size - 1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Entry at a position
+AMCLOdomBuffer::Entry AMCLOdomBuffer::Load(uint64_t i) const
+{
+  const Slot& s = this->ring[i & this->mask];
+  Entry e;
+  e.time = s.time.load(std::memory_order_relaxed);
+  e.pose.v[0] = s.x.load(std::memory_order_relaxed);
+  e.pose.v[1] = s.y.load(std::memory_order_relaxed);
+  e.pose.v[2] = s.a.load(std::memory_order_relaxed);
+  return e;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Add a pose
+void AMCLOdomBuffer::Add(double time, const pf_vector_t& pose)
+{
+  uint64_t h = this->head.load(std::memory_order_relaxed);
+  Slot& s = this->ring[h & this->mask];
+
+  // A reader that sees any of the fields below also sees the head that
+  // tells it the slot may have been reused
+  std::atomic_thread_fence(std::memory_order_release);
+  s.time.store(time, std::memory_order_relaxed);
+  s.x.store(pose.v[0], std::memory_order_relaxed);
+  s.y.store(pose.v[1], std::memory_order_relaxed);
+  s.a.store(pose.v[2], std::memory_order_relaxed);
+  this->head.store(h + 1, std::memory_order_release);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Number of poses added
+uint64_t AMCLOdomBuffer::Count() const
+{
+  return this->head.load(std::memory_order_acquire);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Pose at a time
+bool AMCLOdomBuffer::Lookup(double time, double tolerance, pf_vector_t& pose) const
+{
+  for(int attempt = 0; attempt < ODOM_BUFFER_RETRIES; attempt++)
+  {
+    uint64_t h = this->head.load(std::memory_order_acquire);
+    uint64_t n = std::min<uint64_t>(h, (this->mask + 1) / 2);
+    if(n == 0)
+      return false;
+    uint64_t first = h - n;
+
+    // Last entry not newer than the time
+    Entry a = this->Load(h - 1);
+    Entry b = a;
+    bool found = true;
+    if(time >= a.time)
+    {
+      found = time - a.time <= tolerance;
+    }
+    else
+    {
+      uint64_t lo = first, hi = h - 1;
+      if(this->Load(lo).time > time)
+        found = false;
+      else
+      {
+        // ring[lo].time <= time < ring[hi].time
+        while(hi - lo > 1)
+        {
+          uint64_t mid = lo + (hi - lo) / 2;
+          if(this->Load(mid).time <= time)
+            lo = mid;
+          else
+            hi = mid;
+        }
+        a = this->Load(lo);
+        b = this->Load(hi);
+      }
+    }
+
+    // Entries from first on must not have been reused meanwhile
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(this->head.load(std::memory_order_relaxed) - first > this->mask)
+      continue;
+    if(!found)
+      return false;
+
+    double s = b.time > a.time ? (time - a.time) / (b.time - a.time) : 0.0;
+    double da = atan2(sin(b.pose.v[2] - a.pose.v[2]), cos(b.pose.v[2] - a.pose.v[2]));
+    pose.v[0] = a.pose.v[0] + s * (b.pose.v[0] - a.pose.v[0]);
+    pose.v[1] = a.pose.v[1] + s * (b.pose.v[1] - a.pose.v[1]);
+    pose.v[2] = a.pose.v[2] + s * da;
+    pose.v[2] = atan2(sin(pose.v[2]), cos(pose.v[2]));
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,179 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+///////////////////////////////////////////////////////////////////////////
+//
+// Desc: Unified (Mei) omnidirectional camera model projection
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+
+#include "amcl_doris/sensors/amcl_omni_camera.h"
+
+using namespace amcl;
+
+////////////////////////////////////////////////////////////////////////////////
+// Default constructor
+AMCLOmniCamera::AMCLOmniCamera() :
+  fx(1.0), fy(1.0), cx(0.0), cy(0.0), skew(0.0), xi(0.0),
+  k1(0.0), k2(0.0), p1(0.0), p2(0.0),
+  table_step(0), table_cols(0), table_rows(0)
+{
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Take the intrinsics
+void AMCLOmniCamera::SetIntrinsics(const cv::Mat& K, double xi, const cv::Mat& D)
+{
+  cv::Mat Kd, Dd;
+  K.convertTo(Kd, CV_64F);
+  D.convertTo(Dd, CV_64F);
+
+  this->fx = Kd.at<double>(0, 0);
+  this->fy = Kd.at<double>(1, 1);
+  this->cx = Kd.at<double>(0, 2);
+  this->cy = Kd.at<double>(1, 2);
+  this->skew = Kd.at<double>(0, 1);
+  this->xi = xi;
+
+  const double* d = Dd.ptr<double>();
+  this->k1 = d[0];
+  this->k2 = d[1];
+  this->p1 = d[2];
+  this->p2 = d[3];
+  this->table.clear();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Project a batch of points
+void AMCLOmniCamera::Project(const double* x, const double* y, const double* z, int n,
+                             double* u, double* v) const
+{
+  #pragma omp simd
+  for(int i = 0; i < n; i++)
+  {
+    // Onto the unit sphere, then the normalised plane
+    double norm = sqrt(x[i]*x[i] + y[i]*y[i] + z[i]*z[i]);
+    double den = z[i] / norm + this->xi;
+    double xu = x[i] / norm / den;
+    double yu = y[i] / norm / den;
+
+    // Distortion
+    double r2 = xu*xu + yu*yu;
+    double radial = 1 + this->k1*r2 + this->k2*r2*r2;
+    double xd = xu*radial + 2*this->p1*xu*yu + this->p2*(r2 + 2*xu*xu);
+    double yd = yu*radial + this->p1*(r2 + 2*yu*yu) + 2*this->p2*xu*yu;
+
+    u[i] = this->fx*xd + this->skew*yd + this->cx;
+    v[i] = this->fy*yd + this->cy;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Point on the projected side of the sphere
+bool AMCLOmniCamera::InFront(double x, double y, double z) const
+{
+  return z + this->xi * sqrt(x*x + y*y + z*z) > 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Bearing of a pixel
+void AMCLOmniCamera::Unproject(double u, double v, double b[3]) const
+{
+  if(!this->table.empty())
+  {
+    double gu = u / this->table_step;
+    double gv = v / this->table_step;
+    int i = (int)floor(gu);
+    int j = (int)floor(gv);
+    if(i >= 0 && j >= 0 && i < this->table_cols - 1 && j < this->table_rows - 1)
+    {
+      double fu = gu - i, fv = gv - j;
+      const double* t00 = &this->table[3 * (j * this->table_cols + i)];
+      const double* t01 = t00 + 3;
+      const double* t10 = t00 + 3 * this->table_cols;
+      const double* t11 = t10 + 3;
+      double norm = 0.0;
+      for(int k = 0; k < 3; k++)
+      {
+        b[k] = (1 - fv) * ((1 - fu) * t00[k] + fu * t01[k]) +
+          fv * ((1 - fu) * t10[k] + fu * t11[k]);
+        norm += b[k] * b[k];
+      }
+      // Cells touching the rim of the mirror have undefined nodes
+      if(norm > 0)
+      {
+        norm = sqrt(norm);
+        for(int k = 0; k < 3; k++)
+          b[k] /= norm;
+        return;
+      }
+    }
+  }
+  this->UnprojectExact(u, v, b);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Tabulate the bearings
+void AMCLOmniCamera::BuildBearingTable(int width, int height, int step)
+{
+  this->table_step = step;
+  this->table_cols = width / step + 2;
+  this->table_rows = height / step + 2;
+  this->table.resize(3 * this->table_cols * this->table_rows);
+  for(int j = 0; j < this->table_rows; j++)
+    for(int i = 0; i < this->table_cols; i++)
+      this->UnprojectExact(i * step, j * step, &this->table[3 * (j * this->table_cols + i)]);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Bearing of a pixel, without the table
+void AMCLOmniCamera::UnprojectExact(double u, double v, double b[3]) const
+{
+  // Distorted point on the normalised plane
+  double yd = (v - this->cy) / this->fy;
+  double xd = (u - this->cx - this->skew*yd) / this->fx;
+
+  // Undo the distortion by fixed point iteration
+  double xu = xd, yu = yd;
+  for(int it = 0; it < 20; it++)
+  {
+    double r2 = xu*xu + yu*yu;
+    double radial = 1 + this->k1*r2 + this->k2*r2*r2;
+    double dx = 2*this->p1*xu*yu + this->p2*(r2 + 2*xu*xu);
+    double dy = this->p1*(r2 + 2*yu*yu) + 2*this->p2*xu*yu;
+    xu = (xd - dx) / radial;
+    yu = (yd - dy) / radial;
+  }
+
+  // Lift to the unit sphere: the point (xu*(zs+xi), yu*(zs+xi), zs) with
+  // norm 1
+  double r2 = xu*xu + yu*yu;
+  double a = r2 + 1;
+  double bb = 2*this->xi*r2;
+  double c = r2*this->xi*this->xi - 1;
+  double zs = (-bb + sqrt(bb*bb - 4*a*c)) / (2*a);
+  b[0] = xu * (zs + this->xi);
+  b[1] = yu * (zs + this->xi);
+  b[2] = zs;
+}
@@ -67,6 +67,37 @@ bool AMCLSensor::UpdateSensor(pf_t *pf, AMCLSensorData *data)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Weight the samples
+double AMCLSensor::Weight(AMCLSensorData *data, pf_sample_set_t *set)
+{
+  double total = 0.0;
+  for(int i = 0; i < set->sample_count; i++)
+    total += set->samples[i].weight;
+  return total;
+}
+
+
+// Sensor model of a group of measurements
+static double FusedWeight(std::vector<AMCLSensorData*> *data, pf_sample_set_t *set)
+{
+  double total = 0.0;
+  for(int i = 0; i < set->sample_count; i++)
+    total += set->samples[i].weight;
+  for(size_t k = 0; k < data->size(); k++)
+    total = (*data)[k]->sensor->Weight((*data)[k], set);
+  return total;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Apply several sensor models at once
+void AMCLSensor::UpdateSensors(pf_t *pf, std::vector<AMCLSensorData*>& data)
+{
+  pf_update_sensor(pf, (pf_sensor_model_fn_t) FusedWeight, &data);
+}
+
+
 #ifdef INCLUDE_RTKGUI
 
 ////////////////////////////////////////////////////////////////////////////////
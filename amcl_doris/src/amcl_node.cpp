@@ -21,12 +21,21 @@
 /* Author: Brian Gerkey */
 
 #include <algorithm>
+#include <atomic>
 #include <vector>
+#include <deque>
 #include <map>
+#include <set>
 #include <cmath>
+#include <limits>
+#include <fstream>
+#include <sstream>
 
 #include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 // Signal handling
 #include <signal.h>
@@ -34,6 +43,7 @@
 #include "amcl_doris/map/map.h"
 #include "amcl_doris/pf/pf.h"
 #include "amcl_doris/sensors/amcl_odom.h"
+#include "amcl_doris/sensors/amcl_odom_buffer.h"
 #include "amcl_doris/sensors/amcl_laser.h"
 #include "amcl_doris/sensors/amcl_marker.h"
 #include "detector/messagedet.h"
@@ -59,6 +69,7 @@
 #include <nav_msgs/Odometry.h>
 #include <nav_msgs/Path.h>
 #include <std_msgs/Float64MultiArray.h>
+#include <std_msgs/Float32MultiArray.h>
 #include <std_msgs/Float64.h>
 #include <amcl_doris/pose_error.h>
 
@@ -97,6 +108,68 @@ typedef struct
 
 } amcl_hyp_t;
 
+// Path published for visualisation.  Only the last `window` poses are
+// kept, one of every `decimation` added, and the whole window is sent
+// only while someone subscribes; each kept pose is also sent alone on
+// <topic>_append.  With a log file every pose added is written to it.
+class PathPublisher
+{
+  public:
+    PathPublisher() : window_(0), decimation_(1), count_(0), log_(NULL) {}
+    ~PathPublisher()
+    {
+      if(log_)
+        fclose(log_);
+    }
+
+    void advertise(ros::NodeHandle& nh, const std::string& topic,
+                   const std::string& frame_id, int window, int decimation,
+                   const std::string& log_dir)
+    {
+      pub_ = nh.advertise<nav_msgs::Path>(topic, 1);
+      append_pub_ = nh.advertise<geometry_msgs::PoseStamped>(topic + "_append", 10);
+      path_.header.frame_id = frame_id;
+      window_ = std::max(window, 1);
+      decimation_ = std::max(decimation, 1);
+      if(!log_dir.empty())
+      {
+        std::string file = log_dir + "/" + topic + ".txt";
+        log_ = fopen(file.c_str(), "w");
+        if(log_)
+          fprintf(log_, "# stamp x y yaw\n");
+        else
+          ROS_WARN("Couldn't open trajectory log %s", file.c_str());
+      }
+    }
+
+    void add(const geometry_msgs::PoseStamped& pose)
+    {
+      if(log_)
+        fprintf(log_, "%.6f %.4f %.4f %.4f\n", pose.header.stamp.toSec(),
+                pose.pose.position.x, pose.pose.position.y,
+                tf::getYaw(pose.pose.orientation));
+      if(count_++ % decimation_)
+        return;
+      poses_.push_back(pose);
+      if((int)poses_.size() > window_)
+        poses_.pop_front();
+      append_pub_.publish(pose);
+      if(pub_.getNumSubscribers() == 0)
+        return;
+      path_.header.stamp = pose.header.stamp;
+      path_.poses.assign(poses_.begin(), poses_.end());
+      pub_.publish(path_);
+    }
+
+  private:
+    ros::Publisher pub_, append_pub_;
+    nav_msgs::Path path_;
+    std::deque<geometry_msgs::PoseStamped> poses_;
+    int window_, decimation_;
+    long count_;
+    FILE* log_;
+};
+
 static double
 normalize(double z)
 {
@@ -127,13 +200,18 @@ class AmclNode
     ~AmclNode();
 
     /**
-     * @brief Uses TF and LaserScan messages from bag file to drive AMCL instead
+     * @brief Drives AMCL from the tf, odometry, scans and marker detections
+     * of a bag file instead, as fast as it can, and logs a summary
      */
     void runFromBag(const std::string &in_bag_fn);
 
     int process();
     void savePoseToServer();
 
+    // Threaded mode and the threads for the ROS spinner
+    bool threaded() const { return threaded_; }
+    int spinnerThreads() const { return spinner_threads_; }
+
   private:
     tf::TransformBroadcaster* tfb_;
 
@@ -145,16 +223,32 @@ class AmclNode
 
     TransformListenerWrapper* tf_;
 
-    bool sent_first_transform_;
+    // Set by the filter or the transform thread, read by the callbacks
+    std::atomic<bool> sent_first_transform_;
 
     tf::Transform latest_tf_;
     bool latest_tf_valid_;
+    void broadcastTransform(const ros::Time& expiration, bool reverse);
+    // Last estimate: odometry pose of the particles and covariance, for
+    // the predicted pose; guarded with latest_tf_
+    pf_vector_t estimate_odom_pose_;
+    geometry_msgs::PoseWithCovariance::_covariance_type estimate_cov_;
+    // Predicted pose: the last estimate moved by each odometry message
+    bool predicted_pose_;
+    ros::Publisher predicted_pose_pub_;
+    ros::Timer transform_timer_;
+    void publishPredictedPose(const geometry_msgs::Pose& odom, const ros::Time& stamp);
+    void transformTimer(const ros::TimerEvent& event);
 
     // Pose-generating function used to uniformly distribute particles over
     // the map
     static pf_vector_t uniformPoseGenerator(void* arg);
+    // Pose-generating function used instead while there are poses
+    // recovered from the markers; arg is the node
+    static pf_vector_t markerPoseGenerator(void* arg);
 #if NEW_UNIFORM_SAMPLING
-    static std::vector<std::pair<int,int> > free_space_indices;
+    static map_free_index_t* free_space_index;
+    void updateFreeSpaceWeights();
 #endif
     // Callbacks
     bool globalLocalizationCallback(std_srvs::Empty::Request& req,
@@ -170,6 +264,9 @@ class AmclNode
     void mapReceived(const nav_msgs::OccupancyGridConstPtr& msg);
 
     void handleMapMessage(const nav_msgs::OccupancyGrid& msg);
+    bool updateMapIncremental(const nav_msgs::OccupancyGrid& msg);
+    bool loadMapFile(const std::string& filename);
+    void initMapDependentState();
     void freeMapDependentMemory();
     map_t* convertMap( const nav_msgs::OccupancyGrid& map_msg );
     void updatePoseFromServer();
@@ -181,8 +278,6 @@ class AmclNode
     std::string odom_frame_id_;
 
     //paramater to store latest odom pose
-    pf_vector_t latest_odom_pose_scan;
-    pf_vector_t latest_odom_pose_camera;
     tf::Stamped<tf::Pose> latest_odom_pose_;
 
 
@@ -192,6 +287,12 @@ class AmclNode
 
     bool use_map_topic_;
     bool first_map_only_;
+    bool crop_map_;
+    std::string map_file_bin_;
+    bool incremental_map_updates_;
+    // Last grid received, to diff map updates against
+    std::vector<int8_t> map_data_;
+    nav_msgs::MapMetaData map_info_;
 
     ros::Duration gui_publish_period;
     ros::Time save_pose_last_time;
@@ -208,42 +309,116 @@ class AmclNode
     tf::MessageFilter<sensor_msgs::LaserScan>* laser_scan_filter_;
     ros::Subscriber initial_pose_sub_;
     std::vector< AMCLLaser* > lasers_;
-    std::vector< bool > lasers_update_;
     std::map< std::string, int > frame_to_laser_;
 
     // Particle filter
     pf_t *pf_;
     double pf_err_, pf_z_;
+    // Odometry pose the particles are at; pf_init_ is false until the
+    // first sensor sets it.  Odometry is applied lazily, see applyMotion().
     bool pf_init_;
     pf_vector_t pf_odom_pose_;
+    void applyMotion(const pf_vector_t& pose);
+
+    // Sensor fusion: scans and detections are queued in stamp order and
+    // those within fusion_window_ of each other update the filter together
+    struct FusionItem
+    {
+      ros::Time stamp;
+      pf_vector_t pose;
+      boost::shared_ptr<AMCLSensorData> data;
+      bool marker;
+    };
+    std::vector<FusionItem> fusion_queue_;
+    double fusion_window_;
+    // Update gate of the scans (0) and of the detections (1): once the
+    // robot has moved update_min_d or update_min_a since the last update
+    // of the modality, or an update is forced, each of its sensors gets
+    // one update.  init is false until the first message after the
+    // filter is (re)initialized.
+    struct UpdateGate
+    {
+      bool init, force;
+      pf_vector_t pose;
+      std::set<AMCLSensor*> done;
+    };
+    UpdateGate update_gates_[2];
+    void resetUpdateGates();
+    void queueUpdate(const ros::Time& stamp, const pf_vector_t& pose, AMCLSensor* sensor,
+                     const boost::shared_ptr<AMCLSensorData>& data, bool marker);
+    bool fuseQueue();
+    void fuseGroup(std::vector<FusionItem>& group);
+    // Fuses a group whose window has passed when no later message does
+    ros::Timer fusion_timer_;
+    void fusionTimer(const ros::TimerEvent& event);
+    void finishUpdate(const ros::Time& stamp, const pf_vector_t& pose,
+                      bool force_publication, bool marker);
+    void publishEstimate(const ros::Time& stamp, int num_markers);
+
+    // Threaded mode: the callbacks keep only the newest scan of each laser
+    // and the newest detection for the filter thread, and the transform
+    // thread broadcasts map to odom on new estimates and at
+    // transform_publish_rate
+    bool threaded_;
+    int spinner_threads_;
+    double transform_publish_rate_;
+    bool threads_stop_;
+    boost::mutex input_mutex_;
+    boost::condition_variable input_cond_;
+    std::map<std::string, sensor_msgs::LaserScanConstPtr> pending_scans_;
+    detector::messagedet::ConstPtr pending_detection_;
+    boost::thread* filter_thread_;
+    // Guards latest_tf_ and the transform handed to the transform thread
+    boost::mutex tf_mutex_;
+    boost::condition_variable tf_cond_;
+    bool tf_pending_, tf_reverse_;
+    ros::Time tf_expiration_;
+    boost::thread* transform_thread_;
+    // Guards the paths and ground truth shared with the odometry callbacks
+    boost::mutex path_mutex_;
+    void laserMessage(const sensor_msgs::LaserScanConstPtr& laser_scan);
+    void detectionMessage(const detector::messagedet::ConstPtr& msg);
+    void filterThread();
+    void transformThread();
     //pf_vector_t pf_odom_pose_scan;
     double d_thresh_, a_thresh_;
     int resample_interval_;
     int resample_count_cam;
-    int resample_count_scan;
     double laser_min_range_;
     double laser_max_range_;
 
-    //Nomotion update control
-    bool m_force_update_cam;
-    bool m_force_update_scan;// used to temporarily let amcl update samples even when no motion occurs...
-    bool updated_scan;    //used to know what update has occurred last
-    bool updated_camera;
-    bool pf_init_scan;
-    bool pf_init_cam;
-
     AMCLOdom* odom_;
     AMCLLaser* laser_;
     AMCLMarker* marker_;
 
     ros::Duration cloud_pub_interval;
     ros::Time last_cloud_pub_time;
-
-    // For slowing play-back when reading directly from a bag file
-    ros::WallDuration bag_scan_period_;
+    // Particles in the published cloud, 0 for all
+    int cloud_max_particles_;
+    // Random state of the cloud subsampling, apart from drand48 so that
+    // subscribing to the cloud doesn't change the filter's random sequence
+    unsigned short cloud_rand_[3];
+    ros::Publisher particlecloud_compact_pub_;
+    void publishParticleCloud();
+
+    // Bag replay: whether a bag is being replayed (nothing is published
+    // then), bag time the fusion queue goes by (zero when live), time
+    // spent in motion, sensor, resample and publication and number of
+    // filter updates
+    bool replaying_;
+    ros::Time replay_now_;
+    double stage_time_[4];
+    int fused_groups_;
+    bool ground_truth_received_;
 
     void requestMap();
 
+    // Odometry poses from the odometry topic; when there is one, sensor
+    // messages skip the tf message filters and take their pose from it
+    AMCLOdomBuffer* odom_history_;
+    double odom_history_tolerance_;
+    void addOdometry(const geometry_msgs::Pose& pose, const ros::Time& stamp);
+
     // Helper to get odometric pose from transform system
     bool getOdomPose(tf::Stamped<tf::Pose>& pose,
                      double& x, double& y, double& yaw,
@@ -262,7 +437,6 @@ class AmclNode
     ros::ServiceServer set_map_srv_;
     ros::Subscriber initial_pose_sub_old_;
     ros::Subscriber map_sub_;
-    ros::Publisher odom_path_pub;
 
     amcl_hyp_t* initial_pose_hyp_;
     bool first_map_received_;
@@ -285,10 +459,28 @@ class AmclNode
     odom_model_t odom_model_type_;
     double init_pose_[3];
     double init_cov_[3];
+    // Bias of the uniform pose generator towards cells near markers
+    double uniform_marker_bias_, uniform_marker_bias_range_;
+
+    // Marker line-of-sight grid, rebuilt with the map or the markers
+    map_visibility_t* marker_visibility_;
+    std::vector<double> marker_visibility_points_;
+    double marker_visibility_resolution_, marker_visibility_range_;
+    double marker_miss_prob_, marker_miss_range_;
+    void updateMarkerVisibility();
+    // Evaluate the marker model once per pose bin
+    bool marker_bin_evaluation_;
+    // Apply the motion model on several threads
+    bool odom_parallel_;
+    // Sensor resetting: recovery particles are drawn around the robot
+    // poses the detected markers give, with these deviations and, for
+    // poses from a single marker, a turn about it
+    bool marker_recovery_;
+    double marker_recovery_sigma_xy_, marker_recovery_sigma_yaw_, marker_recovery_sigma_view_;
+    std::vector<marker_hypothesis_t> marker_hypotheses_;
     laser_model_t laser_model_type_;
     marker_model_t marker_model_type_;
     bool tf_broadcast_;
-    nav_msgs::Path odom_path;
     void reconfigureCB(amcl::AMCLConfig &config, uint32_t level);
 
     ros::Time last_laser_received_ts_;
@@ -296,16 +488,26 @@ class AmclNode
     void checkLaserReceived(const ros::TimerEvent& event);
 
     //For Camera PF
-    bool marker_update;
     geometry_msgs::Pose EstimatedPose,Cam1,Cam2,Cam3;
-    ros::Publisher publicar,publicar_cam1,publicar_cam2,publicar_cam3,publicar_mapa,error_pub,path_pub_r,path_pub_out,yaw_odom,yaw_amcl;
+    ros::Publisher publicar,publicar_cam1,publicar_cam2,publicar_cam3,publicar_mapa,error_pub,yaw_odom,yaw_amcl;
     ros::Subscriber detector_subs, corners_subs,ground_truth_subs,real_odom_subs;
     float  marker_width, num_cam,marker_height,image_width,ground_truth_x_,ground_truth_y_,ground_truth_yaw_,image_height;
     visualization_msgs::Marker pub_map;
     tf::TransformBroadcaster br_marker;
     Mat imagen_filter;
     std::vector<Marcador> marker_map;
+    // marker_map compiled for lookup by the marker model
+    AMCLMarkerMap marker_table_;
     std::vector<geometry_msgs::TransformStamped> tf_cameras;
+    // Camera poses and image offsets (NaN for the default) from camera_positions
+    std::vector<geometry_msgs::Pose> camera_poses_;
+    std::vector<double> camera_u_offsets_;
+    // Camera intrinsics, read once at startup, and the camera pose in the
+    // robot frame when it comes from TF
+    CameraCalibration camera_calibration_;
+    std::string camera_frame_id_;
+    tf::Transform camera_extrinsics_;
+    bool camera_extrinsics_from_tf_;
     std::string frame_to_camera_;
 
     //Functions
@@ -322,7 +524,8 @@ class AmclNode
     double marker_z_hit,marker_z_rand,marker_sigma_hit,marker_landa;
     message_filters::Subscriber<detector::messagedet>* marker_detection_sub_;
     tf::MessageFilter<detector::messagedet>* marker_detection_filter_;
-    nav_msgs::Path reference, output, odometry;
+    // Reference (ground truth or real odometry), estimated and odometry paths
+    PathPublisher reference_path_, output_path_, odom_path_;
     geometry_msgs::Pose ground_truth;
     geometry_msgs::PoseStamped real_odom;
     geometry_msgs::PoseStamped odom_pose;
@@ -338,9 +541,11 @@ class AmclNode
 
 };
 
-std::vector<std::pair<int,int> > AmclNode::free_space_indices;
+#if NEW_UNIFORM_SAMPLING
+map_free_index_t* AmclNode::free_space_index = NULL;
+#endif
 
-#define USAGE "USAGE: amcl"
+#define USAGE "USAGE: amcl [--run-from-bag BAG [SEED]]"
 
 boost::shared_ptr<AmclNode> amcl_node_ptr;
 
@@ -359,10 +564,32 @@ main(int argc, char** argv)
 
   // Override default sigint handler
   signal(SIGINT, sigintHandler);
+
+  if(argc > 1 && std::string(argv[1]) == "--run-from-bag")
+  {
+    if(argc < 3)
+    {
+      puts(USAGE);
+      return(1);
+    }
+    // Same seed, same run
+    pf_seed(argc > 3 ? atol(argv[3]) : 0);
+    AmclNode node;
+    node.runFromBag(argv[2]);
+    return(0);
+  }
+
   ros::Rate r(10);
   // Make our node available to sigintHandler
   //amcl_node_ptr.reset(new AmclNode());
   AmclNode node;
+  if(node.threaded()){
+      // Callbacks only hand the messages to the filter thread
+      ros::AsyncSpinner spinner(node.spinnerThreads());
+      spinner.start();
+      ros::waitForShutdown();
+      return(0);
+  }
   while(ros::ok()){
       ros::spinOnce();
       r.sleep();
@@ -378,19 +605,32 @@ AmclNode::AmclNode() :
         map_(NULL),
         pf_(NULL),
         resample_count_cam(0),
-        resample_count_scan(0),
         odom_(NULL),
         laser_(NULL),
         marker_(NULL),
 	      private_nh_("~"),
         initial_pose_hyp_(NULL),
         first_map_received_(false),
-        first_reconfigure_call_(true)
+        first_reconfigure_call_(true),
+        marker_visibility_(NULL),
+        threads_stop_(false),
+        filter_thread_(NULL),
+        tf_pending_(false),
+        tf_reverse_(false),
+        transform_thread_(NULL),
+        odom_history_(NULL),
+        replaying_(false),
+        stage_time_(),
+        fused_groups_(0),
+        ground_truth_received_(false)
 {
   boost::recursive_mutex::scoped_lock l(configuration_mutex_);
   // Grab params off the param server
   private_nh_.param("use_map_topic", use_map_topic_, false);
   private_nh_.param("first_map_only", first_map_only_, false);
+  private_nh_.param("crop_map", crop_map_, true);
+  private_nh_.param("map_file_bin", map_file_bin_, std::string(""));
+  private_nh_.param("incremental_map_updates", incremental_map_updates_, true);
 
   double tmp;
   private_nh_.param("gui_publish_rate", tmp, -1.0);
@@ -446,6 +686,15 @@ AmclNode::AmclNode() :
   if (tmp_marker_model_type=="observation_likelihood"){
       marker_model_type_=MARKER_MODEL_LIKELIHOOD;
   }
+  else if (tmp_marker_model_type=="bearing"){
+      marker_model_type_=MARKER_MODEL_BEARING;
+  }
+  else
+  {
+    ROS_WARN("Unknown marker model type \"%s\"; defaulting to observation_likelihood model",
+             tmp_marker_model_type.c_str());
+    marker_model_type_=MARKER_MODEL_LIKELIHOOD;
+  }
 
   private_nh_.param("odom_model_type", tmp_model_type, std::string("diff"));
   if(tmp_model_type == "diff")
@@ -474,14 +723,36 @@ AmclNode::AmclNode() :
   private_nh_.param("recovery_alpha_slow", alpha_slow_, 0.001);
   private_nh_.param("recovery_alpha_fast", alpha_fast_, 0.1);
   private_nh_.param("tf_broadcast", tf_broadcast_, true);
+  private_nh_.param("uniform_marker_bias", uniform_marker_bias_, 0.0);
+  private_nh_.param("uniform_marker_bias_range", uniform_marker_bias_range_, 4.0);
+  private_nh_.param("marker_visibility_resolution", marker_visibility_resolution_, 0.5);
+  private_nh_.param("marker_visibility_range", marker_visibility_range_, 15.0);
+  private_nh_.param("marker_bin_evaluation", marker_bin_evaluation_, false);
+  private_nh_.param("odom_parallel", odom_parallel_, false);
+  private_nh_.param("sensor_fusion_window", fusion_window_, 0.0);
+  private_nh_.param("threaded", threaded_, false);
+  private_nh_.param("spinner_threads", spinner_threads_, 1);
+  private_nh_.param("transform_publish_rate", transform_publish_rate_, 20.0);
+  private_nh_.param("predicted_pose", predicted_pose_, false);
+  private_nh_.param("cloud_max_particles", cloud_max_particles_, 0);
+  cloud_rand_[0] = 0x330e;
+  cloud_rand_[1] = cloud_rand_[2] = 0;
+  bool odom_history;
+  int odom_history_size;
+  private_nh_.param("odom_history", odom_history, false);
+  private_nh_.param("odom_history_size", odom_history_size, 1024);
+  private_nh_.param("odom_history_tolerance", odom_history_tolerance_, 0.05);
+  if(odom_history)
+    odom_history_ = new AMCLOdomBuffer(odom_history_size);
+  private_nh_.param("marker_miss_prob", marker_miss_prob_, 1.0);
+  private_nh_.param("marker_miss_range", marker_miss_range_, 5.0);
+  private_nh_.param("marker_recovery", marker_recovery_, false);
+  private_nh_.param("marker_recovery_sigma_xy", marker_recovery_sigma_xy_, 0.1);
+  private_nh_.param("marker_recovery_sigma_yaw", marker_recovery_sigma_yaw_, 0.05);
+  private_nh_.param("marker_recovery_sigma_view", marker_recovery_sigma_view_, 0.3);
 
   transform_tolerance_.fromSec(tmp_tol);
 
-  {
-    double bag_scan_period;
-    private_nh_.param("bag_scan_period", bag_scan_period, -1.0);
-    bag_scan_period_.fromSec(bag_scan_period);
-  }
   updatePoseFromServer();
 
   cloud_pub_interval.fromSec(1.0);
@@ -490,6 +761,7 @@ AmclNode::AmclNode() :
 
   pose_pub_ = nh_.advertise<geometry_msgs::PoseWithCovarianceStamped>("amcl_pose", 2, true);
   particlecloud_pub_ = nh_.advertise<geometry_msgs::PoseArray>("particlecloud", 2, true);
+  particlecloud_compact_pub_ = nh_.advertise<std_msgs::Float32MultiArray>("particlecloud_compact", 2);
   global_loc_srv_ = nh_.advertiseService("global_localization",
                                         &AmclNode::globalLocalizationCallback,
                                          this);
@@ -498,21 +770,22 @@ AmclNode::AmclNode() :
   set_map_srv_= nh_.advertiseService("set_map", &AmclNode::setMapCallback, this);
 
  laser_scan_sub_ = new message_filters::Subscriber<sensor_msgs::LaserScan>(nh_, scan_topic_, 100);
+ laser_scan_filter_ = NULL;
+ // With the odometry history scans don't wait for tf
+ if(odom_history_)
+   laser_scan_sub_->registerCallback(boost::bind(&AmclNode::laserMessage,
+   this, _1));
+ else
+ {
  laser_scan_filter_ =
        new tf::MessageFilter<sensor_msgs::LaserScan>(*laser_scan_sub_,
                                                        *tf_,
                                                        odom_frame_id_,
                                                        100);
 
- laser_scan_filter_->registerCallback(boost::bind(&AmclNode::laserReceived,
+ laser_scan_filter_->registerCallback(boost::bind(&AmclNode::laserMessage,
  this, _1));
-
-  if(use_map_topic_) {
-    map_sub_ = nh_.subscribe("map", 1, &AmclNode::mapReceived, this);
-    ROS_INFO("Subscribed to map topic.");
-  } else {
-    requestMap();
-  }
+ }
 
   // 15s timer to warn on lack of receipt of laser scans, #5209
   laser_check_interval_ = ros::Duration(15.0);
@@ -536,6 +809,35 @@ AmclNode::AmclNode() :
   marker_= new AMCLMarker(simulation);
   marker_->simulation= simulation;
 
+  //Camera calibration: pinhole for the simulated cameras, unified model
+  //for the real omnidirectional one
+  std::string camera_calibration_file;
+  private_nh_.param("camera_calibration_file",camera_calibration_file,
+                    CameraCalibration::defaultFile(simulation==1 ? "doris_sim.yaml" : "doris_omni.yaml"));
+  if(!camera_calibration_.load(camera_calibration_file)){
+      ROS_FATAL("Failed to load camera calibration %s",camera_calibration_file.c_str());
+      exit(1);
+  }
+  if(camera_calibration_.omni != (simulation==0))
+      ROS_WARN("Camera calibration %s is not a %s model",camera_calibration_file.c_str(),
+               simulation==1 ? "pinhole" : "unified");
+
+  //Camera pose from TF if its frame is given, the built-in one otherwise
+  private_nh_.param("camera_frame_id",camera_frame_id_,std::string(""));
+  camera_extrinsics_from_tf_=false;
+  if(!camera_frame_id_.empty()){
+      tf::StampedTransform robot_to_camera;
+      try{
+          tf_->waitForTransform(base_frame_id_,camera_frame_id_,ros::Time(0),ros::Duration(5.0));
+          tf_->lookupTransform(base_frame_id_,camera_frame_id_,ros::Time(0),robot_to_camera);
+          camera_extrinsics_=robot_to_camera;
+          camera_extrinsics_from_tf_=true;
+      }catch(tf::TransformException& e){
+          ROS_WARN("Couldn't get the pose of camera frame %s: %s; using the built-in one",
+                   camera_frame_id_.c_str(),e.what());
+      }
+  }
+
   //Reading visual map.
   std::vector<geometry_msgs::Pose> Centros;
   std::vector<int> IDs,sectors,maps;
@@ -581,38 +883,73 @@ AmclNode::AmclNode() :
           temp_pose.orientation.z = double(Quat.z());
           temp_pose.orientation.w = double(Quat.w());
           cameras.push_back(temp_pose);
+          //Optional horizontal offset of this camera in the stitched image
+          double u_offset=std::numeric_limits<double>::quiet_NaN();
+          if(camera_list[i].hasMember("u_offset"))
+              u_offset=camera_list[i]["u_offset"];
+          camera_u_offsets_.push_back(u_offset);
 
 
 }
+  camera_poses_=cameras;
   tf::Quaternion quat;
   this->loadTFCameras(cameras);
   this->LoadMapMarkers(maps,sectors,IDs,Centros);
 
+  // The map dependent state configures the marker model, so the map is
+  // loaded or requested once the cameras and markers are in
+  if(!map_file_bin_.empty() && loadMapFile(map_file_bin_)) {
+    ROS_INFO("Using map file %s; not requesting a map.", map_file_bin_.c_str());
+  } else if(use_map_topic_) {
+    map_sub_ = nh_.subscribe("map", 1, &AmclNode::mapReceived, this);
+    ROS_INFO("Subscribed to map topic.");
+  } else {
+    requestMap();
+  }
+
   //Subscribing to the output of the detector node.
   marker_detection_sub_=new message_filters::Subscriber<detector::messagedet>(nh_,"DetectorNode/detection",100);
-  marker_detection_filter_=new tf::MessageFilter<detector::messagedet>(*marker_detection_sub_,*tf_,odom_frame_id_,100);
-  marker_detection_filter_->registerCallback(boost::bind(&AmclNode::detectionCallback,
-                                                 this, _1));
+  marker_detection_filter_=NULL;
+  if(odom_history_){
+    marker_detection_sub_->registerCallback(boost::bind(&AmclNode::detectionMessage,
+                                                   this, _1));
+  }else{
+    marker_detection_filter_=new tf::MessageFilter<detector::messagedet>(*marker_detection_sub_,*tf_,odom_frame_id_,100);
+    marker_detection_filter_->registerCallback(boost::bind(&AmclNode::detectionMessage,
+                                                   this, _1));
+  }
   ground_truth_subs=nh_.subscribe("/Doris/ground_truth/state",1, &AmclNode::groundTruthCallback,this);
+  //The odometry history needs every message
+  int odom_queue=odom_history_ ? 100 : 1;
   if(simulation==0){
-  real_odom_subs=nh_.subscribe("Doris/odom",1,&AmclNode::realOdomCallback,this);
+  real_odom_subs=nh_.subscribe("Doris/odom",odom_queue,&AmclNode::realOdomCallback,this);
   }else{
-    real_odom_subs=nh_.subscribe("Doris/odom",1,&AmclNode::simuOdomCallback,this);
+    real_odom_subs=nh_.subscribe("Doris/odom",odom_queue,&AmclNode::simuOdomCallback,this);
   }
 
-
-  m_force_update_cam = false;
-  m_force_update_scan=false;
-  updated_scan=false;
-  updated_camera=false;
+  resetUpdateGates();
 
   initial_pose_sub_ = nh_.subscribe("initialpose", 2, &AmclNode::initialPoseReceived, this);
   error_pub=nh_.advertise<amcl_doris::pose_error>("amcl_error",1);
-  path_pub_r=nh_.advertise<nav_msgs::Path>("reference_path",1);
-  path_pub_out=nh_.advertise<nav_msgs::Path>("output_path",1);
-  odom_path_pub=nh_.advertise<nav_msgs::Path>("odom_path",1);
+  int path_window, path_decimation;
+  std::string path_log_dir;
+  private_nh_.param("path_window", path_window, 1000);
+  private_nh_.param("path_decimation", path_decimation, 1);
+  private_nh_.param("path_log_dir", path_log_dir, std::string(""));
+  reference_path_.advertise(nh_,"reference_path","map",path_window,path_decimation,path_log_dir);
+  output_path_.advertise(nh_,"output_path","map",path_window,path_decimation,path_log_dir);
+  odom_path_.advertise(nh_,"odom_path","Doris/odom",path_window,path_decimation,path_log_dir);
   yaw_odom=nh_.advertise<std_msgs::Float64>("odom_yaw",1);
   yaw_amcl=nh_.advertise<std_msgs::Float64>("amcl_yaw",1);
+  if(predicted_pose_){
+    predicted_pose_pub_=nh_.advertise<geometry_msgs::PoseWithCovarianceStamped>("amcl_pose_predicted",10);
+    // The transform thread already republishes map to odom
+    if(!threaded_ && transform_publish_rate_>0.0)
+      transform_timer_=nh_.createTimer(ros::Duration(1.0/transform_publish_rate_),
+                                       &AmclNode::transformTimer,this);
+  }
+  if(fusion_window_>0.0)
+    fusion_timer_=nh_.createTimer(ros::Duration(fusion_window_),&AmclNode::fusionTimer,this);
 
   dsrv_ = new dynamic_reconfigure::Server<amcl::AMCLConfig>(ros::NodeHandle("~"));
   dynamic_reconfigure::Server<amcl::AMCLConfig>::CallbackType cb = boost::bind(&AmclNode::reconfigureCB, this, _1, _2);
@@ -625,6 +962,11 @@ AmclNode::AmclNode() :
   cout<<quatini.y<<endl;
   cout<<quatini.z<<endl;
   cout<<quatini.w<<endl;
+
+  if(threaded_){
+    filter_thread_=new boost::thread(boost::bind(&AmclNode::filterThread,this));
+    transform_thread_=new boost::thread(boost::bind(&AmclNode::transformThread,this));
+  }
 }
 
 void AmclNode::reconfigureCB(AMCLConfig &config, uint32_t level)
@@ -725,8 +1067,8 @@ void AmclNode::reconfigureCB(AMCLConfig &config, uint32_t level)
   pf_init_pose_cov.m[1][1] = last_published_pose.pose.covariance[6*1+1];
   pf_init_pose_cov.m[2][2] = last_published_pose.pose.covariance[6*5+5];
   pf_init(pf_, pf_init_pose_mean, pf_init_pose_cov);
-  pf_init_scan = false;
-  pf_init_cam = false;
+  pf_init_ = false;
+  resetUpdateGates();
 
   // Instantiate the sensor objects
   // Odometry
@@ -734,6 +1076,7 @@ void AmclNode::reconfigureCB(AMCLConfig &config, uint32_t level)
   odom_ = new AMCLOdom();
   ROS_ASSERT(odom_);
   odom_->SetModel( odom_model_type_, alpha1_, alpha2_, alpha3_, alpha4_, alpha5_ );
+  odom_->parallel = odom_parallel_;
   // Laser
   delete laser_;
   laser_ = new AMCLLaser(max_beams_, map_);
@@ -760,33 +1103,48 @@ void AmclNode::reconfigureCB(AMCLConfig &config, uint32_t level)
   base_frame_id_ = config.base_frame_id;
   global_frame_id_ = config.global_frame_id;
 
-  delete laser_scan_filter_;
-  laser_scan_filter_ =
-          new tf::MessageFilter<sensor_msgs::LaserScan>(*laser_scan_sub_, 
-                                                        *tf_, 
-                                                        odom_frame_id_, 
-                                                        100);
-  laser_scan_filter_->registerCallback(boost::bind(&AmclNode::laserReceived,
-                                                  this, _1));
+  if(!odom_history_)
+  {
+    delete laser_scan_filter_;
+    laser_scan_filter_ =
+            new tf::MessageFilter<sensor_msgs::LaserScan>(*laser_scan_sub_, 
+                                                          *tf_, 
+                                                          odom_frame_id_, 
+                                                          100);
+    laser_scan_filter_->registerCallback(boost::bind(&AmclNode::laserMessage,
+                                                    this, _1));
+  }
 
   //Markers
   delete marker_;
+  fusion_queue_.clear();
   marker_=new AMCLMarker(simulation);
   ROS_ASSERT(marker_);
-  if (marker_model_type_==MARKER_MODEL_LIKELIHOOD){
+  {
       ROS_INFO("Initializong visual algorithm...");
-      marker_->SetModelLikelihoodField(marker_z_hit,marker_z_rand,marker_sigma_hit,marker_landa,marker_coeff);
-      marker_->map=marker_map;
-      marker_->tf_cameras=tf_cameras;
+      if (marker_model_type_==MARKER_MODEL_BEARING)
+          marker_->SetModelBearing(marker_z_rand,marker_landa);
+      else
+          marker_->SetModelLikelihoodField(marker_z_hit,marker_z_rand,marker_sigma_hit,marker_landa,marker_coeff);
+      marker_->map=&marker_table_;
+      marker_->visibility=marker_visibility_;
+      marker_->bin_evaluation=marker_bin_evaluation_;
+      marker_->SetMissModel(marker_miss_prob_);
       marker_->num_cam=num_cam;
       marker_->image_width=image_width;
       marker_->image_height=image_height;
+      marker_->SetCalibration(camera_calibration_);
+      if(camera_extrinsics_from_tf_)
+          marker_->SetCameraExtrinsics(camera_extrinsics_);
+      marker_->SetCameraRig(camera_poses_,camera_u_offsets_);
   }
 
-  delete marker_detection_filter_;
-  marker_detection_filter_=new tf::MessageFilter<detector::messagedet>(*marker_detection_sub_,*tf_,odom_frame_id_,100);
-  marker_detection_filter_->registerCallback(boost::bind(&AmclNode::detectionCallback,
-                                                  this, _1));
+  if(!odom_history_){
+    delete marker_detection_filter_;
+    marker_detection_filter_=new tf::MessageFilter<detector::messagedet>(*marker_detection_sub_,*tf_,odom_frame_id_,100);
+    marker_detection_filter_->registerCallback(boost::bind(&AmclNode::detectionMessage,
+                                                    this, _1));
+  }
 
   initial_pose_sub_ = nh_.subscribe("initialpose", 2, &AmclNode::initialPoseReceived, this);
 }
@@ -795,20 +1153,32 @@ void AmclNode::reconfigureCB(AMCLConfig &config, uint32_t level)
 void AmclNode::runFromBag(const std::string &in_bag_fn)
 {
   rosbag::Bag bag;
-  bag.open(in_bag_fn, rosbag::bagmode::Read);
-  std::vector<std::string> topics;
-  topics.push_back(std::string("tf"));
-  std::string scan_topic_name = "Doris/scan"; // TODO determine what topic this actually is from ROS
-  topics.push_back(scan_topic_name);
-  rosbag::View view(bag, rosbag::TopicQuery(topics));
+  try
+  {
+    bag.open(in_bag_fn, rosbag::bagmode::Read);
+  }
+  catch(rosbag::BagException& e)
+  {
+    ROS_ERROR("Couldn't open bag %s: %s", in_bag_fn.c_str(), e.what());
+    return;
+  }
+  rosbag::View view(bag);
 
-  ros::Publisher laser_pub = nh_.advertise<sensor_msgs::LaserScan>(scan_topic_name, 100);
-  ros::Publisher tf_pub = nh_.advertise<tf2_msgs::TFMessage>("/tf", 100);
+  // Sensor messages wait this long in bag time, so that the tf and
+  // odometry around their stamp are in, and are then handled in stamp order
+  double delay;
+  std::string summary_file;
+  private_nh_.param("bag_sensor_delay", delay, 0.2);
+  private_nh_.param("bag_summary", summary_file, std::string(""));
+  ros::Duration sensor_delay(delay);
 
-  // Sleep for a second to let all subscribers connect
-  ros::WallDuration(1.0).sleep();
+  // Poses come from the odometry in the bag when there is some
+  if(!odom_history_)
+    odom_history_ = new AMCLOdomBuffer(4096);
 
-  ros::WallTime start(ros::WallTime::now());
+  // The estimates only go to the summary; publishing them would also
+  // make the run depend on subscribers and the wall clock
+  replaying_ = true;
 
   // Wait for map
   while (ros::ok())
@@ -825,55 +1195,168 @@ void AmclNode::runFromBag(const std::string &in_bag_fn)
     ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(1.0));
   }
 
-  BOOST_FOREACH(rosbag::MessageInstance const msg, view)
+  typedef std::multimap<ros::Time, rosbag::MessageInstance> SensorQueue;
+  SensorQueue sensors;
+  // Ground truth, to compare the final estimate with at its stamp
+  AMCLOdomBuffer ground_truth_history(4096);
+  double ground_truth_last = -1.0;
+  int scans = 0, detections = 0, odometry = 0, transforms = 0;
+  ros::Time first, last;
+  ros::WallTime start(ros::WallTime::now());
+  for(int i = 0; i < 4; i++)
+    stage_time_[i] = 0.0;
+  fused_groups_ = 0;
+
+  for(rosbag::View::iterator it = view.begin(); ros::ok(); ++it)
   {
-    if (!ros::ok())
+    bool end = (it == view.end());
+    ros::Time now = end ? ros::TIME_MAX : it->getTime();
+    if(!end)
     {
-      break;
+      if(first.isZero())
+        first = now;
+      last = now;
     }
 
-    // Process any ros messages or callbacks at this point
-    ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration());
+    // Sensor messages that have waited long enough
+    while(!sensors.empty() && (end || sensors.begin()->first + sensor_delay <= now))
+    {
+      const rosbag::MessageInstance& msg = sensors.begin()->second;
+      replay_now_ = sensors.begin()->first;
+      sensor_msgs::LaserScan::ConstPtr scan = msg.instantiate<sensor_msgs::LaserScan>();
+      if(scan != NULL)
+        laserReceived(scan);
+      else
+        detectionCallback(msg.instantiate<detector::messagedet>());
+      sensors.erase(sensors.begin());
+    }
+    if(end)
+      break;
+    const rosbag::MessageInstance& msg = *it;
 
     tf2_msgs::TFMessage::ConstPtr tf_msg = msg.instantiate<tf2_msgs::TFMessage>();
     if (tf_msg != NULL)
     {
-      tf_pub.publish(msg);
+      bool is_static = (msg.getTopic() == "/tf_static" || msg.getTopic() == "tf_static");
       for (size_t ii=0; ii<tf_msg->transforms.size(); ++ii)
       {
-        tf_->getBuffer().setTransform(tf_msg->transforms[ii], "rosbag_authority");
+        tf_->getBuffer().setTransform(tf_msg->transforms[ii], "rosbag_authority", is_static);
       }
+      transforms++;
       continue;
     }
 
     sensor_msgs::LaserScan::ConstPtr base_scan = msg.instantiate<sensor_msgs::LaserScan>();
     if (base_scan != NULL)
     {
-      laser_pub.publish(msg);
-      laser_scan_filter_->add(base_scan);
-      if (bag_scan_period_ > ros::WallDuration(0))
+      sensors.insert(std::make_pair(base_scan->header.stamp, msg));
+      scans++;
+      continue;
+    }
+
+    detector::messagedet::ConstPtr detection = msg.instantiate<detector::messagedet>();
+    if (detection != NULL)
+    {
+      sensors.insert(std::make_pair(detection->header.stamp, msg));
+      detections++;
+      continue;
+    }
+
+    nav_msgs::Odometry::ConstPtr odom = msg.instantiate<nav_msgs::Odometry>();
+    if (odom != NULL)
+    {
+      if(msg.getTopic().find("ground_truth") != std::string::npos)
+      {
+        groundTruthCallback(odom);
+        if(odom->header.stamp.toSec() > ground_truth_last)
+        {
+          pf_vector_t p;
+          p.v[0] = odom->pose.pose.position.x;
+          p.v[1] = odom->pose.pose.position.y;
+          p.v[2] = tf::getYaw(odom->pose.pose.orientation);
+          ground_truth_last = odom->header.stamp.toSec();
+          ground_truth_history.Add(ground_truth_last, p);
+        }
+      }
+      else
       {
-        bag_scan_period_.sleep();
+        addOdometry(odom->pose.pose, odom->header.stamp);
+        odometry++;
       }
       continue;
     }
 
-    ROS_WARN_STREAM("Unsupported message type" << msg.getTopic());
+    geometry_msgs::PoseStamped::ConstPtr odom_pose = msg.instantiate<geometry_msgs::PoseStamped>();
+    if (odom_pose != NULL && msg.getTopic().find("odom") != std::string::npos)
+    {
+      addOdometry(odom_pose->pose, odom_pose->header.stamp);
+      odometry++;
+      continue;
+    }
+  }
+
+  // Whatever the fusion window still holds
+  replay_now_ = ros::TIME_MAX;
+  {
+    boost::recursive_mutex::scoped_lock cfl(configuration_mutex_);
+    fuseQueue();
   }
+  replay_now_ = ros::Time();
+  replaying_ = false;
 
   bag.close();
 
   double runtime = (ros::WallTime::now() - start).toSec();
-  ROS_INFO("Bag complete, took %.1f seconds to process, shutting down", runtime);
-
+  double duration = (last - first).toSec();
   const geometry_msgs::Quaternion & q(last_published_pose.pose.pose.orientation);
   double yaw, pitch, roll;
   tf::Matrix3x3(tf::Quaternion(q.x, q.y, q.z, q.w)).getEulerYPR(yaw,pitch,roll);
-  ROS_INFO("Final location %.3f, %.3f, %.3f with stamp=%f",
-            last_published_pose.pose.pose.position.x,
-            last_published_pose.pose.pose.position.y,
-            yaw, last_published_pose.header.stamp.toSec()
-            );
+
+  // Summary, as YAML
+  std::ostringstream summary;
+  summary << "bag: " << in_bag_fn << "\n"
+          << "bag_duration: " << duration << "\n"
+          << "runtime: " << runtime << "\n"
+          << "speedup: " << (runtime > 0.0 ? duration / runtime : 0.0) << "\n"
+          << "messages: {scans: " << scans << ", detections: " << detections
+          << ", odometry: " << odometry << ", tf: " << transforms << "}\n"
+          << "updates: " << fused_groups_ << "\n";
+  const char* stages[] = { "motion", "sensor", "resample", "publish" };
+  summary << "stages:\n";
+  for(int i = 0; i < 4; i++)
+    summary << "  " << stages[i] << ": {total: " << stage_time_[i] << ", mean_ms: "
+            << (fused_groups_ > 0 ? 1e3 * stage_time_[i] / fused_groups_ : 0.0) << "}\n";
+  summary << "final_pose: {x: " << last_published_pose.pose.pose.position.x
+          << ", y: " << last_published_pose.pose.pose.position.y
+          << ", yaw: " << yaw << ", stamp: " << last_published_pose.header.stamp.toSec() << "}\n";
+  if(ground_truth_received_)
+  {
+    // Ground truth where the robot was at the stamp of the estimate, not
+    // the last message, which depends on how the topics end
+    pf_vector_t truth;
+    if(ground_truth_history.Lookup(last_published_pose.header.stamp.toSec(),
+                                   odom_history_tolerance_, truth))
+    {
+      double ex = last_published_pose.pose.pose.position.x - truth.v[0];
+      double ey = last_published_pose.pose.pose.position.y - truth.v[1];
+      summary << "final_error: {x: " << ex << ", y: " << ey
+              << ", distance: " << hypot(ex, ey)
+              << ", yaw: " << angle_diff(yaw, truth.v[2]) << "}\n";
+    }
+    else
+      ROS_WARN("No ground truth around the final estimate at %.3f; no final error",
+               last_published_pose.header.stamp.toSec());
+  }
+
+  ROS_INFO("Bag complete, took %.1f seconds to process\n%s", runtime, summary.str().c_str());
+  if(!summary_file.empty())
+  {
+    std::ofstream out(summary_file.c_str());
+    if(out)
+      out << summary.str();
+    else
+      ROS_ERROR("Couldn't write the bag summary to %s", summary_file.c_str());
+  }
 
   ros::shutdown();
 }
@@ -1001,22 +1484,144 @@ AmclNode::handleMapMessage(const nav_msgs::OccupancyGrid& msg)
              msg.header.frame_id.c_str(),
              global_frame_id_.c_str());
 
+  // Small edits of the current map don't need the filter to be rebuilt
+  if(incremental_map_updates_ && updateMapIncremental(msg))
+    return;
+
   freeMapDependentMemory();
   // Clear queued laser objects because they hold pointers to the existing
   // map, #5202.
   lasers_.clear();
-  lasers_update_.clear();
   frame_to_laser_.clear();
 
   map_ = convertMap(msg);
+  map_data_ = msg.data;
+  map_info_ = msg.info;
+
+  initMapDependentState();
+}
+
+/**
+ * Apply a map that only differs from the current one in some cells.  The
+ * distance field, free space index and marker visibility are refreshed
+ * around the changed cells; the particle set and the sensors are kept.
+ * Returns false if the map has to be reloaded instead.
+ */
+bool
+AmclNode::updateMapIncremental(const nav_msgs::OccupancyGrid& msg)
+{
+  if(map_ == NULL || map_data_.empty())
+    return false;
+  if(msg.info.width != map_info_.width ||
+     msg.info.height != map_info_.height ||
+     msg.info.resolution != map_info_.resolution ||
+     msg.info.origin.position.x != map_info_.origin.position.x ||
+     msg.info.origin.position.y != map_info_.origin.position.y ||
+     msg.data.size() != map_data_.size())
+    return false;
+
+  // Grid coordinates of cell (0,0) of map_, which may have been cropped
+  int off_i = (int)floor((MAP_WXGX(map_, 0) - msg.info.origin.position.x) / msg.info.resolution + 0.5);
+  int off_j = (int)floor((MAP_WYGY(map_, 0) - msg.info.origin.position.y) / msg.info.resolution + 0.5);
 
+  std::vector<int> changed;
+  int min_i = map_->size_x, min_j = map_->size_y, max_i = -1, max_j = -1;
+  for(size_t k = 0; k < msg.data.size(); k++)
+  {
+    if(msg.data[k] == map_data_[k])
+      continue;
+    int i = (int)(k % msg.info.width) - off_i;
+    int j = (int)(k / msg.info.width) - off_j;
+    // Changes outside the cropped window need a full reload
+    if(!MAP_VALID(map_, i, j))
+      return false;
+    changed.push_back(MAP_INDEX(map_, i, j));
+    min_i = std::min(min_i, i);
+    min_j = std::min(min_j, j);
+    max_i = std::max(max_i, i);
+    max_j = std::max(max_j, j);
+  }
+  map_data_ = msg.data;
+
+  if(changed.empty())
+  {
+    ROS_INFO("Received map is unchanged");
+    return true;
+  }
+
+  for(size_t k = 0; k < changed.size(); k++)
+  {
+    int i = changed[k] % map_->size_x;
+    int j = changed[k] / map_->size_x;
+    int8_t value = msg.data[(j + off_j) * msg.info.width + (i + off_i)];
+    if(value == 0)
+      map_->cells[changed[k]].occ_state = -1;
+    else if(value == 100)
+      map_->cells[changed[k]].occ_state = +1;
+    else
+      map_->cells[changed[k]].occ_state = 0;
+  }
+
+  if(map_->max_occ_dist > 0)
+    map_update_cspace_window(map_, map_->max_occ_dist, min_i, min_j, max_i, max_j);
+#if NEW_UNIFORM_SAMPLING
+  map_free_index_update(free_space_index, map_, min_i, min_j, max_i, max_j);
+  updateFreeSpaceWeights();
+#endif
+  if(marker_visibility_ != NULL)
+    map_visibility_update(marker_visibility_, map_, &marker_visibility_points_[0], MARKER_CORNERS,
+                          marker_visibility_range_, min_i, min_j, max_i, max_j);
+
+  ROS_INFO("Applied map update: %d cells changed within %d X %d cells",
+           (int)changed.size(), max_i - min_i + 1, max_j - min_j + 1);
+  return true;
+}
+
+/**
+ * Load a map stored by map_to_bin.  The cells are memory-mapped rather
+ * than copied; a stored likelihood field is reused by the laser model
+ * when its maximum distance matches laser_likelihood_max_dist.
+ */
+bool
+AmclNode::loadMapFile(const std::string& filename)
+{
+  boost::recursive_mutex::scoped_lock cfl(configuration_mutex_);
+
+  map_t* map = map_alloc();
+  ROS_ASSERT(map);
+  if(map_load_bin(map, filename.c_str()) != 0)
+  {
+    ROS_ERROR("Failed to load map file %s", filename.c_str());
+    map_free(map);
+    return false;
+  }
+  ROS_INFO("Loaded a %d X %d map @ %.3f m/pix from %s",
+           map->size_x, map->size_y, map->scale, filename.c_str());
+  if(map->max_occ_dist > 0 && map->max_occ_dist != laser_likelihood_max_dist_)
+    ROS_WARN("Map file stores distances up to %.3f m but laser_likelihood_max_dist is %.3f m; recomputing",
+             map->max_occ_dist, laser_likelihood_max_dist_);
+
+  freeMapDependentMemory();
+  lasers_.clear();
+  frame_to_laser_.clear();
+
+  map_ = map;
+  map_data_.clear();
+  initMapDependentState();
+  return true;
+}
+
+/**
+ * (Re)build everything that depends on map_: the free space index, the
+ * particle filter and the sensor models.
+ */
+void
+AmclNode::initMapDependentState()
+{
 #if NEW_UNIFORM_SAMPLING
   // Index of free space
-  free_space_indices.resize(0);
-  for(int i = 0; i < map_->size_x; i++)
-    for(int j = 0; j < map_->size_y; j++)
-      if(map_->cells[MAP_INDEX(map_,i,j)].occ_state == -1)
-        free_space_indices.push_back(std::make_pair(i,j));
+  free_space_index = map_free_index_alloc(map_);
+  updateFreeSpaceWeights();
 #endif
   // Create the particle filter
   pf_ = pf_alloc(min_particles_, max_particles_,
@@ -1038,8 +1643,7 @@ AmclNode::handleMapMessage(const nav_msgs::OccupancyGrid& msg)
   pf_init_pose_cov.m[2][2] = init_cov_[2];
   pf_init(pf_, pf_init_pose_mean, pf_init_pose_cov);
   pf_init_ = false;
-  pf_init_scan=false;
-  pf_init_cam=false;
+  resetUpdateGates();
 
   // Instantiate the sensor objects
   // Odometry
@@ -1047,6 +1651,7 @@ AmclNode::handleMapMessage(const nav_msgs::OccupancyGrid& msg)
   odom_ = new AMCLOdom();
   ROS_ASSERT(odom_);
   odom_->SetModel( odom_model_type_, alpha1_, alpha2_, alpha3_, alpha4_, alpha5_ );
+  odom_->parallel = odom_parallel_;
   // Laser
   delete laser_;
   laser_ = new AMCLLaser(max_beams_, map_);
@@ -1073,15 +1678,25 @@ AmclNode::handleMapMessage(const nav_msgs::OccupancyGrid& msg)
   delete marker_;
   marker_=new AMCLMarker(simulation);
   ROS_ASSERT(marker_);
-  if (marker_model_type_==MARKER_MODEL_LIKELIHOOD){
-      marker_->SetModelLikelihoodField(marker_z_hit,marker_z_rand,marker_sigma_hit,marker_landa,marker_coeff);
-      marker_->map=marker_map;
-      marker_->tf_cameras=tf_cameras;
+  {
+      if (marker_model_type_==MARKER_MODEL_BEARING)
+          marker_->SetModelBearing(marker_z_rand,marker_landa);
+      else
+          marker_->SetModelLikelihoodField(marker_z_hit,marker_z_rand,marker_sigma_hit,marker_landa,marker_coeff);
+      marker_->map=&marker_table_;
+      marker_->visibility=marker_visibility_;
+      marker_->bin_evaluation=marker_bin_evaluation_;
+      marker_->SetMissModel(marker_miss_prob_);
       marker_->num_cam=num_cam;
       marker_->image_width=image_width;
       marker_->image_height=image_height;
+      marker_->SetCalibration(camera_calibration_);
+      if(camera_extrinsics_from_tf_)
+          marker_->SetCameraExtrinsics(camera_extrinsics_);
+      marker_->SetCameraRig(camera_poses_,camera_u_offsets_);
       marker_->simulation=simulation;
   }
+  updateMarkerVisibility();
   // In case the initial pose message arrived before the first map,
   // try to apply the initial pose now that the map has arrived.
   applyInitialPose();
@@ -1095,6 +1710,10 @@ AmclNode::freeMapDependentMemory()
     map_free( map_ );
     map_ = NULL;
   }
+#if NEW_UNIFORM_SAMPLING
+  map_free_index_free( free_space_index );
+  free_space_index = NULL;
+#endif
   if( pf_ != NULL ) {
     pf_free( pf_ );
     pf_ = NULL;
@@ -1105,6 +1724,10 @@ AmclNode::freeMapDependentMemory()
   laser_ = NULL;
   delete marker_;
   marker_=NULL;
+  // Queued data points to the sensors
+  fusion_queue_.clear();
+  map_visibility_free( marker_visibility_ );
+  marker_visibility_ = NULL;
 }
 
 /**
@@ -1135,11 +1758,33 @@ AmclNode::convertMap( const nav_msgs::OccupancyGrid& map_msg )
       map->cells[i].occ_state = 0;
   }
 
+  // Drop the unknown border, keeping enough margin for the likelihood field
+  if(crop_map_ && map_crop(map, laser_likelihood_max_dist_) == 0)
+  {
+    ROS_INFO("Cropped map to %d X %d cells around known space",
+             map->size_x, map->size_y);
+  }
+
   return map;
 }
 
 AmclNode::~AmclNode()
 {
+  {
+    boost::mutex::scoped_lock li(input_mutex_);
+    boost::mutex::scoped_lock lt(tf_mutex_);
+    threads_stop_ = true;
+    input_cond_.notify_all();
+    tf_cond_.notify_all();
+  }
+  if(filter_thread_){
+    filter_thread_->join();
+    delete filter_thread_;
+  }
+  if(transform_thread_){
+    transform_thread_->join();
+    delete transform_thread_;
+  }
   delete dsrv_;
   freeMapDependentMemory();
   delete laser_scan_filter_;
@@ -1148,6 +1793,7 @@ AmclNode::~AmclNode()
   delete tf_;
   delete marker_detection_filter_;
   delete marker_detection_sub_;
+  delete odom_history_;
   // TODO: delete everything allocated in constructor
 }
 
@@ -1156,6 +1802,21 @@ AmclNode::getOdomPose(tf::Stamped<tf::Pose>& odom_pose,
                       double& x, double& y, double& yaw,
                       const ros::Time& t, const std::string& f)
 {
+  // From the odometry history if it has the time
+  pf_vector_t p;
+  if(odom_history_ && odom_history_->Lookup(t.toSec(), odom_history_tolerance_, p))
+  {
+    odom_pose = tf::Stamped<tf::Pose>(tf::Pose(tf::createQuaternionFromYaw(p.v[2]),
+                                               tf::Vector3(p.v[0], p.v[1], 0)),
+                                      t, odom_frame_id_);
+    x = p.v[0];
+    y = p.v[1];
+    yaw = p.v[2];
+    return true;
+  }
+  if(odom_history_)
+    ROS_WARN_THROTTLE(1.0, "No odometry at %.3f in the odometry history, trying tf", t.toSec());
+
   // Get the robot's pose
   tf::Stamped<tf::Pose> ident (tf::Transform(tf::createIdentityQuaternion(),
                                            tf::Vector3(0,0,0)), t, f);
@@ -1171,20 +1832,6 @@ AmclNode::getOdomPose(tf::Stamped<tf::Pose>& odom_pose,
   }
   x = odom_pose.getOrigin().x();
   y = odom_pose.getOrigin().y();
-
-  geometry_msgs::PoseStamped odom;
-  odom.pose.position.x=x;
-  odom.pose.position.y=y;
-  odom.pose.position.z=0.0;
-  odom.pose.orientation.x= odom_pose.getRotation().getX();
-  odom.pose.orientation.y= odom_pose.getRotation().getY();
-  odom.pose.orientation.z= odom_pose.getRotation().getZ();
-  odom.pose.orientation.w= odom_pose.getRotation().getW();
-  odom.header.stamp=ros::Time::now();
-  odom.header.frame_id=odom_frame_id_;
-  odometry.header.stamp=ros::Time::now();
-  odometry.header.frame_id=odom_frame_id_;
-  odometry.poses.push_back(odom);
   double pitch,roll;
   odom_pose.getBasis().getEulerYPR(yaw, pitch, roll);
 
@@ -1198,11 +1845,13 @@ AmclNode::uniformPoseGenerator(void* arg)
 {
   map_t* map = (map_t*)arg;
 #if NEW_UNIFORM_SAMPLING
-  unsigned int rand_index = drand48() * free_space_indices.size();
-  std::pair<int,int> free_point = free_space_indices[rand_index];
-  pf_vector_t p;
-  p.v[0] = MAP_WXGX(map, free_point.first);
-  p.v[1] = MAP_WYGY(map, free_point.second);
+  pf_vector_t p = pf_vector_zero();
+  int cell = map_free_index_sample(free_space_index);
+  if(cell >= 0)
+  {
+    p.v[0] = MAP_WXGX(map, cell % map->size_x);
+    p.v[1] = MAP_WYGY(map, cell / map->size_x);
+  }
   p.v[2] = drand48() * 2 * M_PI - M_PI;
 #else
   double min_x, max_x, min_y, max_y;
@@ -1231,6 +1880,111 @@ AmclNode::uniformPoseGenerator(void* arg)
   return p;
 }
 
+/**
+ * Draw a recovery particle around one of the poses recovered from the
+ * markers, picked at random.  A pose from a single marker is first turned
+ * about the marker, which keeps the marker where it was seen.
+ */
+pf_vector_t
+AmclNode::markerPoseGenerator(void* arg)
+{
+  AmclNode* node = (AmclNode*)arg;
+  const std::vector<marker_hypothesis_t>& hyps = node->marker_hypotheses_;
+  const marker_hypothesis_t& h = hyps[(int)(drand48() * hyps.size()) % hyps.size()];
+
+  pf_vector_t p = h.pose;
+  if(h.single)
+  {
+    double a = pf_ran_gaussian(node->marker_recovery_sigma_view_);
+    double dx = p.v[0] - h.pivot_x, dy = p.v[1] - h.pivot_y;
+    p.v[0] = h.pivot_x + cos(a) * dx - sin(a) * dy;
+    p.v[1] = h.pivot_y + sin(a) * dx + cos(a) * dy;
+    p.v[2] += a;
+  }
+  p.v[0] += pf_ran_gaussian(node->marker_recovery_sigma_xy_);
+  p.v[1] += pf_ran_gaussian(node->marker_recovery_sigma_xy_);
+  p.v[2] = normalize(p.v[2] + pf_ran_gaussian(node->marker_recovery_sigma_yaw_));
+  return p;
+}
+
+#if NEW_UNIFORM_SAMPLING
+/**
+ * Optionally bias the uniform pose generator towards free cells with
+ * markers nearby, where a marker update can quickly confirm or reject
+ * the injected particles.  Each free cell gets weight
+ * 1 + uniform_marker_bias * (number of markers within range).
+ */
+void
+AmclNode::updateFreeSpaceWeights()
+{
+  if(free_space_index == NULL || free_space_index->count == 0)
+    return;
+  if(uniform_marker_bias_ <= 0.0 || marker_table_.Size() == 0)
+  {
+    map_free_index_set_weights(free_space_index, NULL);
+    return;
+  }
+
+  // Marker centres on the floor plane
+  std::vector<double> mx, my;
+  for(int m = 0; m < marker_table_.Size(); m++)
+  {
+    mx.push_back(marker_table_.CenterX()[m]);
+    my.push_back(marker_table_.CenterY()[m]);
+  }
+
+  double range2 = uniform_marker_bias_range_ * uniform_marker_bias_range_;
+  std::vector<double> weights(free_space_index->count);
+  #pragma omp parallel for schedule(static)
+  for(int k = 0; k < free_space_index->count; k++)
+  {
+    int cell = free_space_index->cells[k];
+    double x = MAP_WXGX(map_, cell % map_->size_x);
+    double y = MAP_WYGY(map_, cell / map_->size_x);
+    int near = 0;
+    for(size_t m = 0; m < mx.size(); m++)
+      if((x-mx[m])*(x-mx[m]) + (y-my[m])*(y-my[m]) < range2)
+        near++;
+    weights[k] = 1.0 + uniform_marker_bias_ * near;
+  }
+  if(map_free_index_set_weights(free_space_index, &weights[0]) < 0)
+    ROS_WARN("Invalid free space weights; using uniform sampling");
+}
+#endif
+
+/**
+ * Rebuild the grid of markers in line of sight, used by the marker model
+ * to skip projecting markers a particle cannot see.  Disabled when
+ * marker_visibility_resolution is not positive.
+ */
+void
+AmclNode::updateMarkerVisibility()
+{
+  map_visibility_free(marker_visibility_);
+  marker_visibility_ = NULL;
+
+  if(map_ != NULL && marker_visibility_resolution_ > 0.0 && marker_table_.Size() > 0)
+  {
+    marker_visibility_points_.clear();
+    for(int k = 0; k < MARKER_CORNERS * marker_table_.Size(); k++)
+    {
+      marker_visibility_points_.push_back(marker_table_.CornerX()[k]);
+      marker_visibility_points_.push_back(marker_table_.CornerY()[k]);
+    }
+    ros::WallTime start = ros::WallTime::now();
+    marker_visibility_ = map_visibility_alloc(map_, &marker_visibility_points_[0],
+                                              marker_table_.Size(), MARKER_CORNERS,
+                                              marker_visibility_resolution_,
+                                              marker_visibility_range_);
+    ROS_INFO("Built %d X %d marker visibility grid for %d markers in %.3f s",
+             marker_visibility_->size_x, marker_visibility_->size_y,
+             marker_table_.Size(), (ros::WallTime::now() - start).toSec());
+  }
+
+  if(marker_ != NULL)
+    marker_->visibility = marker_visibility_;
+}
+
 bool
 AmclNode::globalLocalizationCallback(std_srvs::Empty::Request& req,
                                      std_srvs::Empty::Response& res)
@@ -1244,8 +1998,7 @@ AmclNode::globalLocalizationCallback(std_srvs::Empty::Request& req,
                 (void *)map_);
   ROS_INFO("Global initialisation done!");
   pf_init_ = false;
-  pf_init_scan=false;
-  pf_init_cam=false;
+  resetUpdateGates();
   return true;
 }
 
@@ -1254,8 +2007,9 @@ bool
 AmclNode::nomotionUpdateCallback(std_srvs::Empty::Request& req,
                                      std_srvs::Empty::Response& res)
 {       cout<<"no motion"<<endl;
-        m_force_update_scan = true;
-        m_force_update_cam=true;
+        boost::recursive_mutex::scoped_lock nm(configuration_mutex_);
+        update_gates_[0].force = true;
+        update_gates_[1].force = true;
 	//ROS_INFO("Requesting no-motion update");
 	return true;
 }
@@ -1285,7 +2039,6 @@ AmclNode::laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan)
       {
         ROS_DEBUG("Setting up laser %d (frame_id=%s)\n", (int)frame_to_laser_.size(), laser_scan->header.frame_id.c_str());
         lasers_.push_back(new AMCLLaser(*laser_));
-        lasers_update_.push_back(true);
         laser_index = frame_to_laser_.size();
 
         tf::Stamped<tf::Pose> ident (tf::Transform(tf::createIdentityQuaternion(),
@@ -1331,381 +2084,87 @@ AmclNode::laserReceived(const sensor_msgs::LaserScanConstPtr& laser_scan)
         return;
       }
 
-      pf_vector_t delta = pf_vector_zero();
-        pf_vector_t delta_update = pf_vector_zero();
-
-        if(pf_init_scan)
-        {
-          // Compute change in pose since last filter actualization (could be camera)
-          //delta = pf_vector_coord_sub(pose, pf_odom_pose_);
-          delta.v[0] = pose.v[0] - pf_odom_pose_.v[0];
-          delta.v[1] = pose.v[1] - pf_odom_pose_.v[1];
-          delta.v[2] = angle_diff(pose.v[2], pf_odom_pose_.v[2]);
-
-          //Change in pose since last laser actualization
-          delta_update.v[0]=pose.v[0]-latest_odom_pose_scan.v[0];
-          delta_update.v[1]=pose.v[1]-latest_odom_pose_scan.v[1];
-          delta_update.v[2]=angle_diff(pose.v[2], latest_odom_pose_scan.v[2]);
-          // See if we should update the filter
-          bool update = fabs(delta_update.v[0]) > d_thresh_ ||
-                        fabs(delta_update.v[1]) > d_thresh_ ||
-                        fabs(delta_update.v[2]) > a_thresh_;
-          update = update || m_force_update_scan;
-          m_force_update_scan=false;
-
-          // Set the laser update flags
-          if(update)
-            for(unsigned int i=0; i < lasers_update_.size(); i++)
-              lasers_update_[i] = true;
-        }
+      // Queue the scan; the update gate decides whether it is used
+      AMCLLaserData* ldata = new AMCLLaserData;
+      boost::shared_ptr<AMCLSensorData> data(ldata);
+      ldata->sensor = lasers_[laser_index];
+      ldata->range_count = laser_scan->ranges.size();
+
+      // To account for lasers that are mounted upside-down, we determine the
+      // min, max, and increment angles of the laser in the base frame.
+      //
+      // Construct min and max angles of laser, in the base_link frame.
+      tf::Quaternion q;
+      q.setRPY(0.0, 0.0, laser_scan->angle_min);
+      tf::Stamped<tf::Quaternion> min_q(q, laser_scan->header.stamp,
+                                        laser_scan->header.frame_id);
+      q.setRPY(0.0, 0.0, laser_scan->angle_min + laser_scan->angle_increment);
+      tf::Stamped<tf::Quaternion> inc_q(q, laser_scan->header.stamp,
+                                        laser_scan->header.frame_id);
+      try
+      {
+        tf_->transformQuaternion(base_frame_id_, min_q, min_q);
+        tf_->transformQuaternion(base_frame_id_, inc_q, inc_q);
+      }
+      catch(tf::TransformException& e)
+      {
+        ROS_WARN("Unable to transform min/max laser angles into base frame: %s",
+                 e.what());
+        return;
+      }
 
-        bool force_publication = false;
-        if(!pf_init_scan)
-        {
-          // Pose at last filter update
-          pf_odom_pose_ = pose;
-          latest_odom_pose_scan=pose;
+      double angle_min = tf::getYaw(min_q);
+      double angle_increment = tf::getYaw(inc_q) - angle_min;
+
+      // wrapping angle to [-pi .. pi]
+      angle_increment = fmod(angle_increment + 5*M_PI, 2*M_PI) - M_PI;
+
+      ROS_DEBUG("Laser %d angles in base frame: min: %.3f inc: %.3f", laser_index, angle_min, angle_increment);
+
+      // Apply range min/max thresholds, if the user supplied them
+      if(laser_max_range_ > 0.0)
+        ldata->range_max = std::min(laser_scan->range_max, (float)laser_max_range_);
+      else
+        ldata->range_max = laser_scan->range_max;
+      double range_min;
+      if(laser_min_range_ > 0.0)
+        range_min = std::max(laser_scan->range_min, (float)laser_min_range_);
+      else
+        range_min = laser_scan->range_min;
+      // The AMCLLaserData destructor will free this memory
+      ldata->ranges = new double[ldata->range_count][2];
+      ROS_ASSERT(ldata->ranges);
+      for(int i=0;i<ldata->range_count;i++)
+      {
+        // amcl doesn't (yet) have a concept of min range.  So we'll map short
+        // readings to max range.
+        if(laser_scan->ranges[i] <= range_min)
+          ldata->ranges[i][0] = ldata->range_max;
+        else
+          ldata->ranges[i][0] = laser_scan->ranges[i];
+        // Compute bearing
+        ldata->ranges[i][1] = angle_min +
+                (i * angle_increment);
+      }
 
-          // Filter is now initialized
-          pf_init_scan= true;
+      queueUpdate(laser_scan->header.stamp, pose, lasers_[laser_index], data, false);
+}
 
-          // Should update sensor data
-          for(unsigned int i=0; i < lasers_update_.size(); i++)
-            lasers_update_[i] = true;
+double
+AmclNode::getYaw(tf::Pose& t)
+{
+  double yaw, pitch, roll;
+  t.getBasis().getEulerYPR(yaw,pitch,roll);
+  return yaw;
+}
 
-          force_publication = true;
-
-          resample_count_scan = 0;
-        }
-        // If the robot has moved, update the filter
-        else if(pf_init_scan && lasers_update_[laser_index])
-        {
-          //printf("pose\n");
-          //pf_vector_fprintf(pose, stdout, "%.3f");
-
-          AMCLOdomData odata;
-          odata.pose = pose;
-          // HACK
-          // Modify the delta in the action data so the filter gets
-          // updated correctly
-          odata.delta = delta;
-
-          // Use the action data to update the filter
-          odom_->UpdateAction(pf_, (AMCLSensorData*)&odata);
-
-          // Pose at last filter update
-          //this->pf_odom_pose = pose;
-        }
-
-        bool resampled = false;
-        // If the robot has moved, update the filter
-        if(lasers_update_[laser_index])
-        {
-          AMCLLaserData ldata;
-          ldata.sensor = lasers_[laser_index];
-          ldata.range_count = laser_scan->ranges.size();
-
-          // To account for lasers that are mounted upside-down, we determine the
-          // min, max, and increment angles of the laser in the base frame.
-          //
-          // Construct min and max angles of laser, in the base_link frame.
-          tf::Quaternion q;
-          q.setRPY(0.0, 0.0, laser_scan->angle_min);
-          tf::Stamped<tf::Quaternion> min_q(q, laser_scan->header.stamp,
-                                            laser_scan->header.frame_id);
-          q.setRPY(0.0, 0.0, laser_scan->angle_min + laser_scan->angle_increment);
-          tf::Stamped<tf::Quaternion> inc_q(q, laser_scan->header.stamp,
-                                            laser_scan->header.frame_id);
-          try
-          {
-            tf_->transformQuaternion(base_frame_id_, min_q, min_q);
-            tf_->transformQuaternion(base_frame_id_, inc_q, inc_q);
-          }
-          catch(tf::TransformException& e)
-          {
-            ROS_WARN("Unable to transform min/max laser angles into base frame: %s",
-                     e.what());
-            return;
-          }
-
-          double angle_min = tf::getYaw(min_q);
-          double angle_increment = tf::getYaw(inc_q) - angle_min;
-
-          // wrapping angle to [-pi .. pi]
-          angle_increment = fmod(angle_increment + 5*M_PI, 2*M_PI) - M_PI;
-
-          ROS_DEBUG("Laser %d angles in base frame: min: %.3f inc: %.3f", laser_index, angle_min, angle_increment);
-
-          // Apply range min/max thresholds, if the user supplied them
-          if(laser_max_range_ > 0.0)
-            ldata.range_max = std::min(laser_scan->range_max, (float)laser_max_range_);
-          else
-            ldata.range_max = laser_scan->range_max;
-          double range_min;
-          if(laser_min_range_ > 0.0)
-            range_min = std::max(laser_scan->range_min, (float)laser_min_range_);
-          else
-            range_min = laser_scan->range_min;
-          // The AMCLLaserData destructor will free this memory
-          ldata.ranges = new double[ldata.range_count][2];
-          ROS_ASSERT(ldata.ranges);
-          for(int i=0;i<ldata.range_count;i++)
-          {
-            // amcl doesn't (yet) have a concept of min range.  So we'll map short
-            // readings to max range.
-            if(laser_scan->ranges[i] <= range_min)
-              ldata.ranges[i][0] = ldata.range_max;
-            else
-              ldata.ranges[i][0] = laser_scan->ranges[i];
-            // Compute bearing
-            ldata.ranges[i][1] = angle_min +
-                    (i * angle_increment);
-          }
-
-          lasers_[laser_index]->UpdateSensor(pf_, (AMCLSensorData*)&ldata);
-          updated_scan=true;
-          cout<<"Updated laser"<<endl;
-
-          lasers_update_[laser_index] = false;
-
-          latest_odom_pose_scan=pose;
-          pf_odom_pose_ = pose;
-
-          // Resample the particles
-          //if(!(++resample_count_scan % resample_interval_))
-          //{
-            pf_update_resample(pf_);
-            resampled = true;
-         // }
-
-          pf_sample_set_t* set = pf_->sets + pf_->current_set;
-          ROS_DEBUG("Num samples: %d\n", set->sample_count);
-
-          // Publish the resulting cloud
-          // TODO: set maximum rate for publishing
-          if (!m_force_update_scan) {
-            geometry_msgs::PoseArray cloud_msg;
-            cloud_msg.header.stamp = ros::Time::now();
-            cloud_msg.header.frame_id = global_frame_id_;
-            cloud_msg.poses.resize(set->sample_count);
-            for(int i=0;i<set->sample_count;i++)
-            {
-              tf::poseTFToMsg(tf::Pose(tf::createQuaternionFromYaw(set->samples[i].pose.v[2]),
-                                       tf::Vector3(set->samples[i].pose.v[0],
-                                                 set->samples[i].pose.v[1], 0)),
-                              cloud_msg.poses[i]);
-            }
-            particlecloud_pub_.publish(cloud_msg);
-          }
-        }
-
-        if(resampled || force_publication)
-        {
-          if (!resampled)
-          {
-                  // re-compute the cluster statistics
-                  pf_cluster_stats(pf_, pf_->sets);
-          }
-          // Read out the current hypotheses
-          double max_weight = 0.0;
-          int max_weight_hyp = -1;
-          std::vector<amcl_hyp_t> hyps;
-          hyps.resize(pf_->sets[pf_->current_set].cluster_count);
-          for(int hyp_count = 0;
-              hyp_count < pf_->sets[pf_->current_set].cluster_count; hyp_count++)
-          {
-            double weight;
-            pf_vector_t pose_mean;
-            pf_matrix_t pose_cov;
-            if (!pf_get_cluster_stats(pf_, hyp_count, &weight, &pose_mean, &pose_cov))
-            {
-              ROS_ERROR("Couldn't get stats on cluster %d", hyp_count);
-              break;
-            }
-
-            hyps[hyp_count].weight = weight;
-            hyps[hyp_count].pf_pose_mean = pose_mean;
-            hyps[hyp_count].pf_pose_cov = pose_cov;
-
-            if(hyps[hyp_count].weight > max_weight)
-            {
-              max_weight = hyps[hyp_count].weight;
-              max_weight_hyp = hyp_count;
-            }
-          }
-
-          if(max_weight > 0.0)
-          {
-            ROS_DEBUG("Max weight pose: %.3f %.3f %.3f",
-                      hyps[max_weight_hyp].pf_pose_mean.v[0],
-                      hyps[max_weight_hyp].pf_pose_mean.v[1],
-                      hyps[max_weight_hyp].pf_pose_mean.v[2]);
-
-            /*
-               puts("");
-               pf_matrix_fprintf(hyps[max_weight_hyp].pf_pose_cov, stdout, "%6.3f");
-               puts("");
-             */
-
-            geometry_msgs::PoseWithCovarianceStamped p;
-            // Fill in the header
-            p.header.frame_id = global_frame_id_;
-            p.header.stamp = laser_scan->header.stamp;
-            // Copy in the pose
-            p.pose.pose.position.x = hyps[max_weight_hyp].pf_pose_mean.v[0];
-            p.pose.pose.position.y = hyps[max_weight_hyp].pf_pose_mean.v[1];
-            tf::quaternionTFToMsg(tf::createQuaternionFromYaw(hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                                  p.pose.pose.orientation);
-            // Copy in the covariance, converting from 3-D to 6-D
-            pf_sample_set_t* set = pf_->sets + pf_->current_set;
-            for(int i=0; i<2; i++)
-            {
-              for(int j=0; j<2; j++)
-              {
-                // Report the overall filter covariance, rather than the
-                // covariance for the highest-weight cluster
-                //p.covariance[6*i+j] = hyps[max_weight_hyp].pf_pose_cov.m[i][j];
-                p.pose.covariance[6*i+j] = set->cov.m[i][j];
-              }
-            }
-            // Report the overall filter covariance, rather than the
-            // covariance for the highest-weight cluster
-            //p.covariance[6*5+5] = hyps[max_weight_hyp].pf_pose_cov.m[2][2];
-            p.pose.covariance[6*5+5] = set->cov.m[2][2];
-
-            /*
-               printf("cov:\n");
-               for(int i=0; i<6; i++)
-               {
-               for(int j=0; j<6; j++)
-               printf("%6.3f ", p.covariance[6*i+j]);
-               puts("");
-               }
-             */
-            amcl_doris::pose_error p_error;
-
-            float error_x=p.pose.pose.position.x-ground_truth_x_;
-            float error_y=p.pose.pose.position.y-ground_truth_y_;
-
-            p_error.vec_error.data.push_back(p.pose.pose.position.x-ground_truth_x_);
-            p_error.vec_error.data.push_back(p.pose.pose.position.y-ground_truth_y_);
-            p_error.vec_error.data.push_back(sqrt((error_x*error_x)+(error_y*error_y)));
-            p_error.vec_error.data.push_back(hyps[max_weight_hyp].pf_pose_mean.v[2]-ground_truth_yaw_);
-            p_error.num_markers.data=0;
-
-            p_error.header.stamp=ros::Time::now();
-            error_pub.publish(p_error);
-
-            pose_pub_.publish(p);
-            last_published_pose = p;
-
-            ROS_DEBUG("New pose: %6.3f %6.3f %6.3f",
-                     hyps[max_weight_hyp].pf_pose_mean.v[0],
-                     hyps[max_weight_hyp].pf_pose_mean.v[1],
-                     hyps[max_weight_hyp].pf_pose_mean.v[2]);
-
-            // subtracting base to odom from map to base and send map to odom instead
-            tf::Stamped<tf::Pose> odom_to_map;
-            try
-            {
-              tf::Transform tmp_tf(tf::createQuaternionFromYaw(hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                                   tf::Vector3(hyps[max_weight_hyp].pf_pose_mean.v[0],
-                                               hyps[max_weight_hyp].pf_pose_mean.v[1],
-                                               0.0));
-              tf::Stamped<tf::Pose> tmp_tf_stamped (tmp_tf.inverse(),
-                                                    laser_scan->header.stamp,
-                                                    base_frame_id_);
-              this->tf_->transformPose(odom_frame_id_,
-                                       tmp_tf_stamped,
-                                       odom_to_map);
-            }
-            catch(tf::TransformException)
-            {
-              ROS_DEBUG("Failed to subtract base to odom transform");
-              return;
-            }
-
-            latest_tf_ = tf::Transform(tf::Quaternion(odom_to_map.getRotation()),
-                                       tf::Point(odom_to_map.getOrigin()));
-            latest_tf_valid_ = true;
-
-            if (tf_broadcast_ == true)
-            {
-              // We want to send a transform that is good up until a
-              // tolerance time so that odom can be used
-              ros::Time transform_expiration = (laser_scan->header.stamp +
-                                                transform_tolerance_);
-              tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                                  transform_expiration,
-                                                  global_frame_id_, odom_frame_id_);
-              this->tfb_->sendTransform(tmp_tf_stamped);
-              sent_first_transform_ = true;
-            }
-          }
-          else
-          {
-            ROS_ERROR("No pose!");
-          }
-        }
-        else if(latest_tf_valid_)
-        {
-          if (tf_broadcast_ == true)
-          {
-            // Nothing changed, so we'll just republish the last transform, to keep
-            // everybody happy.
-            ros::Time transform_expiration = (laser_scan->header.stamp +
-                                              transform_tolerance_);
-            tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                                transform_expiration,
-                                                global_frame_id_, odom_frame_id_);
-            this->tfb_->sendTransform(tmp_tf_stamped);
-          }
-
-          // Is it time to save our last pose to the param server
-          ros::Time now = ros::Time::now();
-          if((save_pose_period.toSec() > 0.0) &&
-             (now - save_pose_last_time) >= save_pose_period)
-          {
-            this->savePoseToServer();
-            save_pose_last_time = now;
-          }
-        }
-
-        geometry_msgs::PoseStamped pose_g,pose_o;
-        pose_g.pose=ground_truth;
-        pose_g.header.stamp=ros::Time::now();
-        if(simulation == 1){
-            reference.poses.push_back(pose_g);
-        }
-
-        pose_o.pose=last_published_pose.pose.pose;
-        pose_o.header.stamp=ros::Time::now();
-        output.poses.push_back(pose_o);
-        reference.header.frame_id="map";
-        output.header.frame_id="map";
-        if(simulation==0){
-            reference.poses.push_back(real_odom);
-        }
-        path_pub_r.publish(reference);
-        path_pub_out.publish(output);
-
-}
-
-double
-AmclNode::getYaw(tf::Pose& t)
-{
-  double yaw, pitch, roll;
-  t.getBasis().getEulerYPR(yaw,pitch,roll);
-  return yaw;
-}
-
-void
-AmclNode::initialPoseReceived(const geometry_msgs::PoseWithCovarianceStampedConstPtr& msg)
-{
-  //cout<<"he recibido initial pose"<<endl;
-  //waitKey();
-  handleInitialPoseMessage(*msg);
-}
+void
+AmclNode::initialPoseReceived(const geometry_msgs::PoseWithCovarianceStampedConstPtr& msg)
+{
+  //cout<<"he recibido initial pose"<<endl;
+  //waitKey();
+  handleInitialPoseMessage(*msg);
+}
 
 void
 AmclNode::handleInitialPoseMessage(const geometry_msgs::PoseWithCovarianceStamped& msg)
@@ -1798,13 +2257,631 @@ AmclNode::applyInitialPose()
     cout<<"initpose2"<<endl;
     pf_init(pf_, initial_pose_hyp_->pf_pose_mean, initial_pose_hyp_->pf_pose_cov);
     pf_init_ = false;
-    pf_init_scan=false;
-    pf_init_cam=false;
+    resetUpdateGates();
     delete initial_pose_hyp_;
     initial_pose_hyp_ = NULL;
   }
 }
 
+/**
+ * @brief AmclNode::applyMotion move the particles by the odometry since
+ * they were last moved.  Sensors only record their odometry pose; the
+ * motion model is applied here, once and with the combined delta, right
+ * before a sensor update or a pose publication, so skipped messages cost
+ * nothing and alternating sensors don't sample noise twice.
+ * @param pose : odometry pose the particles should be at
+ */
+void AmclNode::applyMotion(const pf_vector_t& pose){
+    if(!pf_init_){
+        pf_odom_pose_=pose;
+        pf_init_=true;
+        return;
+    }
+    pf_vector_t delta;
+    delta.v[0]=pose.v[0]-pf_odom_pose_.v[0];
+    delta.v[1]=pose.v[1]-pf_odom_pose_.v[1];
+    delta.v[2]=angle_diff(pose.v[2],pf_odom_pose_.v[2]);
+    if(delta.v[0]==0.0 && delta.v[1]==0.0 && delta.v[2]==0.0)
+        return;
+
+    AMCLOdomData odata;
+    odata.pose=pose;
+    odata.delta=delta;
+    odom_->UpdateAction(pf_,(AMCLSensorData*)&odata);
+    pf_odom_pose_=pose;
+}
+
+/**
+ * @brief AmclNode::resetUpdateGates let the next message of each modality
+ * through and have it publish, after the filter is (re)initialized
+ */
+void AmclNode::resetUpdateGates(){
+    for(int i=0;i<2;i++){
+        update_gates_[i].init=false;
+        update_gates_[i].force=false;
+        update_gates_[i].done.clear();
+    }
+}
+
+/**
+ * @brief AmclNode::queueUpdate pass an observation through the update gate
+ * of its modality and, if it is due, add it to the fusion queue, which is
+ * kept in stamp order.  Then fuse what is due and publish.
+ * @param stamp : time of the observation
+ * @param pose : odometry pose at that time
+ * @param sensor : sensor that made it
+ * @param data : sensor data, with its sensor set; NULL if there is nothing
+ * to fuse, which still uses up the update of the sensor
+ * @param marker : true for marker detections, false for scans
+ */
+void AmclNode::queueUpdate(const ros::Time& stamp, const pf_vector_t& pose, AMCLSensor* sensor,
+                           const boost::shared_ptr<AMCLSensorData>& data, bool marker){
+    UpdateGate& gate=update_gates_[marker ? 1 : 0];
+    bool force_publication=false;
+    if(!gate.init){
+        gate.init=true;
+        gate.done.clear();
+        force_publication=true;
+        if(marker)
+            resample_count_cam=0;
+    }else{
+        bool update=fabs(pose.v[0]-gate.pose.v[0]) > d_thresh_ ||
+                    fabs(pose.v[1]-gate.pose.v[1]) > d_thresh_ ||
+                    fabs(angle_diff(pose.v[2],gate.pose.v[2])) > a_thresh_;
+        if(update || gate.force)
+            gate.done.clear();
+        gate.force=false;
+    }
+
+    if(gate.done.insert(sensor).second){
+        gate.pose=pose;
+        if(data){
+            FusionItem item;
+            item.stamp=stamp;
+            item.pose=pose;
+            item.data=data;
+            item.marker=marker;
+            std::vector<FusionItem>::iterator it=fusion_queue_.end();
+            while(it!=fusion_queue_.begin() && (it-1)->stamp>stamp)
+                --it;
+            fusion_queue_.insert(it,item);
+        }
+    }
+
+    finishUpdate(stamp, pose, force_publication, marker);
+}
+
+/**
+ * @brief AmclNode::fuseQueue update the filter with the queued observations.
+ * Observations within sensor_fusion_window of the oldest one form a group;
+ * a group is fused once a later observation or the clock is past the window.
+ * @return true if a pose was published
+ */
+bool AmclNode::fuseQueue(){
+    bool published=false;
+    while(!fusion_queue_.empty()){
+        ros::Time end=fusion_queue_.front().stamp+ros::Duration(fusion_window_);
+        ros::Time now=replay_now_.isZero() ? ros::Time::now() : replay_now_;
+        if(fusion_window_>0.0 && fusion_queue_.back().stamp<=end && now<=end)
+            break;
+        std::vector<FusionItem>::iterator last=fusion_queue_.begin();
+        while(last!=fusion_queue_.end() && last->stamp<=end)
+            ++last;
+        std::vector<FusionItem> group(fusion_queue_.begin(),last);
+        fusion_queue_.erase(fusion_queue_.begin(),last);
+        fuseGroup(group);
+        published=true;
+    }
+    return published;
+}
+
+/**
+ * @brief AmclNode::fusionTimer fuse the queued group once its window has
+ * passed, so the last observation before a sensor stops is not held back
+ * @param event
+ */
+void AmclNode::fusionTimer(const ros::TimerEvent& event){
+    boost::recursive_mutex::scoped_lock lr(configuration_mutex_);
+    fuseQueue();
+}
+
+/**
+ * @brief AmclNode::fuseGroup one sensor pass, one resample and one
+ * publication for a group of observations.  The group is taken as seen
+ * from the odometry pose of its newest observation.
+ * @param group : observations in stamp order
+ */
+void AmclNode::fuseGroup(std::vector<FusionItem>& group){
+    std::vector<AMCLSensorData*> data;
+    AMCLMarkerData* mdata=NULL;
+    int num_markers=-1;
+    bool scans=false;
+    for(size_t i=0;i<group.size();i++){
+        data.push_back(group[i].data.get());
+        if(group[i].marker){
+            mdata=(AMCLMarkerData*)group[i].data.get();
+            num_markers=std::max(num_markers,0)+int(mdata->markers_obs.size());
+        }else{
+            scans=true;
+        }
+    }
+
+    ros::WallTime t0=ros::WallTime::now();
+    applyMotion(group.back().pose);
+    ros::WallTime t1=ros::WallTime::now();
+    AMCLSensor::UpdateSensors(pf_,data);
+    ros::WallTime t2=ros::WallTime::now();
+
+    // Scans resample on every update, detections every resample_interval
+    bool resample=scans;
+    if(mdata!=NULL && !(++resample_count_cam % resample_interval_))
+        resample=true;
+    if(resample){
+        // Recovery particles go where the markers say the robot is, in
+        // the proportion w_slow/w_fast decide; the poses are only worked
+        // out when pf_update_resample will draw some (w_diff > 0)
+        marker_hypotheses_.clear();
+        bool recovery=pf_->w_slow>0.0 && pf_->w_fast<pf_->w_slow;
+        if(marker_recovery_ && recovery && mdata!=NULL && !mdata->markers_obs.empty())
+            ((AMCLMarker*)mdata->sensor)->PoseHypotheses(mdata->markers_obs, marker_hypotheses_);
+        pf_init_model_fn_t random_pose_fn = pf_->random_pose_fn;
+        void* random_pose_data = pf_->random_pose_data;
+        if(!marker_hypotheses_.empty())
+        {
+            pf_->random_pose_fn = (pf_init_model_fn_t)AmclNode::markerPoseGenerator;
+            pf_->random_pose_data = (void*)this;
+        }
+        pf_update_resample(pf_);
+        pf_->random_pose_fn = random_pose_fn;
+        pf_->random_pose_data = random_pose_data;
+    }else{
+        // re-compute the cluster statistics
+        pf_cluster_stats(pf_, pf_->sets);
+    }
+
+    pf_sample_set_t* set = pf_->sets + pf_->current_set;
+    ROS_DEBUG("Fused %d observations, num samples: %d", int(group.size()), set->sample_count);
+
+    ros::WallTime t3=ros::WallTime::now();
+    publishParticleCloud();
+    publishEstimate(group.back().stamp, num_markers);
+    ros::WallTime t4=ros::WallTime::now();
+    stage_time_[0]+=(t1-t0).toSec();
+    stage_time_[1]+=(t2-t1).toSec();
+    stage_time_[2]+=(t3-t2).toSec();
+    stage_time_[3]+=(t4-t3).toSec();
+    fused_groups_++;
+}
+
+/**
+ * @brief AmclNode::publishParticleCloud publish the particles, at most at
+ * gui_publish_rate and only if someone listens.  particlecloud carries
+ * the poses; particlecloud_compact carries x, y, yaw and weight of each
+ * particle as rows of a float32 array.  With cloud_max_particles the
+ * cloud is a low variance resample of that size, whose rows weigh the
+ * same.
+ */
+void AmclNode::publishParticleCloud(){
+    if(replaying_)
+        return;
+    bool poses=particlecloud_pub_.getNumSubscribers()>0;
+    bool compact=particlecloud_compact_pub_.getNumSubscribers()>0;
+    if(!poses && !compact)
+        return;
+    ros::Time now=ros::Time::now();
+    if(gui_publish_period.toSec()>0.0 && now-last_cloud_pub_time<gui_publish_period)
+        return;
+    last_cloud_pub_time=now;
+
+    pf_sample_set_t* set = pf_->sets + pf_->current_set;
+    std::vector<int> index;
+    if(cloud_max_particles_>0 && cloud_max_particles_<set->sample_count){
+        double total=0.0;
+        for(int i=0;i<set->sample_count;i++)
+            total+=set->samples[i].weight;
+        double step=total/cloud_max_particles_;
+        double target=erand48(cloud_rand_)*step;
+        double c=set->samples[0].weight;
+        int i=0;
+        for(int m=0;m<cloud_max_particles_;m++,target+=step){
+            while(c<target && i<set->sample_count-1)
+                c+=set->samples[++i].weight;
+            index.push_back(i);
+        }
+    }else{
+        for(int i=0;i<set->sample_count;i++)
+            index.push_back(i);
+    }
+    bool subsampled=(int)index.size()<set->sample_count;
+
+    if(poses){
+        geometry_msgs::PoseArray cloud_msg;
+        cloud_msg.header.stamp = now;
+        cloud_msg.header.frame_id = global_frame_id_;
+        cloud_msg.poses.resize(index.size());
+        for(size_t k=0;k<index.size();k++){
+            const pf_vector_t& pose=set->samples[index[k]].pose;
+            geometry_msgs::Pose& msg=cloud_msg.poses[k];
+            msg.position.x=pose.v[0];
+            msg.position.y=pose.v[1];
+            msg.orientation.z=sin(0.5*pose.v[2]);
+            msg.orientation.w=cos(0.5*pose.v[2]);
+        }
+        particlecloud_pub_.publish(cloud_msg);
+    }
+    if(compact){
+        std_msgs::Float32MultiArray cloud_msg;
+        cloud_msg.layout.dim.resize(2);
+        cloud_msg.layout.dim[0].label="particles";
+        cloud_msg.layout.dim[0].size=index.size();
+        cloud_msg.layout.dim[0].stride=4*index.size();
+        cloud_msg.layout.dim[1].label="x_y_yaw_weight";
+        cloud_msg.layout.dim[1].size=4;
+        cloud_msg.layout.dim[1].stride=4;
+        cloud_msg.data.resize(4*index.size());
+        for(size_t k=0;k<index.size();k++){
+            const pf_sample_t& sample=set->samples[index[k]];
+            cloud_msg.data[4*k+0]=sample.pose.v[0];
+            cloud_msg.data[4*k+1]=sample.pose.v[1];
+            cloud_msg.data[4*k+2]=sample.pose.v[2];
+            cloud_msg.data[4*k+3]=subsampled ? 1.0/index.size() : sample.weight;
+        }
+        particlecloud_compact_pub_.publish(cloud_msg);
+    }
+}
+
+/**
+ * @brief AmclNode::finishUpdate common end of queueUpdate: fuse
+ * what is due, publish anyway the first time a sensor is seen and keep the
+ * transform alive otherwise
+ * @param stamp : stamp of the message handled
+ * @param pose : odometry pose at that stamp
+ * @param force_publication : publish the estimate even without an update
+ * @param marker : the message was a marker detection
+ */
+void AmclNode::finishUpdate(const ros::Time& stamp, const pf_vector_t& pose,
+                            bool force_publication, bool marker){
+    bool published=fuseQueue();
+    if(!published && force_publication){
+        applyMotion(pose);
+        pf_cluster_stats(pf_, pf_->sets);
+        publishEstimate(stamp, marker ? 0 : -1);
+        published=true;
+    }
+    if(replaying_)
+        return;
+    if(!published && latest_tf_valid_){
+        // Nothing changed, so we'll just republish the last transform, to keep
+        // everybody happy.
+        broadcastTransform(stamp + transform_tolerance_, marker);
+
+        // Is it time to save our last pose to the param server
+        ros::Time now = ros::Time::now();
+        if((save_pose_period.toSec() > 0.0) &&
+           (now - save_pose_last_time) >= save_pose_period)
+        {
+            this->savePoseToServer();
+            save_pose_last_time = now;
+        }
+    }
+
+    //Publish reference and output path.
+    boost::mutex::scoped_lock pl(path_mutex_);
+    geometry_msgs::PoseStamped pose_g,pose_o;
+    pose_g.pose=ground_truth;
+    pose_g.header.stamp=ros::Time::now();
+    if(simulation == 1)
+        reference_path_.add(pose_g);
+    else
+        reference_path_.add(real_odom);
+
+    pose_o.pose=last_published_pose.pose.pose;
+    pose_o.header.stamp=ros::Time::now();
+    output_path_.add(pose_o);
+}
+
+/**
+ * @brief AmclNode::publishEstimate publish the pose of the heaviest cluster
+ * and the map to odom transform
+ * @param stamp : stamp of the estimate
+ * @param num_markers : markers used in the update, -1 if only scans were
+ */
+void AmclNode::publishEstimate(const ros::Time& stamp, int num_markers){
+    // Read out the current hypotheses
+    double max_weight = 0.0;
+    int max_weight_hyp = -1;
+    std::vector<amcl_hyp_t> hyps;
+    hyps.resize(pf_->sets[pf_->current_set].cluster_count);
+    for(int hyp_count = 0;
+        hyp_count < pf_->sets[pf_->current_set].cluster_count; hyp_count++)
+    {
+      double weight;
+      pf_vector_t pose_mean;
+      pf_matrix_t pose_cov;
+      if (!pf_get_cluster_stats(pf_, hyp_count, &weight, &pose_mean, &pose_cov))
+      {
+        ROS_ERROR("Couldn't get stats on cluster %d", hyp_count);
+        break;
+      }
+
+      hyps[hyp_count].weight = weight;
+      hyps[hyp_count].pf_pose_mean = pose_mean;
+      hyps[hyp_count].pf_pose_cov = pose_cov;
+
+      if(hyps[hyp_count].weight > max_weight)
+      {
+        max_weight = hyps[hyp_count].weight;
+        max_weight_hyp = hyp_count;
+      }
+    }
+
+    if(max_weight <= 0.0)
+    {
+      ROS_ERROR("No pose!");
+      return;
+    }
+    const pf_vector_t& mean = hyps[max_weight_hyp].pf_pose_mean;
+    ROS_DEBUG("New pose: %6.3f %6.3f %6.3f", mean.v[0], mean.v[1], mean.v[2]);
+
+    geometry_msgs::PoseWithCovarianceStamped p;
+    // Fill in the header
+    p.header.frame_id = global_frame_id_;
+    p.header.stamp = stamp;
+    // Copy in the pose
+    p.pose.pose.position.x = mean.v[0];
+    p.pose.pose.position.y = mean.v[1];
+    tf::quaternionTFToMsg(tf::createQuaternionFromYaw(mean.v[2]),
+                          p.pose.pose.orientation);
+    // Copy in the covariance, converting from 3-D to 6-D.  Report the
+    // overall filter covariance, rather than the covariance for the
+    // highest-weight cluster
+    pf_sample_set_t* set = pf_->sets + pf_->current_set;
+    for(int i=0; i<2; i++)
+      for(int j=0; j<2; j++)
+        p.pose.covariance[6*i+j] = set->cov.m[i][j];
+    p.pose.covariance[6*5+5] = set->cov.m[2][2];
+
+    if(replaying_){
+      last_published_pose = p;
+      return;
+    }
+
+    //Publishing error with gazebo's ground_truth
+    if(num_markers < 0 || simulation == 1){
+      boost::mutex::scoped_lock pl(path_mutex_);
+      amcl_doris::pose_error p_error;
+
+      float error_x=p.pose.pose.position.x-ground_truth_x_;
+      float error_y=p.pose.pose.position.y-ground_truth_y_;
+
+      p_error.vec_error.data.push_back(p.pose.pose.position.x-ground_truth_x_);
+      p_error.vec_error.data.push_back(p.pose.pose.position.y-ground_truth_y_);
+      p_error.vec_error.data.push_back(sqrt((error_x*error_x)+(error_y*error_y)));
+      p_error.vec_error.data.push_back(mean.v[2]-ground_truth_yaw_);
+      p_error.num_markers.data=std::max(num_markers,0);
+      p_error.header.stamp=ros::Time::now();
+      error_pub.publish(p_error);
+    }
+    if(num_markers >= 0 && simulation == 0){
+      std_msgs::Float64 yaw_out;
+      yaw_out.data=mean.v[2];
+      yaw_amcl.publish(yaw_out);
+    }
+
+    pose_pub_.publish(p);
+    last_published_pose = p;
+
+    // subtracting base to odom from map to base and send map to odom instead
+    tf::Stamped<tf::Pose> odom_to_map;
+    tf::Transform tmp_tf(tf::createQuaternionFromYaw(mean.v[2]),
+                         tf::Vector3(mean.v[0], mean.v[1], 0.0));
+    if(odom_history_)
+    {
+      // The sensors were matched to the odometry history, which tf may
+      // not have caught up with yet; the particles are at pf_odom_pose_
+      tf::Transform odom_to_base(tf::createQuaternionFromYaw(pf_odom_pose_.v[2]),
+                                 tf::Vector3(pf_odom_pose_.v[0], pf_odom_pose_.v[1], 0.0));
+      odom_to_map = tf::Stamped<tf::Pose>(odom_to_base * tmp_tf.inverse(),
+                                          stamp, odom_frame_id_);
+    }
+    else
+    {
+      try
+      {
+        tf::Stamped<tf::Pose> tmp_tf_stamped (tmp_tf.inverse(),
+                                              stamp,
+                                              base_frame_id_);
+        this->tf_->transformPose(odom_frame_id_,
+                                 tmp_tf_stamped,
+                                 odom_to_map);
+      }
+      catch(tf::TransformException)
+      {
+        ROS_DEBUG("Failed to subtract base to odom transform");
+        return;
+      }
+    }
+
+    {
+      boost::mutex::scoped_lock l(tf_mutex_);
+      latest_tf_ = tf::Transform(tf::Quaternion(odom_to_map.getRotation()),
+                                 tf::Point(odom_to_map.getOrigin()));
+      latest_tf_valid_ = true;
+      estimate_odom_pose_ = pf_odom_pose_;
+      estimate_cov_ = p.pose.covariance;
+    }
+
+    // We want to send a transform that is good up until a
+    // tolerance time so that odom can be used
+    broadcastTransform(stamp + transform_tolerance_, num_markers >= 0);
+}
+
+/**
+ * @brief AmclNode::broadcastTransform send latest_tf_ as the map to odom
+ * transform; in threaded mode the transform thread sends it
+ * @param expiration : time the transform is good until
+ * @param reverse : send odom to map too, as the marker updates do
+ */
+void AmclNode::broadcastTransform(const ros::Time& expiration, bool reverse){
+    if (tf_broadcast_ == false)
+      return;
+    if(threaded_){
+      boost::mutex::scoped_lock l(tf_mutex_);
+      tf_expiration_=expiration;
+      tf_reverse_=reverse;
+      tf_pending_=true;
+      tf_cond_.notify_one();
+      return;
+    }
+    tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
+                                        expiration,
+                                        global_frame_id_, odom_frame_id_);
+    this->tfb_->sendTransform(tmp_tf_stamped);
+    sent_first_transform_ = true;
+    if(reverse){
+      tf::StampedTransform tmp_tf_stamped2(latest_tf_,expiration, odom_frame_id_,global_frame_id_);
+      this->tfb_->sendTransform(tmp_tf_stamped2);
+    }
+}
+
+/**
+ * @brief AmclNode::publishPredictedPose publish the last estimate moved by
+ * the odometry since, so there is a fresh pose between filter updates.
+ * The covariance grows with the noise of the differential motion model.
+ * @param odom : newest odometry pose, in the odometry frame
+ * @param stamp : its stamp
+ */
+void AmclNode::publishPredictedPose(const geometry_msgs::Pose& odom, const ros::Time& stamp){
+    if(!predicted_pose_)
+        return;
+    tf::Pose odom_pose;
+    tf::poseMsgToTF(odom,odom_pose);
+    geometry_msgs::PoseWithCovarianceStamped p;
+    pf_vector_t from;
+    {
+        boost::mutex::scoped_lock l(tf_mutex_);
+        if(!latest_tf_valid_)
+            return;
+        tf::poseTFToMsg(latest_tf_.inverse()*odom_pose,p.pose.pose);
+        p.pose.covariance=estimate_cov_;
+        from=estimate_odom_pose_;
+    }
+    double trans=hypot(odom.position.x-from.v[0],odom.position.y-from.v[1]);
+    double rot=fabs(angle_diff(tf::getYaw(odom_pose.getRotation()),from.v[2]));
+    double var_trans=alpha3_*trans*trans+alpha4_*rot*rot;
+    double var_rot=alpha1_*rot*rot+alpha2_*trans*trans;
+    p.pose.covariance[6*0+0]+=var_trans;
+    p.pose.covariance[6*1+1]+=var_trans;
+    p.pose.covariance[6*5+5]+=var_rot;
+    p.header.frame_id=global_frame_id_;
+    p.header.stamp=stamp;
+    predicted_pose_pub_.publish(p);
+}
+
+/**
+ * @brief AmclNode::transformTimer republish map to odom between updates
+ * @param event
+ */
+void AmclNode::transformTimer(const ros::TimerEvent& event){
+    if(latest_tf_valid_)
+        broadcastTransform(ros::Time::now()+transform_tolerance_,false);
+}
+
+/**
+ * @brief AmclNode::laserMessage scan callback; in threaded mode it only
+ * keeps the scan as the newest of its laser
+ * @param laser_scan
+ */
+void AmclNode::laserMessage(const sensor_msgs::LaserScanConstPtr& laser_scan){
+    if(!threaded_){
+        laserReceived(laser_scan);
+        return;
+    }
+    boost::mutex::scoped_lock l(input_mutex_);
+    pending_scans_[laser_scan->header.frame_id]=laser_scan;
+    input_cond_.notify_one();
+}
+
+/**
+ * @brief AmclNode::detectionMessage detection callback; in threaded mode it
+ * only keeps the detection as the newest one
+ * @param msg
+ */
+void AmclNode::detectionMessage(const detector::messagedet::ConstPtr& msg){
+    if(!threaded_){
+        detectionCallback(msg);
+        return;
+    }
+    boost::mutex::scoped_lock l(input_mutex_);
+    pending_detection_=msg;
+    input_cond_.notify_one();
+}
+
+/**
+ * @brief AmclNode::filterThread update the filter with the newest scans and
+ * detection, in stamp order, as they come.  Messages that arrive while an
+ * update runs replace the older ones instead of piling up.
+ */
+void AmclNode::filterThread(){
+    while(true){
+        std::vector<sensor_msgs::LaserScanConstPtr> scans;
+        detector::messagedet::ConstPtr detection;
+        {
+            boost::mutex::scoped_lock l(input_mutex_);
+            while(!threads_stop_ && pending_scans_.empty() && !pending_detection_)
+                input_cond_.wait(l);
+            if(threads_stop_)
+                return;
+            for(std::map<std::string, sensor_msgs::LaserScanConstPtr>::iterator it=pending_scans_.begin();
+                it!=pending_scans_.end(); ++it)
+                scans.push_back(it->second);
+            pending_scans_.clear();
+            detection.swap(pending_detection_);
+        }
+        bool detection_done=!detection;
+        for(size_t i=0;i<=scans.size();i++){
+            if(!detection_done && (i==scans.size() || detection->header.stamp<scans[i]->header.stamp)){
+                detectionCallback(detection);
+                detection_done=true;
+            }
+            if(i<scans.size())
+                laserReceived(scans[i]);
+        }
+    }
+}
+
+/**
+ * @brief AmclNode::transformThread broadcast map to odom when there is a new
+ * estimate and at transform_publish_rate in between
+ */
+void AmclNode::transformThread(){
+    boost::posix_time::time_duration period=boost::posix_time::hours(1);
+    if(transform_publish_rate_>0.0)
+        period=boost::posix_time::microseconds(int64_t(1e6/transform_publish_rate_));
+    boost::mutex::scoped_lock l(tf_mutex_);
+    while(!threads_stop_){
+        if(!tf_pending_)
+            tf_cond_.timed_wait(l,period);
+        if(threads_stop_)
+            break;
+        if(!latest_tf_valid_)
+            continue;
+        ros::Time expiration=tf_pending_ ? tf_expiration_ : ros::Time::now()+transform_tolerance_;
+        tf_pending_=false;
+        tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
+                                            expiration,
+                                            global_frame_id_, odom_frame_id_);
+        tf::StampedTransform tmp_tf_stamped2(latest_tf_,expiration, odom_frame_id_,global_frame_id_);
+        bool reverse=tf_reverse_;
+        l.unlock();
+        this->tfb_->sendTransform(tmp_tf_stamped);
+        sent_first_transform_ = true;
+        if(reverse)
+            this->tfb_->sendTransform(tmp_tf_stamped2);
+        l.lock();
+    }
+}
+
 void AmclNode::LoadMapMarkers(std::vector<int>maps,std::vector<int>sectors,std::vector<int>IDs,std::vector<geometry_msgs::Pose> Centros){
 
     this->pub_map.header.frame_id="ground_plane__link";
@@ -1861,6 +2938,13 @@ void AmclNode::LoadMapMarkers(std::vector<int>maps,std::vector<int>sectors,std::
 
         }
 
+    int unreachable=marker_table_.Build(marker_map);
+    if(unreachable>0)
+        ROS_WARN("%d markers have repeated or out of range map/sector/ID and won't be matched",unreachable);
+    //Markers each particle should see, for the miss model
+    if(marker_miss_prob_<1.0)
+        marker_table_.BuildIndex(marker_miss_range_,MARKER_MISS_RESOLUTION,MARKER_MISS_MARKERS);
+
 
 
 
@@ -1896,11 +2980,11 @@ void AmclNode::loadTFCameras(std::vector<geometry_msgs::Pose> pose_cameras){
 }
 
 void AmclNode::imageCallback(const sensor_msgs::ImageConstPtr& msg){
-    this->marker_->image_filter = cv_bridge::toCvShare(msg, "bgr8")->image.clone();
-    //cout<<"Callback"<<endl;
-    //imshow("Callback",this->marker_->image_filter);
-    waitKey(30);
-
+    cv::Mat image = cv_bridge::toCvShare(msg, "bgr8")->image.clone();
+    //marker_ is used by the filter and replaced with the map
+    boost::recursive_mutex::scoped_lock lr(configuration_mutex_);
+    if(this->marker_ != NULL)
+        this->marker_->image_filter = image;
 }
 
 
@@ -1942,7 +3026,6 @@ void AmclNode::detectionCallback (const detector::messagedet::ConstPtr &msg){
        //Create an object to handle marker detection the first time.
     if(frame_to_camera_!=msg->header.frame_id){
         marker_=new AMCLMarker(*marker_);
-        marker_update=true;
         frame_to_camera_=msg->header.frame_id;
         marker_->simulation=simulation;
         marker_->image_height=image_height;
@@ -1956,316 +3039,53 @@ void AmclNode::detectionCallback (const detector::messagedet::ConstPtr &msg){
             ROS_ERROR("Couldn't determine robot's pose associated with camera info");
             return;
           }
-        pf_vector_t delta = pf_vector_zero();
-        pf_vector_t delta_update = pf_vector_zero();
-        if(pf_init_cam)
-          {
-            // Compute change in pose
-            //Change in position since last filter actualization(laser or camera)
-            delta.v[0] = pose.v[0] - pf_odom_pose_.v[0];
-            delta.v[1] = pose.v[1] - pf_odom_pose_.v[1];
-            delta.v[2] = angle_diff(pose.v[2], pf_odom_pose_.v[2]);
-
-            //Change in position since last filter actualization
-            delta_update.v[0] = pose.v[0] - latest_odom_pose_camera.v[0];
-            delta_update.v[1] = pose.v[1] - latest_odom_pose_camera.v[1];
-            delta_update.v[2] = angle_diff(pose.v[2],latest_odom_pose_camera.v[2]);
-            // See if we should update the filter
-            bool update = fabs(delta_update.v[0]) > d_thresh_ ||
-                          fabs(delta_update.v[1]) > d_thresh_ ||
-                          fabs(delta_update.v[2]) > a_thresh_;
-            //cout<<"update"<<update<<endl;
-            update = update || m_force_update_cam;
-            m_force_update_cam=false;
-
-            // Set the laser update flags
-            if(update){
-                //cout<<"entra en update"<<endl;
-              marker_update=true;
-            }
-
-
-          }
-          bool force_publication=false;
-
-          if(!pf_init_cam)
-          {
-            //cout<<"not init"<<endl;
-            // Pose at last filter update
-            pf_odom_pose_ = pose;
-            latest_odom_pose_camera=pose;
-            // Filter is now initialized
-            pf_init_cam = true;
-
-            // Should update sensor data
-              marker_update = true;
-
-            force_publication = true;
-
-            resample_count_cam= 0;
-        }
-        //If the robot has moved update the filter
-          else if(pf_init_cam && marker_update)
-          {
-
-              AMCLOdomData odata;
-              odata.pose = pose;
-              odata.delta = delta;
-              // Use the action data to update the filter
-              odom_->UpdateAction(pf_, (AMCLSensorData*)&odata);
-          }
-          bool resampled = false;
-          if(marker_update){
-
-            AMCLMarkerData mdata;
-            mdata.sensor=this->marker_;
-            mdata.markers_obs=observation;
-            marker_->model_type=marker_model_type_;
-            marker_->image_width=image_width;
-            marker_->num_cam=num_cam;
-            marker_->image_height=image_height;
-
-            //Update filter with marker data
-            if(!observation.empty()){
-                marker_->UpdateSensor(pf_,(AMCLSensorData*) &mdata);
-                updated_camera=true;
-            }
-            latest_odom_pose_camera=pose;
-            pf_odom_pose_=pose;
-            marker_update=false;
-
-
-            if(!(++resample_count_cam % resample_interval_))
-
-                  pf_update_resample(pf_);
-                  resampled = true;
-
-
-            pf_sample_set_t* set = pf_->sets + pf_->current_set;
-            ROS_INFO("Num samples: %d\n", set->sample_count);
-
-          //Publish resulting particle cloud
-          if(!m_force_update_cam){
-          geometry_msgs::PoseArray cloud_msg;
-          cloud_msg.header.stamp = ros::Time::now();
-          cloud_msg.header.frame_id = global_frame_id_;
-          cloud_msg.poses.resize(set->sample_count);
-          for(int i=0;i<set->sample_count;i++)
-          {
-            tf::poseTFToMsg(tf::Pose(tf::createQuaternionFromYaw(set->samples[i].pose.v[2]),
-                                     tf::Vector3(set->samples[i].pose.v[0],
-                                               set->samples[i].pose.v[1], 0)),
-                            cloud_msg.poses[i]);
-          }
-          //cout<<"Publicacion de la nube de particulas"<<endl;
-          particlecloud_pub_.publish(cloud_msg);
-        }
-          }
-          if (resampled|| force_publication){
-              if(!resampled){
-                  // re-compute the cluster statistics
-                 pf_cluster_stats(pf_, pf_->sets);
-              }
-    //read hypotheses
-    double max_weight=0.0;
-    double max_weight_hyp=-1;
-    std::vector<amcl_hyp_t> marker_hyps;
-    marker_hyps.resize(pf_->sets[pf_->current_set].cluster_count);
-    for(int hyp_count = 0;hyp_count < pf_->sets[pf_->current_set].cluster_count; hyp_count++)
-    {
-        double weight;
-        pf_vector_t pose_mean;
-        pf_matrix_t pose_cov;
-
-        if (!pf_get_cluster_stats(pf_, hyp_count, &weight, &pose_mean, &pose_cov))
-              {
-                ROS_ERROR("Couldn't get stats on cluster %d", hyp_count);
-                break;
-        }
-
-
-        marker_hyps[hyp_count].weight = weight;
-        marker_hyps[hyp_count].pf_pose_mean = pose_mean;
-        marker_hyps[hyp_count].pf_pose_cov = pose_cov;
-
-        if(marker_hyps[hyp_count].weight > max_weight)
-              {
-                max_weight = marker_hyps[hyp_count].weight;
-                max_weight_hyp = hyp_count;
-        }
-        }
+        marker_->model_type=marker_model_type_;
+        marker_->image_width=image_width;
+        marker_->num_cam=num_cam;
+        marker_->image_height=image_height;
 
-        if(max_weight > 0.0)
-            {
-              ROS_DEBUG("Max weight pose: %.3f %.3f %.3f",
-                        marker_hyps[max_weight_hyp].pf_pose_mean.v[0],
-                        marker_hyps[max_weight_hyp].pf_pose_mean.v[1],
-                        marker_hyps[max_weight_hyp].pf_pose_mean.v[2]);
-
-              //Message for pose
-              geometry_msgs::PoseWithCovarianceStamped p;
-              // Fill in the header
-              p.header.frame_id = global_frame_id_;
-              p.header.stamp = msg->header.stamp;
-              // Copy in the pose with the maximum weight
-              p.pose.pose.position.x = marker_hyps[max_weight_hyp].pf_pose_mean.v[0];
-              p.pose.pose.position.y = marker_hyps[max_weight_hyp].pf_pose_mean.v[1];
-              tf::quaternionTFToMsg(tf::createQuaternionFromYaw(marker_hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                                          p.pose.pose.orientation);
-              // Copy in the covariance, converting from 3-D to 6-D
-              pf_sample_set_t* set = pf_->sets + pf_->current_set;
-              for(int i=0; i<2; i++){
-                      for(int j=0; j<2; j++){
-                          p.pose.covariance[6*i+j] = set->cov.m[i][j];
-                                  }
-                          }
-              p.pose.covariance[6*5+5] = set->cov.m[2][2];
-
-              //cout<<"publicacion de la pose"<<endl;
-              pose_pub_.publish(p);
-
-              //Publishing error with gazebo's ground_truth
-              if(simulation == 1){
-              amcl_doris::pose_error p_error;
-
-              float error_x=p.pose.pose.position.x-ground_truth_x_;
-              float error_y=p.pose.pose.position.y-ground_truth_y_;
-
-              p_error.vec_error.data.push_back(p.pose.pose.position.x-ground_truth_x_);
-              p_error.vec_error.data.push_back(p.pose.pose.position.y-ground_truth_y_);
-              p_error.vec_error.data.push_back(sqrt((error_x*error_x)+(error_y*error_y)));
-              p_error.vec_error.data.push_back(marker_hyps[max_weight_hyp].pf_pose_mean.v[2]-ground_truth_yaw_);
-              p_error.num_markers.data=int(observation.size());
-              p_error.header.stamp=ros::Time::now();
-              error_pub.publish(p_error);
-              }
-              std_msgs::Float64 yaw_out;
-
-              if (simulation==0){
-              yaw_out.data=marker_hyps[max_weight_hyp].pf_pose_mean.v[2];
-              yaw_amcl.publish(yaw_out);
-              }
-
-              last_published_pose = p;
-
-
-              cout<<"new pose"<<endl;
-                             cout<<marker_hyps[max_weight_hyp].pf_pose_mean.v[0]<<endl;
-                             cout<<marker_hyps[max_weight_hyp].pf_pose_mean.v[1]<<endl;
-                             cout<<marker_hyps[max_weight_hyp].pf_pose_mean.v[2];
-
-              //tf from map to odom frame
-              tf::Stamped<tf::Pose> odom_to_map;
-              tf::Transform map_to_odom;
-              try
-                    {
-                      tf::Transform tmp_tf(tf::createQuaternionFromYaw(marker_hyps[max_weight_hyp].pf_pose_mean.v[2]),
-                                           tf::Vector3(marker_hyps[max_weight_hyp].pf_pose_mean.v[0],
-                                                       marker_hyps[max_weight_hyp].pf_pose_mean.v[1],
-                                                       0.0));
-
-                      tf::Stamped<tf::Pose> tmp_tf_stamped (tmp_tf.inverse(),
-                                                            ros::Time(0),
-                                                            base_frame_id_);
-
-                      this->tf_->transformPose(odom_frame_id_,
-                                               tmp_tf_stamped,
-                                               odom_to_map);
-              } catch(tf::TransformException e)
-              {
-                cout<<"Failed to subtract base to odom transform "<<e.what()<<endl;
-                waitKey();
-                return;
-             }
-              latest_tf_ = tf::Transform(tf::Quaternion(odom_to_map.getRotation()),
-                                              tf::Point(odom_to_map.getOrigin()));
-              map_to_odom=latest_tf_;
-              //Publishing TF for odometry
-                   latest_tf_valid_ = true;
-                   if (tf_broadcast_ == true)
-                         {
-                           // We want to send a transform that is good up until a
-                           // tolerance time so that odom can be used
-                           ros::Time transform_expiration = (msg->header.stamp +
-                                                             transform_tolerance_);
-                           tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                                               msg->header.stamp,
-                                                               global_frame_id_, odom_frame_id_);
-                           this->tfb_->sendTransform(tmp_tf_stamped);
-                           sent_first_transform_ = true;
-
-                           tf::StampedTransform tmp_tf_stamped2(latest_tf_,msg->header.stamp, odom_frame_id_,global_frame_id_);
-                           this->tfb_->sendTransform(tmp_tf_stamped2);
-                         }
-                   }
-        else
-            {
-              ROS_ERROR("No pose!");
-            }
+        //Queue the marker data; with the miss model an empty detection is
+        //information too.  The update gate decides whether it is used.
+        boost::shared_ptr<AMCLSensorData> data;
+        if(!observation.empty() || marker_miss_prob_<1.0){
+            AMCLMarkerData* mdata=new AMCLMarkerData;
+            data.reset(mdata);
+            mdata->sensor=this->marker_;
+            mdata->markers_obs=observation;
         }
-    else if(latest_tf_valid_)
-  {
-    if (tf_broadcast_ == true)
-    {
-      // Nothing changed, so we'll just republish the last transform, to keep
-      // everybody happy.
-      ros::Time transform_expiration = (msg->header.stamp +
-                                        transform_tolerance_);
-      tf::StampedTransform tmp_tf_stamped(latest_tf_.inverse(),
-                                          transform_expiration,
-                                          global_frame_id_, odom_frame_id_);
-      this->tfb_->sendTransform(tmp_tf_stamped);
-      tf::StampedTransform tmp_tf_stamped2(latest_tf_,transform_expiration, odom_frame_id_,global_frame_id_);
-      this->tfb_->sendTransform(tmp_tf_stamped2);
-    }
-
-    // Is it time to save our last pose to the param server
-    ros::Time now = ros::Time::now();
-    if((save_pose_period.toSec() > 0.0) &&
-       (now - save_pose_last_time) >= save_pose_period)
-    {
-      this->savePoseToServer();
-      save_pose_last_time = now;
-    }
-  }
-
-  //Publish odometry, reference and ooutput path.
-  geometry_msgs::PoseStamped pose_g,pose_o,odom_sim;
-  odom_sim.header.stamp=ros::Time::now();
-  pose_g.pose=ground_truth;
-  pose_g.header.stamp=ros::Time::now();
-  odom_sim.header.stamp=ros::Time::now();
-
-
-  if(simulation == 1){
-      odom_path.poses.push_back(odom_sim);
-      reference.poses.push_back(pose_g);
-  }
-
-  pose_o.pose=last_published_pose.pose.pose;
-  pose_o.header.stamp=ros::Time::now();
-  output.poses.push_back(pose_o);
-  reference.header.frame_id="map";
-  output.header.frame_id="map";
-  if(simulation==0){
-      reference.poses.push_back(real_odom);
-  }
-  path_pub_r.publish(reference);
-  path_pub_out.publish(output);
-//}
-
+        queueUpdate(msg->header.stamp, pose, this->marker_, data, true);
 }
 
 void AmclNode::groundTruthCallback (const nav_msgs::Odometry::ConstPtr& msg){
+    boost::mutex::scoped_lock pl(path_mutex_);
     ground_truth=msg->pose.pose;
     ground_truth_x_=msg->pose.pose.position.x;
+    ground_truth_received_=true;
     ground_truth_y_=msg->pose.pose.position.y;
     tf::Pose pose;
     tf::poseMsgToTF(msg->pose.pose,pose);
     ground_truth_yaw_=tf::getYaw(pose.getRotation());
 }
 
+/**
+ * @brief AmclNode::addOdometry add an odometry message to the odometry
+ * history, if there is one
+ * @param pose : pose of the robot in the odometry frame
+ * @param stamp
+ */
+void AmclNode::addOdometry(const geometry_msgs::Pose& pose, const ros::Time& stamp){
+    if(!odom_history_)
+        return;
+    pf_vector_t p;
+    p.v[0]=pose.position.x;
+    p.v[1]=pose.position.y;
+    p.v[2]=tf::getYaw(pose.orientation);
+    odom_history_->Add(stamp.toSec(),p);
+}
+
 void AmclNode::simuOdomCallback (const nav_msgs::Odometry::ConstPtr& msg){
+    addOdometry(msg->pose.pose,msg->header.stamp);
+    boost::mutex::scoped_lock pl(path_mutex_);
     odom_pose.header.frame_id=odom_frame_id_;
     odom_pose.header.stamp=ros::Time::now();
     odom_pose.pose.position.x=msg->pose.pose.position.x;
@@ -2279,13 +3099,13 @@ void AmclNode::simuOdomCallback (const nav_msgs::Odometry::ConstPtr& msg){
     cout<<odom_pose.pose.orientation.y<<endl;
     cout<<odom_pose.pose.orientation.z<<endl;
     cout<<odom_pose.pose.orientation.w<<endl;
-    odom_path.header.frame_id="Doris/odom";
-    odom_path.header.stamp=ros::Time::now();
-    odom_path.poses.push_back(odom_pose);
-    odom_path_pub.publish(odom_path);
+    odom_path_.add(odom_pose);
+    publishPredictedPose(msg->pose.pose,msg->header.stamp);
 }
 
 void AmclNode::realOdomCallback (const geometry_msgs::PoseStamped& msg){
+    addOdometry(msg.pose,msg.header.stamp);
+    boost::mutex::scoped_lock pl(path_mutex_);
     real_odom=msg;
     real_odom.pose.position.x=real_odom.pose.position.x+pose_ini.getOrigin().x();
     real_odom.pose.position.y=real_odom.pose.position.y+pose_ini.getOrigin().y();
@@ -2296,6 +3116,7 @@ void AmclNode::realOdomCallback (const geometry_msgs::PoseStamped& msg){
     std_msgs::Float64 yaw;
     yaw.data=real_odom_yaw;
     yaw_odom.publish(yaw);
+    publishPredictedPose(msg.pose,msg.header.stamp);
 
 }
 
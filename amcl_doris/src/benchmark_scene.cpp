@@ -0,0 +1,70 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * Synthetic scene shared by the benchmarks: markers, cameras and noise.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "benchmark_scene.h"
+
+void makeMarkers(std::vector<Marcador>& markers, int count, double radius)
+{
+  for(int i = 0; i < count; i++)
+  {
+    double a = 2*M_PI*i / count;
+    double cx = radius*cos(a), cy = radius*sin(a);
+    double tx = -sin(a), ty = cos(a);
+    double z = 1.0 + 0.4*(i % 3) / 2.0;
+    double side[MARKER_CORNERS][2] = { {-1, 1}, {1, 1}, {1, -1}, {-1, -1} };
+
+    Marcador m;
+    m.setMapId(0);
+    m.setSectorId(i / 32);
+    m.setMarkerId(i % 32);
+    for(int c = 0; c < MARKER_CORNERS; c++)
+    {
+      geometry_msgs::Point p;
+      p.x = cx + 0.15*side[c][0]*tx;
+      p.y = cy + 0.15*side[c][0]*ty;
+      p.z = z + 0.15*side[c][1];
+      m.setCorner(p);
+    }
+    markers.push_back(m);
+  }
+}
+
+void makeCameras(std::vector<geometry_msgs::Pose>& cameras)
+{
+  for(int i = 0; i < 3; i++)
+  {
+    tf::Transform pose(tf::createQuaternionFromRPY(0, 2*M_PI*i / 3, 0));
+    geometry_msgs::Pose msg;
+    tf::poseTFToMsg(pose, msg);
+    cameras.push_back(msg);
+  }
+}
+
+double gaussian(double sigma)
+{
+  // Box-Muller
+  double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+  double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sigma * sqrt(-2*log(u1)) * cos(2*M_PI*u2);
+}
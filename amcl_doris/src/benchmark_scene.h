@@ -0,0 +1,38 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * Synthetic scene shared by the benchmarks: markers, cameras and noise.
+ */
+
+#ifndef BENCHMARK_SCENE_H
+#define BENCHMARK_SCENE_H
+
+#include <vector>
+
+#include "amcl_doris/sensors/amcl_marker.h"
+
+// Markers on a circle of the given radius, facing its centre
+void makeMarkers(std::vector<Marcador>& markers, int count, double radius);
+
+// Three cameras around the rig y axis, as in the simulated robot
+void makeCameras(std::vector<geometry_msgs::Pose>& cameras);
+
+// Zero mean normal noise, drawn with rand()
+double gaussian(double sigma);
+
+#endif
@@ -0,0 +1,530 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * Time the filter and its sensor models without ROS running: the map and
+ * marker map are loaded from files, laser scans and marker detections are
+ * synthesized from ground-truth poses sampled in free space, and every
+ * stage of an update is timed for each particle count and thread count.
+ *
+ *   filter_benchmark [--map MAP.yaml] [--markers MARKERS.yaml] [--cameras CAMERAS.yaml]
+ *                    [--particles N,N,...] [--threads T,T,...] [--iterations K]
+ *                    [--poses P] [--max-beams B] [--max-occ-dist D] [--simulation 0|1]
+ *                    [--calibration FILE] [--marker-size W H] [--seed S] [--output FILE]
+ *
+ * The map is a map_server YAML/PGM map; without one, a room enclosing the
+ * markers is used.  The marker and camera files are in the format of the
+ * marker maps and cameras.yaml in maps/; without them, a ring of markers
+ * and the simulated camera rig are used.  Results are written as JSON, with
+ * the milliseconds per call of each stage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include <yaml-cpp/yaml.h>
+#include <ros/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "amcl_doris/map/map.h"
+#include "amcl_doris/pf/pf.h"
+#include "amcl_doris/sensors/amcl_laser.h"
+#include "amcl_doris/sensors/amcl_marker.h"
+
+#include "benchmark_scene.h"
+
+#define USAGE "USAGE: filter_benchmark [--map MAP.yaml] [--markers MARKERS.yaml] [--cameras CAMERAS.yaml]\n" \
+              "                        [--particles N,N,...] [--threads T,T,...] [--iterations K]\n" \
+              "                        [--poses P] [--max-beams B] [--max-occ-dist D] [--simulation 0|1]\n" \
+              "                        [--calibration FILE] [--marker-size W H] [--seed S] [--output FILE]"
+
+// Readings per synthesized scan, over the full circle
+#define SCAN_READINGS 360
+#define SCAN_RANGE_MAX 10.0
+
+// Cell size (m) and margin around the markers (m) of the built-in room
+#define ROOM_SCALE 0.05
+#define ROOM_MARGIN 0.5
+
+// Clearance (m) of the ground-truth poses from obstacles
+#define POSE_CLEARANCE 0.3
+
+using namespace amcl;
+
+// Milliseconds per call of a stage
+struct StageTime
+{
+  StageTime() : total(0), min(HUGE_VAL), max(0), count(0) {}
+  void add(double ms)
+  {
+    total += ms;
+    min = std::min(min, ms);
+    max = std::max(max, ms);
+    count++;
+  }
+  double total, min, max;
+  int count;
+};
+
+static std::vector<int> parseList(const char *arg)
+{
+  std::vector<int> values;
+  for(const char *p = arg; *p; )
+  {
+    char *end;
+    long v = strtol(p, &end, 10);
+    if(end == p)
+      return std::vector<int>();
+    values.push_back((int)v);
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return values;
+}
+
+static geometry_msgs::Pose readPose(const YAML::Node& node)
+{
+  tf::Transform pose(tf::createQuaternionFromRPY(node["roll"].as<double>(),
+                                                 node["pitch"].as<double>(),
+                                                 node["yaw"].as<double>()),
+                     tf::Vector3(node["x"].as<double>(), node["y"].as<double>(),
+                                 node["z"].as<double>()));
+  geometry_msgs::Pose msg;
+  tf::poseTFToMsg(pose, msg);
+  return msg;
+}
+
+// Markers of a marker_positions list, with their corners laid out as the
+// node does
+static bool loadMarkers(const std::string& filename, double width, double height,
+                        std::vector<Marcador>& markers)
+{
+  try
+  {
+    YAML::Node list = YAML::LoadFile(filename)["marker_positions"];
+    for(size_t i = 0; i < list.size(); i++)
+    {
+      geometry_msgs::Pose center = readPose(list[i]);
+      tf::Transform pose;
+      tf::poseMsgToTF(center, pose);
+      Marcador m;
+      for(int c = 0; c < MARKER_CORNERS; c++)
+      {
+        tf::Vector3 corner(c == 0 || c == 1 ? -width/2 : width/2,
+                           c == 0 || c == 3 ? -height/2 : height/2, 0);
+        geometry_msgs::Point p;
+        tf::pointTFToMsg(pose * corner, p);
+        m.setCorner(p);
+      }
+      m.setMarkerId(list[i]["ID"].as<int>());
+      m.setSectorId(list[i]["sector"] ? list[i]["sector"].as<int>() : 0);
+      m.setMapId(list[i]["map"] ? list[i]["map"].as<int>() : 0);
+      markers.push_back(m);
+    }
+  }
+  catch(YAML::Exception& e)
+  {
+    fprintf(stderr, "failed to read markers from %s: %s\n", filename.c_str(), e.what());
+    return false;
+  }
+  return true;
+}
+
+static bool loadCameras(const std::string& filename, std::vector<geometry_msgs::Pose>& cameras,
+                        std::vector<double>& u_offsets)
+{
+  try
+  {
+    YAML::Node list = YAML::LoadFile(filename)["camera_positions"];
+    for(size_t i = 0; i < list.size(); i++)
+    {
+      cameras.push_back(readPose(list[i]));
+      u_offsets.push_back(list[i]["u_offset"] ? list[i]["u_offset"].as<double>()
+                                              : std::numeric_limits<double>::quiet_NaN());
+    }
+  }
+  catch(YAML::Exception& e)
+  {
+    fprintf(stderr, "failed to read cameras from %s: %s\n", filename.c_str(), e.what());
+    return false;
+  }
+  return true;
+}
+
+// Free room with walls on the bounding box of the markers
+static void makeRoom(map_t *map, const AMCLMarkerMap& table)
+{
+  double min_x = -1, max_x = 1, min_y = -1, max_y = 1;
+  for(int k = 0; k < MARKER_CORNERS * table.Size(); k++)
+  {
+    min_x = std::min(min_x, table.CornerX()[k]);
+    max_x = std::max(max_x, table.CornerX()[k]);
+    min_y = std::min(min_y, table.CornerY()[k]);
+    max_y = std::max(max_y, table.CornerY()[k]);
+  }
+  min_x -= ROOM_MARGIN;
+  max_x += ROOM_MARGIN;
+  min_y -= ROOM_MARGIN;
+  max_y += ROOM_MARGIN;
+
+  map->scale = ROOM_SCALE;
+  map->size_x = (int)ceil((max_x - min_x) / map->scale) + 1;
+  map->size_y = (int)ceil((max_y - min_y) / map->scale) + 1;
+  map->origin_x = min_x + (map->size_x / 2) * map->scale;
+  map->origin_y = min_y + (map->size_y / 2) * map->scale;
+  map->max_occ_dist = 0;
+  map->cells = (map_cell_t*)calloc((size_t)map->size_x * map->size_y, sizeof(map_cell_t));
+  for(int j = 0; j < map->size_y; j++)
+  {
+    for(int i = 0; i < map->size_x; i++)
+    {
+      bool wall = (i == 0 || j == 0 || i == map->size_x - 1 || j == map->size_y - 1);
+      map->cells[MAP_INDEX(map, i, j)].occ_state = wall ? +1 : -1;
+    }
+  }
+}
+
+// Free cells with clearance, for the ground-truth and random poses
+struct FreeSpace
+{
+  map_t *map;
+  std::vector<int> cells;
+};
+
+static pf_vector_t freePose(void *data)
+{
+  FreeSpace *free_space = (FreeSpace*)data;
+  map_t *map = free_space->map;
+  int cell = free_space->cells[(size_t)(drand48() * free_space->cells.size())];
+  pf_vector_t p;
+  p.v[0] = MAP_WXGX(map, cell % map->size_x);
+  p.v[1] = MAP_WYGY(map, cell / map->size_x);
+  p.v[2] = drand48() * 2*M_PI - M_PI;
+  return p;
+}
+
+// Scan from a pose, with 2 cm of noise
+static AMCLLaserData *makeScan(AMCLLaser *laser, map_t *map, const pf_vector_t& pose)
+{
+  AMCLLaserData *scan = new AMCLLaserData;
+  scan->sensor = laser;
+  scan->range_count = SCAN_READINGS;
+  scan->range_max = SCAN_RANGE_MAX;
+  scan->ranges = new double[SCAN_READINGS][2];
+  for(int i = 0; i < SCAN_READINGS; i++)
+  {
+    double bearing = -M_PI + 2*M_PI*i / SCAN_READINGS;
+    double range = map_calc_range(map, pose.v[0], pose.v[1], pose.v[2] + bearing, SCAN_RANGE_MAX);
+    scan->ranges[i][0] = std::min(SCAN_RANGE_MAX, std::max(0.0, range + gaussian(0.02)));
+    scan->ranges[i][1] = bearing;
+  }
+  return scan;
+}
+
+// Detections of the markers in line of sight that fall inside the
+// image, with a pixel of noise
+static void makeDetections(AMCLMarker& marker, map_t *map, const std::vector<Marcador>& markers,
+                           const pf_vector_t& pose, AMCLMarkerData& data)
+{
+  const AMCLMarkerMap& table = *marker.map;
+  data.sensor = &marker;
+  for(size_t k = 0; k < markers.size(); k++)
+  {
+    double cx = table.CenterX()[k], cy = table.CenterY()[k];
+    double dist = hypot(cx - pose.v[0], cy - pose.v[1]);
+    double range = map_calc_range(map, pose.v[0], pose.v[1],
+                                  atan2(cy - pose.v[1], cx - pose.v[0]), dist);
+    if(range < dist - 2*map->scale - POSE_CLEARANCE)
+      continue;
+
+    std::vector<cv::Point2f> corners;
+    marker.ExpectedCorners(pose, k, corners);
+    bool inside = true;
+    for(int c = 0; c < MARKER_CORNERS; c++)
+    {
+      corners[c].x += gaussian(1.0);
+      corners[c].y += gaussian(1.0);
+      inside = inside && corners[c].x >= 0 && corners[c].x < marker.image_width &&
+        corners[c].y >= 0 && corners[c].y < marker.image_height;
+    }
+    if(!inside)
+      continue;
+    Marcador m = markers[k];
+    m.MarkerPoints(corners);
+    data.markers_obs.push_back(m);
+  }
+}
+
+// JSON string literal of a path
+static std::string jsonString(const std::string& text)
+{
+  std::string quoted = "\"";
+  for(size_t i = 0; i < text.size(); i++)
+  {
+    unsigned char c = text[i];
+    if(c == '"' || c == '\\')
+    {
+      quoted += '\\';
+      quoted += c;
+    }
+    else if(c < 0x20)
+    {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      quoted += escape;
+    }
+    else
+      quoted += c;
+  }
+  return quoted + "\"";
+}
+
+static void printStage(FILE *out, const char *name, const StageTime& t, bool last)
+{
+  fprintf(out, "          \"%s\": {\"mean\": %.6f, \"min\": %.6f, \"max\": %.6f}%s\n", name,
+          t.count ? t.total / t.count : 0.0, t.count ? t.min : 0.0, t.max, last ? "" : ",");
+}
+
+int
+main(int argc, char** argv)
+{
+  std::string map_file, markers_file, cameras_file, calibration_file, output_file;
+  std::vector<int> particle_counts, thread_counts;
+  int iterations = 20;
+  int pose_count = 10;
+  int max_beams = 30;
+  double max_occ_dist = 2.0;
+  int simulation = 1;
+  double marker_width = 0.215, marker_height = 0.345;
+  long seed = 42;
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--map") && i + 1 < argc)
+      map_file = argv[++i];
+    else if(!strcmp(argv[i], "--markers") && i + 1 < argc)
+      markers_file = argv[++i];
+    else if(!strcmp(argv[i], "--cameras") && i + 1 < argc)
+      cameras_file = argv[++i];
+    else if(!strcmp(argv[i], "--particles") && i + 1 < argc)
+      particle_counts = parseList(argv[++i]);
+    else if(!strcmp(argv[i], "--threads") && i + 1 < argc)
+      thread_counts = parseList(argv[++i]);
+    else if(!strcmp(argv[i], "--iterations") && i + 1 < argc)
+      iterations = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--poses") && i + 1 < argc)
+      pose_count = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--max-beams") && i + 1 < argc)
+      max_beams = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--max-occ-dist") && i + 1 < argc)
+      max_occ_dist = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--simulation") && i + 1 < argc)
+      simulation = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--calibration") && i + 1 < argc)
+      calibration_file = argv[++i];
+    else if(!strcmp(argv[i], "--marker-size") && i + 2 < argc)
+    {
+      marker_width = atof(argv[++i]);
+      marker_height = atof(argv[++i]);
+    }
+    else if(!strcmp(argv[i], "--seed") && i + 1 < argc)
+      seed = atol(argv[++i]);
+    else if(!strcmp(argv[i], "--output") && i + 1 < argc)
+      output_file = argv[++i];
+    else
+    {
+      puts(USAGE);
+      return 1;
+    }
+  }
+  if(particle_counts.empty())
+  {
+    int counts[] = { 100, 1000, 10000, 100000 };
+    particle_counts.assign(counts, counts + 4);
+  }
+  if(thread_counts.empty())
+  {
+    thread_counts.push_back(1);
+#ifdef _OPENMP
+    if(omp_get_max_threads() > 1)
+      thread_counts.push_back(omp_get_max_threads());
+#endif
+  }
+  if(iterations < 1 || pose_count < 1)
+  {
+    puts(USAGE);
+    return 1;
+  }
+  srand(seed);
+  pf_seed(seed);
+
+  if(calibration_file.empty())
+    calibration_file = CameraCalibration::defaultFile(simulation ? "doris_sim.yaml" : "doris_omni.yaml");
+  CameraCalibration calibration;
+  if(!calibration.load(calibration_file))
+    return 1;
+
+  // Marker map and camera rig
+  std::vector<Marcador> markers;
+  if(markers_file.empty())
+    makeMarkers(markers, 16, 4.0);
+  else if(!loadMarkers(markers_file, marker_width, marker_height, markers))
+    return 1;
+  AMCLMarkerMap table;
+  int unreachable = table.Build(markers);
+  if(unreachable > 0)
+    fprintf(stderr, "%d markers have repeated or out of range map/sector/ID\n", unreachable);
+
+  std::vector<geometry_msgs::Pose> cameras;
+  std::vector<double> u_offsets;
+  if(cameras_file.empty())
+    makeCameras(cameras);
+  else if(!loadCameras(cameras_file, cameras, u_offsets))
+    return 1;
+
+  // Occupancy map and its distance field
+  map_t *map = map_alloc();
+  if(map_file.empty())
+    makeRoom(map, table);
+  else if(map_load_yaml(map, map_file.c_str()) != 0)
+  {
+    fprintf(stderr, "failed to load map %s\n", map_file.c_str());
+    return 1;
+  }
+  map_update_cspace(map, max_occ_dist);
+
+  FreeSpace free_space;
+  free_space.map = map;
+  for(int k = 0; k < map->size_x * map->size_y; k++)
+    if(map->cells[k].occ_state == -1 &&
+       map->cells[k].occ_dist >= std::min(POSE_CLEARANCE, max_occ_dist))
+      free_space.cells.push_back(k);
+  if(free_space.cells.empty())
+  {
+    fprintf(stderr, "the map has no free space\n");
+    return 1;
+  }
+
+  AMCLLaser laser(max_beams, map);
+  laser.SetModelLikelihoodField(0.95, 0.05, 0.2, max_occ_dist, 0.5);
+
+  AMCLMarker marker(simulation);
+  marker.map = &table;
+  marker.num_cam = cameras.size();
+  marker.image_width = simulation ? 1812 : calibration.info.width;
+  marker.image_height = simulation ? 679 : calibration.info.height;
+  marker.SetCalibration(calibration);
+  marker.SetCameraRig(cameras, u_offsets);
+  marker.SetModelLikelihoodField(0.995, 0.005, 100, 4.0, 0.5);
+
+  // Ground truth and what the robot senses there
+  std::vector<pf_vector_t> truth(pose_count);
+  std::vector<AMCLLaserData*> scans(pose_count);
+  std::vector<AMCLMarkerData> detections(pose_count);
+  double detected = 0;
+  for(int p = 0; p < pose_count; p++)
+  {
+    truth[p] = freePose(&free_space);
+    scans[p] = makeScan(&laser, map, truth[p]);
+    makeDetections(marker, map, markers, truth[p], detections[p]);
+    detected += (double)detections[p].markers_obs.size() / pose_count;
+  }
+
+  pf_matrix_t cov = pf_matrix_zero();
+  cov.m[0][0] = 0.5*0.5;
+  cov.m[1][1] = 0.5*0.5;
+  cov.m[2][2] = 0.3*0.3;
+
+  FILE *out = stdout;
+  if(!output_file.empty() && !(out = fopen(output_file.c_str(), "w")))
+  {
+    fprintf(stderr, "cannot write %s\n", output_file.c_str());
+    return 1;
+  }
+  fprintf(out, "{\n");
+  fprintf(out, "  \"map\": {\"file\": %s, \"size_x\": %d, \"size_y\": %d, \"scale\": %g, \"free_cells\": %d, \"max_occ_dist\": %g},\n",
+          jsonString(map_file).c_str(), map->size_x, map->size_y, map->scale,
+          (int)free_space.cells.size(), max_occ_dist);
+  fprintf(out, "  \"markers\": {\"file\": %s, \"count\": %d, \"detected_per_pose\": %.2f},\n",
+          jsonString(markers_file).c_str(), table.Size(), detected);
+  fprintf(out, "  \"camera_model\": \"%s\",\n", simulation ? "pinhole_rig" : "omnidirectional");
+  fprintf(out, "  \"scan\": {\"readings\": %d, \"max_beams\": %d},\n", SCAN_READINGS, max_beams);
+  fprintf(out, "  \"iterations\": %d,\n  \"poses\": %d,\n  \"seed\": %ld,\n", iterations, pose_count, seed);
+  fprintf(out, "  \"threads\": [\n");
+
+  for(size_t t = 0; t < thread_counts.size(); t++)
+  {
+#ifdef _OPENMP
+    omp_set_num_threads(thread_counts[t]);
+#endif
+    // The distance field, recomputed with this many threads
+    ros::WallTime start = ros::WallTime::now();
+    map_update_cspace(map, max_occ_dist);
+    double cspace_ms = 1e3 * (ros::WallTime::now() - start).toSec();
+    fprintf(out, "    {\n      \"threads\": %d,\n      \"map_update_cspace_ms\": %.6f,\n      \"runs\": [\n",
+            thread_counts[t], cspace_ms);
+
+    for(size_t n = 0; n < particle_counts.size(); n++)
+    {
+      int particles = particle_counts[n];
+      fprintf(stderr, "%d particles, %d threads\n", particles, thread_counts[t]);
+      pf_t *pf = pf_alloc(particles, particles, 0.0, 0.0, freePose, &free_space);
+
+      // Each iteration starts from a cloud around one of the poses
+      StageTime laser_time, marker_time, resample_time;
+      for(int it = 0; it < iterations; it++)
+      {
+        int p = it % pose_count;
+        pf_init(pf, truth[p], cov);
+
+        start = ros::WallTime::now();
+        laser.UpdateSensor(pf, scans[p]);
+        laser_time.add(1e3 * (ros::WallTime::now() - start).toSec());
+
+        start = ros::WallTime::now();
+        marker.UpdateSensor(pf, &detections[p]);
+        marker_time.add(1e3 * (ros::WallTime::now() - start).toSec());
+
+        start = ros::WallTime::now();
+        pf_update_resample(pf);
+        resample_time.add(1e3 * (ros::WallTime::now() - start).toSec());
+      }
+      pf_free(pf);
+
+      fprintf(out, "        {\n          \"particles\": %d,\n", particles);
+      printStage(out, "laser_update_sensor_ms", laser_time, false);
+      printStage(out, "marker_observation_likelihood_ms", marker_time, false);
+      printStage(out, "pf_update_resample_ms", resample_time, true);
+      fprintf(out, "        }%s\n", n + 1 == particle_counts.size() ? "" : ",");
+    }
+    fprintf(out, "      ]\n    }%s\n", t + 1 == thread_counts.size() ? "" : ",");
+  }
+  fprintf(out, "  ]\n}\n");
+  if(out != stdout)
+    fclose(out);
+
+  for(int p = 0; p < pose_count; p++)
+    delete scans[p];
+  map_free(map);
+  return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * Convert a map_server YAML/PGM map into the binary map format that
+ * amcl_doris can memory-map through its ~map_file_bin parameter.
+ *
+ *   map_to_bin <map.yaml> <map.bin> [--max-occ-dist D] [--crop-margin M] [--no-crop]
+ *
+ * With --max-occ-dist the likelihood field distances are precomputed and
+ * stored, so the node skips the distance transform when its
+ * laser_likelihood_max_dist matches D.  Unless --no-crop is given the
+ * unknown border is cropped, keeping a margin of M (by default 2 m, the
+ * node's laser_likelihood_max_dist) and at least D.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "amcl_doris/map/map.h"
+
+#define USAGE "USAGE: map_to_bin <map.yaml> <map.bin> [--max-occ-dist D] [--crop-margin M] [--no-crop]"
+
+int
+main(int argc, char** argv)
+{
+  if(argc < 3)
+  {
+    puts(USAGE);
+    return 1;
+  }
+
+  double max_occ_dist = 0.0;
+  double crop_margin = 2.0;
+  bool crop = true;
+  for(int i = 3; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--max-occ-dist") && i + 1 < argc)
+      max_occ_dist = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--crop-margin") && i + 1 < argc)
+      crop_margin = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--no-crop"))
+      crop = false;
+    else
+    {
+      puts(USAGE);
+      return 1;
+    }
+  }
+
+  map_t* map = map_alloc();
+  if(map_load_yaml(map, argv[1]) != 0)
+  {
+    map_free(map);
+    return 1;
+  }
+  printf("Loaded %d X %d map @ %.3f m/pix\n", map->size_x, map->size_y, map->scale);
+
+  // The node crops with its laser_likelihood_max_dist; a narrower margin
+  // would change the likelihood field near the border
+  if(crop_margin < max_occ_dist)
+    crop_margin = max_occ_dist;
+  if(crop && map_crop(map, crop_margin) == 0)
+    printf("Cropped to %d X %d\n", map->size_x, map->size_y);
+
+  if(max_occ_dist > 0.0)
+  {
+    map_update_cspace(map, max_occ_dist);
+    printf("Stored distance field up to %.3f m\n", max_occ_dist);
+  }
+
+  int ret = map_save_bin(map, argv[2]);
+  map_free(map);
+  return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * Time the marker sensor models on a synthetic scene: a ring of markers
+ * around the robot, detections generated from the true pose and a
+ * particle cloud spread around it.
+ *
+ *   marker_model_benchmark [--particles N] [--iterations K] [--simulation 0|1]
+ *                          [--calibration FILE] [--miss-prob P]
+ *
+ * For each model it prints the time per update and how far the heaviest
+ * particle is from the true pose.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+#include <ros/time.h>
+
+#include "amcl_doris/sensors/amcl_marker.h"
+
+#include "benchmark_scene.h"
+
+#define USAGE "USAGE: marker_model_benchmark [--particles N] [--iterations K] [--simulation 0|1] [--calibration FILE] [--miss-prob P]"
+
+using namespace amcl;
+
+static pf_vector_t uniformPose(void *data)
+{
+  return pf_vector_zero();
+}
+
+int
+main(int argc, char** argv)
+{
+  int particles = 5000;
+  int iterations = 50;
+  int simulation = 1;
+  double miss_prob = 1.0;
+  std::string calibration_file;
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--particles") && i + 1 < argc)
+      particles = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--iterations") && i + 1 < argc)
+      iterations = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--simulation") && i + 1 < argc)
+      simulation = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--calibration") && i + 1 < argc)
+      calibration_file = argv[++i];
+    else if(!strcmp(argv[i], "--miss-prob") && i + 1 < argc)
+      miss_prob = atof(argv[++i]);
+    else
+    {
+      puts(USAGE);
+      return 1;
+    }
+  }
+  srand(42);
+
+  if(calibration_file.empty())
+    calibration_file = CameraCalibration::defaultFile(simulation ? "doris_sim.yaml" : "doris_omni.yaml");
+  CameraCalibration calibration;
+  if(!calibration.load(calibration_file))
+    return 1;
+
+  std::vector<Marcador> markers;
+  makeMarkers(markers, 16, 4.0);
+  AMCLMarkerMap table;
+  table.Build(markers);
+  if(miss_prob < 1.0)
+    table.BuildIndex(5.0, MARKER_MISS_RESOLUTION, MARKER_MISS_MARKERS);
+
+  std::vector<geometry_msgs::Pose> cameras;
+  makeCameras(cameras);
+
+  AMCLMarker marker(simulation);
+  marker.map = &table;
+  marker.num_cam = cameras.size();
+  marker.image_width = simulation ? 1812 : calibration.info.width;
+  marker.image_height = simulation ? 679 : calibration.info.height;
+  marker.SetCalibration(calibration);
+  marker.SetCameraRig(cameras, std::vector<double>());
+  marker.SetMissModel(miss_prob);
+
+  // Detections from the true pose, with a pixel of noise
+  pf_vector_t truth = pf_vector_zero();
+  truth.v[0] = 0.3;
+  truth.v[1] = -0.2;
+  truth.v[2] = 0.4;
+  AMCLMarkerData data;
+  data.sensor = &marker;
+  for(size_t k = 0; k < markers.size(); k++)
+  {
+    std::vector<cv::Point2f> corners;
+    marker.ExpectedCorners(truth, k, corners);
+    bool inside = true;
+    for(int c = 0; c < MARKER_CORNERS; c++)
+    {
+      corners[c].x += gaussian(1.0);
+      corners[c].y += gaussian(1.0);
+      inside = inside && corners[c].x >= 0 && corners[c].x < marker.image_width &&
+        corners[c].y >= 0 && corners[c].y < marker.image_height;
+    }
+    if(!inside)
+      continue;
+    Marcador m = markers[k];
+    m.MarkerPoints(corners);
+    data.markers_obs.push_back(m);
+  }
+  printf("%d particles, %d markers detected, camera model %s\n", particles,
+         (int)data.markers_obs.size(), simulation ? "pinhole rig" : "omnidirectional");
+
+  pf_t *pf = pf_alloc(particles, particles, 0.0, 0.0, uniformPose, NULL);
+  pf_matrix_t cov = pf_matrix_zero();
+  cov.m[0][0] = 0.5*0.5;
+  cov.m[1][1] = 0.5*0.5;
+  cov.m[2][2] = 0.3*0.3;
+  pf_init(pf, truth, cov);
+
+  // Same cloud for both models
+  pf_sample_set_t *set = pf->sets + pf->current_set;
+  std::vector<pf_vector_t> cloud(set->sample_count);
+  for(int i = 0; i < set->sample_count; i++)
+    cloud[i] = set->samples[i].pose;
+
+  const char *names[] = { "observation_likelihood", "observation_likelihood/bin", "bearing" };
+  for(int model = 0; model < 3; model++)
+  {
+    if(model < 2)
+      marker.SetModelLikelihoodField(0.95, 0.005, 0.2, 4.0, 1.0);
+    else
+      marker.SetModelBearing(0.005, 4.0);
+    marker.bin_evaluation = (model == 1);
+
+    for(int i = 0; i < set->sample_count; i++)
+    {
+      set->samples[i].pose = cloud[i];
+      set->samples[i].weight = 1.0 / set->sample_count;
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    for(int it = 0; it < iterations; it++)
+      marker.UpdateSensor(pf, (AMCLSensorData*)&data);
+    double runtime = (ros::WallTime::now() - start).toSec();
+
+    int best = 0;
+    for(int i = 1; i < set->sample_count; i++)
+      if(set->samples[i].weight > set->samples[best].weight)
+        best = i;
+    pf_vector_t pose = set->samples[best].pose;
+    printf("%-28s %9.3f ms/update   best particle %.3f m, %.3f rad from truth\n",
+           names[model], 1e3 * runtime / iterations,
+           hypot(pose.v[0] - truth.v[0], pose.v[1] - truth.v[1]),
+           fabs(atan2(sin(pose.v[2] - truth.v[2]), cos(pose.v[2] - truth.v[2]))));
+  }
+
+  pf_free(pf);
+  return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Check the camera rig against the pinhole model of each camera: batched
+ * projection, the choice of camera by azimuth and the bearing of pixels.
+ */
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <vector>
+
+#include "amcl_doris/sensors/amcl_camera_rig.h"
+
+using namespace amcl;
+
+// Camera matrix shared by the cameras
+static const double FX = 400, FY = 410, CX = 320, CY = 240;
+static const double IMAGE_WIDTH = 1920;
+static const int CAMERAS = 3;
+
+// Camera k looks along azimuth 2pi k / CAMERAS, off the rig centre
+static tf::Transform cameraPose(int k)
+{
+  double a = 2*M_PI * k / CAMERAS;
+  return tf::Transform(tf::createQuaternionFromRPY(0, a, 0),
+                       tf::Vector3(0.1 * sin(a), -0.05, 0.1 * cos(a)));
+}
+
+static void makeRig(AMCLCameraRig& rig, std::vector<double>& offsets)
+{
+  const double P[12] = { FX, 0, CX, 0,
+                         0, FY, CY, 0,
+                         0, 0, 1, 0 };
+  for(int k = 0; k < CAMERAS; k++)
+  {
+    offsets.push_back(AMCLCameraRig::DefaultOffset(cameraPose(k), CAMERAS, IMAGE_WIDTH));
+    rig.AddCamera(cameraPose(k), P, offsets.back());
+  }
+  rig.Compile();
+}
+
+// Pinhole projection by camera k, in the stitched image
+static void pinhole(int k, double offset, const tf::Vector3& p, double& u, double& v)
+{
+  tf::Vector3 c = cameraPose(k).inverse() * p;
+  u = FX * c.x() / c.z() + CX + offset;
+  v = FY * c.y() / c.z() + CY;
+}
+
+TEST(CameraRig, DefaultOffsets)
+{
+  std::vector<double> offsets;
+  AMCLCameraRig rig;
+  makeRig(rig, offsets);
+  ASSERT_EQ(rig.Size(), CAMERAS);
+  EXPECT_DOUBLE_EQ(offsets[0], 0);
+  EXPECT_DOUBLE_EQ(offsets[1], IMAGE_WIDTH / CAMERAS);
+  EXPECT_DOUBLE_EQ(offsets[2], -IMAGE_WIDTH / CAMERAS);
+}
+
+TEST(CameraRig, ProjectionMatchesPinhole)
+{
+  std::vector<double> offsets;
+  AMCLCameraRig rig;
+  makeRig(rig, offsets);
+
+  // Points around each camera's axis, away from the azimuths where the
+  // closest camera changes
+  std::vector<double> x, y, z;
+  std::vector<int> camera;
+  for(int k = 0; k < CAMERAS; k++)
+  {
+    double a = 2*M_PI * k / CAMERAS;
+    for(double da = -0.8; da <= 0.8; da += 0.1)
+      for(double h = -1.0; h <= 1.0; h += 0.5)
+        for(double r = 1.0; r <= 6.0; r += 2.5)
+        {
+          x.push_back(r * sin(a + da));
+          y.push_back(h);
+          z.push_back(r * cos(a + da));
+          camera.push_back(k);
+        }
+  }
+  std::vector<double> u(x.size()), v(x.size());
+  rig.Project(&x[0], &y[0], &z[0], x.size(), &u[0], &v[0]);
+
+  for(size_t i = 0; i < x.size(); i++)
+  {
+    double eu, ev;
+    pinhole(camera[i], offsets[camera[i]], tf::Vector3(x[i], y[i], z[i]), eu, ev);
+    EXPECT_NEAR(u[i], eu, 1e-6) << "point " << i;
+    EXPECT_NEAR(v[i], ev, 1e-6) << "point " << i;
+    EXPECT_TRUE(rig.InFront(x[i], y[i], z[i]));
+  }
+
+  // Behind the forward camera is another camera's view
+  EXPECT_TRUE(rig.InFront(0, 0, -3));
+}
+
+TEST(CameraRig, UnprojectInvertsProjection)
+{
+  std::vector<double> offsets;
+  AMCLCameraRig rig;
+  makeRig(rig, offsets);
+
+  for(int k = 0; k < CAMERAS; k++)
+  {
+    for(double du = -200; du <= 200; du += 50)
+      for(double dv = -150; dv <= 150; dv += 50)
+      {
+        double u = CX + offsets[k] + du, v = CY + dv;
+        double b[3], o[3];
+        rig.Unproject(u, v, b, o);
+        EXPECT_NEAR(b[0]*b[0] + b[1]*b[1] + b[2]*b[2], 1.0, 1e-12);
+
+        // The camera centre and a point along the ray project back there
+        tf::Vector3 centre = cameraPose(k).getOrigin();
+        EXPECT_NEAR(o[0], centre.x(), 1e-9);
+        EXPECT_NEAR(o[1], centre.y(), 1e-9);
+        EXPECT_NEAR(o[2], centre.z(), 1e-9);
+        double eu, ev;
+        pinhole(k, offsets[k], tf::Vector3(o[0] + 2*b[0], o[1] + 2*b[1], o[2] + 2*b[2]), eu, ev);
+        EXPECT_NEAR(eu, u, 1e-6);
+        EXPECT_NEAR(ev, v, 1e-6);
+      }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,288 @@
+/*
+ * Check the map functions against what they replace: weighted sampling
+ * of the free space index against its weights, and cropping against the
+ * world coordinates of the uncropped map, and the binary format against
+ * the map it was saved from, and the windowed updates of small edits
+ * against a recomputation of the whole map.
+ */
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "amcl_doris/map/map.h"
+
+// Map of free cells with a wall on the border
+static map_t *makeMap(int size_x, int size_y)
+{
+  map_t *map = map_alloc();
+  map->size_x = size_x;
+  map->size_y = size_y;
+  map->scale = 0.1;
+  map->cells = (map_cell_t*)calloc((size_t)size_x * size_y, sizeof(map_cell_t));
+  for(int j = 0; j < size_y; j++)
+    for(int i = 0; i < size_x; i++)
+    {
+      bool wall = (i == 0 || j == 0 || i == size_x - 1 || j == size_y - 1);
+      map->cells[MAP_INDEX(map, i, j)].occ_state = wall ? +1 : -1;
+    }
+  return map;
+}
+
+TEST(FreeIndex, Cells)
+{
+  map_t *map = makeMap(7, 5);
+  map_free_index_t *index = map_free_index_alloc(map);
+  ASSERT_EQ(index->count, 5 * 3);
+  for(int k = 0; k < index->count; k++)
+  {
+    EXPECT_EQ(map->cells[index->cells[k]].occ_state, -1);
+    if(k > 0)
+      EXPECT_LT(index->cells[k - 1], index->cells[k]);
+  }
+  map_free_index_free(index);
+  map_free(map);
+}
+
+TEST(FreeIndex, AliasFrequencies)
+{
+  map_t *map = makeMap(7, 5);
+  map_free_index_t *index = map_free_index_alloc(map);
+
+  // Uneven weights, some of them zero
+  std::vector<double> weights(index->count);
+  double total = 0;
+  for(int k = 0; k < index->count; k++)
+  {
+    weights[k] = (k % 4 == 0) ? 0.0 : 1.0 + k;
+    total += weights[k];
+  }
+  ASSERT_EQ(map_free_index_set_weights(index, &weights[0]), 0);
+
+  srand48(1);
+  const int draws = 400000;
+  std::vector<int> hits(map->size_x * map->size_y, 0);
+  for(int d = 0; d < draws; d++)
+  {
+    int cell = map_free_index_sample(index);
+    ASSERT_GE(cell, 0);
+    hits[cell]++;
+  }
+  for(int k = 0; k < index->count; k++)
+  {
+    double p = weights[k] / total;
+    // Five standard deviations of the binomial count
+    double tolerance = 5 * sqrt(draws * p * (1 - p)) + 1;
+    EXPECT_NEAR(hits[index->cells[k]], draws * p, tolerance) << "entry " << k;
+  }
+
+  // Back to uniform
+  ASSERT_EQ(map_free_index_set_weights(index, NULL), 0);
+  std::fill(hits.begin(), hits.end(), 0);
+  for(int d = 0; d < draws; d++)
+    hits[map_free_index_sample(index)]++;
+  double p = 1.0 / index->count;
+  for(int k = 0; k < index->count; k++)
+    EXPECT_NEAR(hits[index->cells[k]], draws * p, 5 * sqrt(draws * p * (1 - p)));
+
+  // Negative and all-zero weights are refused
+  weights[0] = -1;
+  EXPECT_EQ(map_free_index_set_weights(index, &weights[0]), -1);
+  std::fill(weights.begin(), weights.end(), 0.0);
+  EXPECT_EQ(map_free_index_set_weights(index, &weights[0]), -1);
+
+  map_free_index_free(index);
+  map_free(map);
+}
+
+// Unknown map with a known block of free and occupied cells in
+// [10, 20] x [5, 12]
+static map_t *makeUnknownBorderMap()
+{
+  map_t *map = map_alloc();
+  map->size_x = 41;
+  map->size_y = 30;
+  map->scale = 0.1;
+  map->origin_x = 1.3;
+  map->origin_y = -0.7;
+  map->cells = (map_cell_t*)calloc((size_t)map->size_x * map->size_y, sizeof(map_cell_t));
+  for(int j = 5; j <= 12; j++)
+    for(int i = 10; i <= 20; i++)
+      map->cells[MAP_INDEX(map, i, j)].occ_state = ((i * 7 + j * 3) % 5 == 0) ? +1 : -1;
+  return map;
+}
+
+TEST(Crop, WorldCoordinatesKept)
+{
+  // Margins of 2 and 3 cells: odd and even cropped sizes
+  const double margins[] = { 0.2, 0.3 };
+  for(int m = 0; m < 2; m++)
+  {
+    map_t *original = makeUnknownBorderMap();
+    map_t *map = makeUnknownBorderMap();
+    ASSERT_EQ(map_crop(map, margins[m]), 0);
+    int pad = 2 + m;
+    EXPECT_EQ(map->size_x, 11 + 2 * pad);
+    EXPECT_EQ(map->size_y, 8 + 2 * pad);
+
+    for(int j = 0; j < original->size_y; j++)
+      for(int i = 0; i < original->size_x; i++)
+      {
+        double x = MAP_WXGX(original, i);
+        double y = MAP_WYGY(original, j);
+        int ci = MAP_GXWX(map, x);
+        int cj = MAP_GYWY(map, y);
+        int state = original->cells[MAP_INDEX(original, i, j)].occ_state;
+        if(!MAP_VALID(map, ci, cj))
+        {
+          EXPECT_EQ(state, 0) << "known cell " << i << ", " << j << " cropped";
+          continue;
+        }
+        EXPECT_NEAR(MAP_WXGX(map, ci), x, 1e-9);
+        EXPECT_NEAR(MAP_WYGY(map, cj), y, 1e-9);
+        EXPECT_EQ(map->cells[MAP_INDEX(map, ci, cj)].occ_state, state);
+      }
+    map_free(original);
+    map_free(map);
+  }
+
+  // Nothing known, nothing cropped
+  map_t *map = map_alloc();
+  map->size_x = map->size_y = 4;
+  map->scale = 0.1;
+  map->cells = (map_cell_t*)calloc(16, sizeof(map_cell_t));
+  EXPECT_EQ(map_crop(map, 0.0), -1);
+  EXPECT_EQ(map->size_x, 4);
+  map_free(map);
+}
+
+TEST(BinaryFormat, RoundTrip)
+{
+  map_t *map = makeUnknownBorderMap();
+  map_update_cspace(map, 0.5);
+
+  char filename[] = "/tmp/test_map_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  ASSERT_EQ(map_save_bin(map, filename), 0);
+
+  map_t *loaded = map_alloc();
+  ASSERT_EQ(map_load_bin(loaded, filename), 0);
+  EXPECT_TRUE(loaded->mapped != NULL);
+  EXPECT_EQ(loaded->size_x, map->size_x);
+  EXPECT_EQ(loaded->size_y, map->size_y);
+  EXPECT_EQ(loaded->scale, map->scale);
+  EXPECT_EQ(loaded->origin_x, map->origin_x);
+  EXPECT_EQ(loaded->origin_y, map->origin_y);
+  EXPECT_EQ(loaded->max_occ_dist, map->max_occ_dist);
+  for(int k = 0; k < map->size_x * map->size_y; k++)
+  {
+    ASSERT_EQ(loaded->cells[k].occ_state, map->cells[k].occ_state) << "cell " << k;
+    ASSERT_EQ(loaded->cells[k].occ_dist, map->cells[k].occ_dist) << "cell " << k;
+  }
+
+  // The mapping is private: edits don't reach the file
+  loaded->cells[0].occ_state = +1;
+  map_t *again = map_alloc();
+  ASSERT_EQ(map_load_bin(again, filename), 0);
+  EXPECT_EQ(again->cells[0].occ_state, map->cells[0].occ_state);
+  map_free(again);
+  map_free(loaded);
+
+  // Anything else is refused
+  FILE *file = fopen(filename, "wb");
+  ASSERT_TRUE(file != NULL);
+  fputs("P5 not a map", file);
+  fclose(file);
+  map_t *bad = map_alloc();
+  EXPECT_EQ(map_load_bin(bad, filename), -1);
+  map_free(bad);
+
+  unlink(filename);
+  map_free(map);
+}
+
+// Room with a few pillars, distances computed up to max_occ_dist
+static map_t *makeRoom(double max_occ_dist)
+{
+  map_t *map = makeMap(60, 50);
+  map->scale = 0.05;
+  for(int j = 20; j < 24; j++)
+    for(int i = 15; i < 18; i++)
+      map->cells[MAP_INDEX(map, i, j)].occ_state = +1;
+  for(int j = 30; j < 33; j++)
+    for(int i = 40; i < 45; i++)
+      map->cells[MAP_INDEX(map, i, j)].occ_state = +1;
+  map_update_cspace(map, max_occ_dist);
+  return map;
+}
+
+// Set the occupancy of the cells in [min_i, max_i] x [min_j, max_j]
+static void setWindow(map_t *map, int min_i, int min_j, int max_i, int max_j, int state)
+{
+  for(int j = min_j; j <= max_j; j++)
+    for(int i = min_i; i <= max_i; i++)
+      map->cells[MAP_INDEX(map, i, j)].occ_state = state;
+}
+
+TEST(WindowedUpdate, Cspace)
+{
+  const double max_occ_dist = 0.6;
+  map_t *map = makeRoom(max_occ_dist);
+  map_t *full = makeRoom(max_occ_dist);
+
+  // A new obstacle, one removed and one next to the wall
+  const int edits[3][5] = { { 28, 10, 31, 12, +1 },
+                            { 40, 30, 44, 32, -1 },
+                            { 1, 40, 6, 41, +1 } };
+  for(int e = 0; e < 3; e++)
+  {
+    const int *w = edits[e];
+    setWindow(map, w[0], w[1], w[2], w[3], w[4]);
+    setWindow(full, w[0], w[1], w[2], w[3], w[4]);
+    map_update_cspace_window(map, max_occ_dist, w[0], w[1], w[2], w[3]);
+    map_update_cspace(full, max_occ_dist);
+
+    for(int k = 0; k < map->size_x * map->size_y; k++)
+      ASSERT_NEAR(map->cells[k].occ_dist, full->cells[k].occ_dist, map->scale)
+        << "edit " << e << ", cell " << k % map->size_x << ", " << k / map->size_x;
+  }
+  map_free(map);
+  map_free(full);
+}
+
+TEST(WindowedUpdate, FreeIndex)
+{
+  map_t *map = makeRoom(0.6);
+  map_free_index_t *index = map_free_index_alloc(map);
+
+  const int edits[3][5] = { { 28, 10, 31, 12, +1 },
+                            { 15, 20, 17, 23, -1 },
+                            { 0, 0, 5, 5, -1 } };
+  for(int e = 0; e < 3; e++)
+  {
+    const int *w = edits[e];
+    setWindow(map, w[0], w[1], w[2], w[3], w[4]);
+    map_free_index_update(index, map, w[0], w[1], w[2], w[3]);
+
+    map_free_index_t *rebuilt = map_free_index_alloc(map);
+    ASSERT_EQ(index->count, rebuilt->count) << "edit " << e;
+    for(int k = 0; k < index->count; k++)
+      ASSERT_EQ(index->cells[k], rebuilt->cells[k]) << "edit " << e << ", entry " << k;
+    map_free_index_free(rebuilt);
+  }
+  map_free_index_free(index);
+  map_free(map);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,91 @@
+/*
+ * Check the odometry history: interpolation, the edges of the buffered
+ * range and lookups while another thread keeps adding poses.
+ */
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <thread>
+
+#include "amcl_doris/sensors/amcl_odom_buffer.h"
+
+using namespace amcl;
+
+// Robot on a circle, one pose every 10 ms
+static pf_vector_t circle(double t)
+{
+  pf_vector_t p = pf_vector_zero();
+  p.v[0] = cos(t);
+  p.v[1] = sin(t);
+  p.v[2] = atan2(sin(t + M_PI/2), cos(t + M_PI/2));
+  return p;
+}
+
+TEST(OdomBuffer, Interpolation)
+{
+  AMCLOdomBuffer buffer(256);
+  for(int i = 0; i < 100; i++)
+    buffer.Add(0.01 * i, circle(0.01 * i));
+
+  pf_vector_t p;
+  for(double t = 0.0; t <= 0.99; t += 0.0037)
+  {
+    ASSERT_TRUE(buffer.Lookup(t, 0.0, p));
+    pf_vector_t e = circle(t);
+    EXPECT_NEAR(p.v[0], e.v[0], 1e-4);
+    EXPECT_NEAR(p.v[1], e.v[1], 1e-4);
+    EXPECT_NEAR(atan2(sin(p.v[2] - e.v[2]), cos(p.v[2] - e.v[2])), 0.0, 1e-4);
+  }
+}
+
+TEST(OdomBuffer, Range)
+{
+  AMCLOdomBuffer buffer(16);
+  pf_vector_t p;
+  EXPECT_FALSE(buffer.Lookup(0.0, 1.0, p));
+
+  for(int i = 0; i < 40; i++)
+    buffer.Add(i, circle(i));
+  // Only the newer half of the ring is searched
+  EXPECT_FALSE(buffer.Lookup(31.5, 0.0, p));
+  EXPECT_TRUE(buffer.Lookup(32.5, 0.0, p));
+  // Newer than the newest, within the tolerance or not
+  EXPECT_TRUE(buffer.Lookup(39.05, 0.1, p));
+  EXPECT_NEAR(p.v[0], circle(39).v[0], 1e-12);
+  EXPECT_FALSE(buffer.Lookup(39.5, 0.1, p));
+}
+
+TEST(OdomBuffer, ConcurrentWriter)
+{
+  AMCLOdomBuffer buffer(64);
+  const int count = 200000;
+  std::thread writer([&]() {
+    for(int i = 0; i < count; i++)
+      buffer.Add(1e-3 * i, circle(1e-3 * i));
+  });
+
+  // Whatever the reader gets must be a pose of the circle
+  int hits = 0;
+  pf_vector_t p;
+  while(buffer.Count() < (uint64_t)count)
+  {
+    uint64_t h = buffer.Count();
+    if(h < 12)
+      continue;
+    double t = 1e-3 * (h - 10) + 3e-4;
+    if(buffer.Lookup(t, 0.0, p))
+    {
+      hits++;
+      ASSERT_NEAR(hypot(p.v[0], p.v[1]), 1.0, 1e-5);
+    }
+  }
+  writer.join();
+  EXPECT_GT(hits, 0);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
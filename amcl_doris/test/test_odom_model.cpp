@@ -0,0 +1,198 @@
+/*
+ * Check the batched odometry motion model against the per-particle
+ * sampling it replaces: moved from one pose, the particles must have the
+ * same mean and variance, and the result must not depend on threads.
+ */
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "amcl_doris/sensors/amcl_odom.h"
+
+using namespace amcl;
+
+static const int PARTICLES = 20000;
+
+static double angle_diff(double a, double b)
+{
+  double d = atan2(sin(a), cos(a)) - atan2(sin(b), cos(b));
+  return atan2(sin(d), cos(d));
+}
+
+// Per-particle sample_motion_odometry, one pf_ran_gaussian per term
+static void moveReference(odom_model_t type, const double alpha[5],
+                          const AMCLOdomData& data, std::vector<pf_vector_t>& poses)
+{
+  pf_vector_t old_pose = pf_vector_sub(data.pose, data.delta);
+  double delta_trans = sqrt(data.delta.v[0]*data.delta.v[0] + data.delta.v[1]*data.delta.v[1]);
+  bool corrected = (type == ODOM_MODEL_DIFF_CORRECTED || type == ODOM_MODEL_OMNI_CORRECTED);
+
+  if(type == ODOM_MODEL_DIFF || type == ODOM_MODEL_DIFF_CORRECTED)
+  {
+    double delta_rot1 = delta_trans < 0.01 ? 0.0 :
+      angle_diff(atan2(data.delta.v[1], data.delta.v[0]), old_pose.v[2]);
+    double delta_rot2 = angle_diff(data.delta.v[2], delta_rot1);
+    double rot1_noise = std::min(fabs(angle_diff(delta_rot1, 0.0)), fabs(angle_diff(delta_rot1, M_PI)));
+    double rot2_noise = std::min(fabs(angle_diff(delta_rot2, 0.0)), fabs(angle_diff(delta_rot2, M_PI)));
+    double s1 = alpha[0]*rot1_noise*rot1_noise + alpha[1]*delta_trans*delta_trans;
+    double st = alpha[2]*delta_trans*delta_trans + alpha[3]*rot1_noise*rot1_noise +
+                alpha[3]*rot2_noise*rot2_noise;
+    double s2 = alpha[0]*rot2_noise*rot2_noise + alpha[1]*delta_trans*delta_trans;
+    if(corrected)
+    {
+      s1 = sqrt(s1);
+      st = sqrt(st);
+      s2 = sqrt(s2);
+    }
+    for(size_t i = 0; i < poses.size(); i++)
+    {
+      double rot1_hat = angle_diff(delta_rot1, pf_ran_gaussian(s1));
+      double trans_hat = delta_trans - pf_ran_gaussian(st);
+      double rot2_hat = angle_diff(delta_rot2, pf_ran_gaussian(s2));
+      poses[i].v[0] += trans_hat * cos(poses[i].v[2] + rot1_hat);
+      poses[i].v[1] += trans_hat * sin(poses[i].v[2] + rot1_hat);
+      poses[i].v[2] += rot1_hat + rot2_hat;
+    }
+  }
+  else
+  {
+    double delta_rot = data.delta.v[2];
+    double st = alpha[2]*delta_trans*delta_trans + alpha[0]*delta_rot*delta_rot;
+    double sr = alpha[3]*delta_rot*delta_rot + alpha[1]*delta_trans*delta_trans;
+    double ss = alpha[0]*delta_rot*delta_rot + alpha[4]*delta_trans*delta_trans;
+    if(corrected)
+    {
+      st = sqrt(st);
+      sr = sqrt(sr);
+      ss = sqrt(ss);
+    }
+    for(size_t i = 0; i < poses.size(); i++)
+    {
+      double bearing = angle_diff(atan2(data.delta.v[1], data.delta.v[0]), old_pose.v[2]) +
+                       poses[i].v[2];
+      double cs = cos(bearing), sn = sin(bearing);
+      double trans_hat = delta_trans + pf_ran_gaussian(st);
+      double rot_hat = delta_rot + pf_ran_gaussian(sr);
+      double strafe_hat = pf_ran_gaussian(ss);
+      poses[i].v[0] += trans_hat * cs + strafe_hat * sn;
+      poses[i].v[1] += trans_hat * sn - strafe_hat * cs;
+      poses[i].v[2] += rot_hat;
+    }
+  }
+}
+
+// Particles all at start, moved by the batched model
+static std::vector<pf_vector_t> moveBatched(odom_model_t type, const double alpha[5],
+                                            AMCLOdomData& data, const pf_vector_t& start,
+                                            bool parallel, long seed)
+{
+  pf_seed(seed);
+  pf_t *pf = pf_alloc(PARTICLES, PARTICLES, 0.001, 0.1, NULL, NULL);
+  pf_sample_set_t *set = pf->sets + pf->current_set;
+  set->sample_count = PARTICLES;
+  for(int i = 0; i < PARTICLES; i++)
+    set->samples[i].pose = start;
+
+  AMCLOdom odom;
+  odom.SetModel(type, alpha[0], alpha[1], alpha[2], alpha[3], alpha[4]);
+  odom.parallel = parallel;
+  odom.UpdateAction(pf, &data);
+
+  std::vector<pf_vector_t> poses(PARTICLES);
+  for(int i = 0; i < PARTICLES; i++)
+    poses[i] = set->samples[i].pose;
+  pf_free(pf);
+  return poses;
+}
+
+static void moments(const std::vector<pf_vector_t>& poses, int k, double& mean, double& var)
+{
+  mean = 0;
+  for(size_t i = 0; i < poses.size(); i++)
+    mean += poses[i].v[k] / poses.size();
+  var = 0;
+  for(size_t i = 0; i < poses.size(); i++)
+    var += (poses[i].v[k] - mean) * (poses[i].v[k] - mean) / (poses.size() - 1);
+}
+
+static void compare(odom_model_t type, double dx, double dy, double da)
+{
+  const double alpha[5] = { 0.2, 0.2, 0.2, 0.2, 0.2 };
+  pf_vector_t start = pf_vector_zero();
+  start.v[0] = 1.0;
+  start.v[1] = -2.0;
+  start.v[2] = 0.7;
+
+  AMCLOdomData data;
+  data.pose = pf_vector_zero();
+  data.pose.v[0] = 3.0;
+  data.pose.v[1] = 1.0;
+  data.pose.v[2] = 0.3;
+  data.delta = pf_vector_zero();
+  data.delta.v[0] = dx;
+  data.delta.v[1] = dy;
+  data.delta.v[2] = da;
+
+  std::vector<pf_vector_t> batched = moveBatched(type, alpha, data, start, false, 42);
+  pf_seed(43);
+  std::vector<pf_vector_t> reference(PARTICLES, start);
+  moveReference(type, alpha, data, reference);
+
+  for(int k = 0; k < 3; k++)
+  {
+    double mean, var, ref_mean, ref_var;
+    moments(batched, k, mean, var);
+    moments(reference, k, ref_mean, ref_var);
+    // Five standard errors of the mean and of the variance
+    EXPECT_NEAR(mean, ref_mean, 5 * sqrt(2 * ref_var / PARTICLES) + 1e-12)
+      << "model " << type << ", component " << k;
+    EXPECT_NEAR(var, ref_var, 5 * ref_var * sqrt(2.0 / PARTICLES) + 1e-12)
+      << "model " << type << ", component " << k;
+  }
+}
+
+TEST(OdomModel, Diff)
+{
+  compare(ODOM_MODEL_DIFF, 0.3, 0.1, 0.2);
+  // Turning in place
+  compare(ODOM_MODEL_DIFF, 0.0, 0.0, 0.4);
+  // Backwards
+  compare(ODOM_MODEL_DIFF, -0.2, -0.05, -0.1);
+}
+
+TEST(OdomModel, DiffCorrected)
+{
+  compare(ODOM_MODEL_DIFF_CORRECTED, 0.3, 0.1, 0.2);
+}
+
+TEST(OdomModel, Omni)
+{
+  compare(ODOM_MODEL_OMNI, 0.2, 0.25, 0.15);
+  compare(ODOM_MODEL_OMNI_CORRECTED, 0.2, 0.25, 0.15);
+}
+
+TEST(OdomModel, SameSeedSameResult)
+{
+  const double alpha[5] = { 0.2, 0.2, 0.2, 0.2, 0.2 };
+  pf_vector_t start = pf_vector_zero();
+  AMCLOdomData data;
+  data.pose = pf_vector_zero();
+  data.delta = pf_vector_zero();
+  data.delta.v[0] = 0.3;
+  data.delta.v[2] = 0.2;
+
+  std::vector<pf_vector_t> serial = moveBatched(ODOM_MODEL_DIFF, alpha, data, start, false, 7);
+  std::vector<pf_vector_t> threads = moveBatched(ODOM_MODEL_DIFF, alpha, data, start, true, 7);
+  for(int i = 0; i < PARTICLES; i++)
+    for(int k = 0; k < 3; k++)
+      ASSERT_EQ(serial[i].v[k], threads[i].v[k]) << "particle " << i;
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
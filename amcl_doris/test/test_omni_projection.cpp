@@ -0,0 +1,152 @@
+/*
+ * Check the batched unified-model projection used by the marker model
+ * against cv::omnidir::projectPoints, and its inverse.
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <opencv2/ccalib/omnidir.hpp>
+
+#include "amcl_doris/sensors/amcl_omni_camera.h"
+
+using namespace amcl;
+
+// Calibration of the real omnidirectional camera (see
+// detector/calibration/doris_omni.yaml)
+static void realCamera(cv::Mat& K, cv::Mat& D, double& xi)
+{
+  K = (cv::Mat_<float>(3, 3) <<
+       8.5101024687735935e+02, -2.2255059056366439e-01, 6.5571465382877625e+02,
+       0.0, 8.5170243585411265e+02, 5.1216084358475405e+02,
+       0.0, 0.0, 1.0);
+  D = (cv::Mat_<float>(4, 1) <<
+       -4.2648301140911193e-01, 3.1105618959437248e-01,
+       -1.3775384616268102e-02, -1.9560559208606078e-03);
+  xi = 1.5861076761699640e+00;
+}
+
+// Points around the camera, including behind it (the mirror sees more
+// than a hemisphere)
+static void testPoints(std::vector<double>& x, std::vector<double>& y,
+                       std::vector<double>& z)
+{
+  cv::RNG rng(12345);
+  for(int i = 0; i < 2000; i++)
+  {
+    double az = rng.uniform(-CV_PI, CV_PI);
+    double el = rng.uniform(-1.2, 1.2);
+    double r = rng.uniform(0.3, 15.0);
+    x.push_back(r * cos(el) * sin(az));
+    y.push_back(r * sin(el));
+    z.push_back(r * cos(el) * cos(az));
+  }
+}
+
+static void compare(const cv::Mat& K, const cv::Mat& D, double xi, double tolerance)
+{
+  std::vector<double> x, y, z;
+  testPoints(x, y, z);
+  int n = x.size();
+
+  std::vector<cv::Point3d> points(n);
+  for(int i = 0; i < n; i++)
+    points[i] = cv::Point3d(x[i], y[i], z[i]);
+  std::vector<cv::Point2d> expected;
+  cv::Mat rvec = cv::Mat::zeros(3, 1, CV_64F);
+  cv::Mat tvec = cv::Mat::zeros(3, 1, CV_64F);
+  cv::omnidir::projectPoints(points, expected, rvec, tvec, K, xi, D);
+
+  AMCLOmniCamera camera;
+  camera.SetIntrinsics(K, xi, D);
+  std::vector<double> u(n), v(n);
+  camera.Project(&x[0], &y[0], &z[0], n, &u[0], &v[0]);
+
+  for(int i = 0; i < n; i++)
+  {
+    EXPECT_NEAR(expected[i].x, u[i], tolerance) << "point " << i;
+    EXPECT_NEAR(expected[i].y, v[i], tolerance) << "point " << i;
+  }
+}
+
+TEST(OmniProjection, MatchesOpenCVFloatCalibration)
+{
+  cv::Mat K, D;
+  double xi;
+  realCamera(K, D, xi);
+  compare(K, D, xi, 1e-6);
+}
+
+TEST(OmniProjection, MatchesOpenCVDoubleCalibration)
+{
+  cv::Mat K, D;
+  double xi;
+  realCamera(K, D, xi);
+  K.convertTo(K, CV_64F);
+  D.convertTo(D, CV_64F);
+  compare(K, D, xi, 1e-6);
+}
+
+TEST(OmniProjection, PrincipalPoint)
+{
+  cv::Mat K, D;
+  double xi;
+  realCamera(K, D, xi);
+  AMCLOmniCamera camera;
+  camera.SetIntrinsics(K, xi, D);
+
+  double x = 0.0, y = 0.0, z = 2.0, u, v;
+  camera.Project(&x, &y, &z, 1, &u, &v);
+  EXPECT_NEAR(K.at<float>(0, 2), u, 1e-3);
+  EXPECT_NEAR(K.at<float>(1, 2), v, 1e-3);
+}
+
+// Unprojecting a projected point gives back its direction, with and
+// without the bearing table
+static void roundTrip(bool table, double tolerance)
+{
+  cv::Mat K, D;
+  double xi;
+  realCamera(K, D, xi);
+  AMCLOmniCamera camera;
+  camera.SetIntrinsics(K, xi, D);
+  if(table)
+    camera.BuildBearingTable(1280, 960, 4);
+
+  std::vector<double> x, y, z;
+  testPoints(x, y, z);
+  int checked = 0;
+  for(size_t i = 0; i < x.size(); i++)
+  {
+    // Away from the rim of the mirror, where the distortion folds over
+    if(z[i] < 0)
+      continue;
+    double u, v, b[3];
+    camera.Project(&x[i], &y[i], &z[i], 1, &u, &v);
+    if(u < 0 || u >= 1280 || v < 0 || v >= 960)
+      continue;
+    camera.Unproject(u, v, b);
+    double norm = sqrt(x[i]*x[i] + y[i]*y[i] + z[i]*z[i]);
+    EXPECT_NEAR(x[i] / norm, b[0], tolerance) << "point " << i;
+    EXPECT_NEAR(y[i] / norm, b[1], tolerance) << "point " << i;
+    EXPECT_NEAR(z[i] / norm, b[2], tolerance) << "point " << i;
+    checked++;
+  }
+  EXPECT_GT(checked, 100);
+}
+
+TEST(OmniProjection, UnprojectInvertsProject)
+{
+  roundTrip(false, 1e-6);
+}
+
+TEST(OmniProjection, BearingTable)
+{
+  roundTrip(true, 1e-3);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,41 @@
+#ifndef CAMERA_CALIBRATION_H
+#define CAMERA_CALIBRATION_H
+
+#include <string>
+#include <opencv2/core.hpp>
+#include <sensor_msgs/CameraInfo.h>
+
+
+/**
+ * Intrinsic calibration of a camera, read from a YAML file with the layout
+ * of camera_calibration_parsers (image_width, image_height, camera_matrix,
+ * distortion_model, distortion_coefficients, rectification_matrix,
+ * projection_matrix).  Omnidirectional cameras use distortion_model
+ * "unified" with the coefficients k1 k2 p1 p2 of cv::omnidir and add the
+ * mirror parameter xi.
+ */
+class CameraCalibration{
+public:
+    //Calibration in CameraInfo form; the frame id is the camera_name
+    sensor_msgs::CameraInfo info;
+    //Unified (omnidirectional) model and its mirror parameter
+    bool omni;
+    double xi;
+
+    CameraCalibration();
+
+    //Read a calibration file; false (and an error is logged) if it can't
+    //be read or is incomplete
+    bool load(const std::string& file);
+
+    //The calibration as cv::Mat (CV_64F): 3x3 camera matrix, distortion
+    //coefficients as a column and 3x4 projection matrix
+    cv::Mat cameraMatrix(void) const;
+    cv::Mat distortion(void) const;
+    cv::Mat projectionMatrix(void) const;
+
+    //Path of one of the calibrations shipped in detector/calibration
+    static std::string defaultFile(const std::string& name);
+};
+
+#endif
@@ -18,6 +18,7 @@
 #include <functional>
 #include <signal.h>
 #include <detector/c_detector.h>
+#include <detector/camera_calibration.h>
 #include <algorithm>
 #include <cmath>
 #include <functional>
@@ -80,26 +81,22 @@ cDetector::cDetector ( const ros::NodeHandle& nh,const ros::NodeHandle& nh_priva
 
     newSize= cv::Size(RECTIFIED_IMAGE_WIDTH, RECTIFIED_IMAGE_HEIGHT);
 
-    camMatrix = cv::Mat(3, 3, CV_32F);
-    camMatrix.at<float>(0, 0) = 3.3148337972624245e+02;
-    camMatrix.at<float>(0, 1) = 0;
-    camMatrix.at<float>(0, 2) = 6.5050896530720797e+02;
-    camMatrix.at<float>(1, 0) = 0.0;
-    camMatrix.at<float>(1, 1) = 3.3296507853901846e+02;
-    camMatrix.at<float>(1, 2) = 4.9324794942591592e+02;
-    camMatrix.at<float>(2, 0) = 0.0;
-    camMatrix.at<float>(2, 1) = 0.0;
-    camMatrix.at<float>(2, 2) = 1.0;
-
-    distCoeff = cv::Mat(4, 1, CV_32F);
-    distCoeff.at<float>(0, 0) = -5.0278669230113635e-02;
-    distCoeff.at<float>(1, 0) = 2.7927571053875219e-02;
-    distCoeff.at<float>(2, 0) = -9.7303697830329119e-03;
-    distCoeff.at<float>(3, 0) = 0;
+    //Calibration of the omnidirectional camera used for the rectification
+    std::string calibration_file;
+    nh_private_.param<std::string>("calibration_file",calibration_file,
+                                   CameraCalibration::defaultFile("doris_omni_rectify.yaml"));
+    CameraCalibration calibration;
+    if(!calibration.load(calibration_file) || !calibration.omni){
+        ROS_FATAL("Can't use %s as the calibration of the omnidirectional camera",calibration_file.c_str());
+        ros::shutdown();
+        return;
+    }
+    calibration.cameraMatrix().convertTo(camMatrix,CV_32F);
+    calibration.distortion().convertTo(distCoeff,CV_32F);
 
     Knew = cv::Matx33f(newSize.width / (2 * M_PI), 0, 0, 0, newSize.height / M_PI, 0, 0, 0, 1);
     xi = cv::Mat(1, 1, CV_32FC1);
-    xi.at<float>(0, 0) = 1.5861076761699640e+00;
+    xi.at<float>(0, 0) = calibration.xi;
     break;
     }
     default:
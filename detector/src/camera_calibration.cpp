@@ -0,0 +1,109 @@
+#include <ros/ros.h>
+#include <ros/package.h>
+#include <string>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+#include <detector/camera_calibration.h>
+
+/**
+ * @brief readMatrix reads the data of a {rows, cols, data} node
+ * @param node : matrix node
+ * @param size : expected number of elements; 0 takes any
+ * @param data : elements, row major
+ * @return false if the node is missing or has the wrong size
+ */
+static bool readMatrix(const YAML::Node& node, size_t size, std::vector<double>& data){
+    if(!node || !node["data"])
+        return false;
+    data=node["data"].as<std::vector<double> >();
+    return size==0 || data.size()==size;
+}
+
+/**
+ * @brief CameraCalibration::CameraCalibration
+ * Empty calibration
+ */
+CameraCalibration::CameraCalibration()
+    :omni(false),xi(0.0)
+{
+}
+
+/**
+ * @brief CameraCalibration::load
+ * @param file : calibration YAML
+ * @return true if the calibration was read
+ */
+bool CameraCalibration::load(const std::string& file){
+    sensor_msgs::CameraInfo cal;
+    double mirror=0.0;
+    try{
+        YAML::Node doc=YAML::LoadFile(file);
+        std::vector<double> K,D,R,P;
+        if(!doc["image_width"] || !doc["image_height"] || !readMatrix(doc["camera_matrix"],9,K)){
+            ROS_ERROR("Camera calibration %s needs image_width, image_height and a 3x3 camera_matrix",file.c_str());
+            return false;
+        }
+        cal.width=doc["image_width"].as<unsigned int>();
+        cal.height=doc["image_height"].as<unsigned int>();
+        if(doc["camera_name"])
+            cal.header.frame_id=doc["camera_name"].as<std::string>();
+        cal.distortion_model="plumb_bob";
+        if(doc["distortion_model"])
+            cal.distortion_model=doc["distortion_model"].as<std::string>();
+        if(readMatrix(doc["distortion_coefficients"],0,D))
+            cal.D=D;
+        for(int i=0;i<9;i++){
+            cal.K[i]=K[i];
+            cal.R[i]=(i%4==0);
+        }
+        if(readMatrix(doc["rectification_matrix"],9,R))
+            std::copy(R.begin(),R.end(),cal.R.begin());
+        //Without a projection matrix the camera matrix is used
+        if(readMatrix(doc["projection_matrix"],12,P)){
+            std::copy(P.begin(),P.end(),cal.P.begin());
+        }else{
+            for(int r=0;r<3;r++){
+                for(int c=0;c<3;c++)
+                    cal.P[4*r+c]=K[3*r+c];
+                cal.P[4*r+3]=0.0;
+            }
+        }
+        if(cal.distortion_model=="unified"){
+            if(!doc["xi"] || cal.D.size()!=4){
+                ROS_ERROR("Camera calibration %s: the unified model needs xi and 4 distortion coefficients",file.c_str());
+                return false;
+            }
+            mirror=doc["xi"].as<double>();
+        }
+    }catch(YAML::Exception& e){
+        ROS_ERROR("Failed to read camera calibration %s: %s",file.c_str(),e.what());
+        return false;
+    }
+    this->info=cal;
+    this->omni=(cal.distortion_model=="unified");
+    this->xi=mirror;
+    return true;
+}
+
+cv::Mat CameraCalibration::cameraMatrix(void) const{
+    return cv::Mat(3,3,CV_64F,(void*)&this->info.K[0]).clone();
+}
+
+cv::Mat CameraCalibration::distortion(void) const{
+    if(this->info.D.empty())
+        return cv::Mat::zeros(4,1,CV_64F);
+    return cv::Mat(this->info.D.size(),1,CV_64F,(void*)&this->info.D[0]).clone();
+}
+
+cv::Mat CameraCalibration::projectionMatrix(void) const{
+    return cv::Mat(3,4,CV_64F,(void*)&this->info.P[0]).clone();
+}
+
+/**
+ * @brief CameraCalibration::defaultFile
+ * @param name : file name in detector/calibration
+ * @return full path
+ */
+std::string CameraCalibration::defaultFile(const std::string& name){
+    return ros::package::getPath("detector")+"/calibration/"+name;
+}
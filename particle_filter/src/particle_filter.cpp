@@ -35,6 +35,7 @@
 #include <detector/marker.h>
 #include <detector/messagedet.h>
 #include <particle_filter/particle_filter.h>
+#include <detector/camera_calibration.h>
 #include <visualization_msgs/Marker.h>
 #include <opencv2/ccalib/omnidir.hpp>
 
@@ -123,71 +124,19 @@ using namespace cv;
         this->pub_centros=nh1_.advertise<geometry_msgs::PoseArray> ("centros",1);
         detector_subs=nh1_.subscribe<sensor_msgs::Image> ("DetectorNode/detector_output",1,&ParticleFilter::imageCallback,this);
         odom_subs=nh1_.subscribe<geometry_msgs::PoseStamped> ("Doris/odom",1,&ParticleFilter::odomCallback,this);
-        camMatrix = cv::Mat(3, 3, CV_32F);
-                camMatrix.at<float>(0, 0) = IMAGE_WIDTH/2;
-                camMatrix.at<float>(0, 1) = 0.0;
-                camMatrix.at<float>(0, 2) = 0.0;
-                camMatrix.at<float>(1, 0) = 0.0;
-                camMatrix.at<float>(1, 1) = IMAGE_HEIGHT/2;
-                camMatrix.at<float>(1, 2) =0.0;
-                camMatrix.at<float>(2, 1) = 0.0;
-                camMatrix.at<float>(2, 2) = 1.0;
-       /* camMatrix = cv::Mat(3, 3, CV_32F);
-                camMatrix.at<float>(0, 0) = 8.5101024687735935e+02;
-                camMatrix.at<float>(0, 1) = -2.2255059056366439e-01;
-                camMatrix.at<float>(0, 2) = 6.5571465382877625e+02;
-                camMatrix.at<float>(1, 0) = 0.0;
-                camMatrix.at<float>(1, 1) = 8.5170243585411265e+02;;
-                camMatrix.at<float>(1, 2) = 5.1216084358475405e+02;
-                camMatrix.at<float>(2, 0) = 0.0;
-                camMatrix.at<float>(2, 1) = 0.0;
-                camMatrix.at<float>(2, 2) = 1.0;*/
-
-                distCoeff = cv::Mat(4, 1, CV_32F);
-                distCoeff.at<float>(0, 0) = 0.0;
-                distCoeff.at<float>(1, 0) = 0.0;
-                distCoeff.at<float>(2, 0) = 0.0;
-                distCoeff.at<float>(3, 0) = 0.0;
-
-                /*camMatrix = cv::Mat(3, 3, CV_32F);
-                        camMatrix.at<float>(0, 0) = 3.3148337972624245e+02;
-                        camMatrix.at<float>(0, 1) = 0;
-                        camMatrix.at<float>(0, 2) = 6.5050896530720797e+02;
-                        camMatrix.at<float>(1, 0) = 0.0;
-                        camMatrix.at<float>(1, 1) = 3.3296507853901846e+02;
-                        camMatrix.at<float>(1, 2) = 4.9324794942591592e+02;
-                        camMatrix.at<float>(2, 0) = 0.0;
-                        camMatrix.at<float>(2, 1) = 0.0;
-                        camMatrix.at<float>(2, 2) = 1.0;
-
-                        distCoeff = cv::Mat(4, 1, CV_32F);
-                        distCoeff.at<float>(0, 0) = -5.0278669230113635e-02;
-                        distCoeff.at<float>(1, 0) = 2.7927571053875219e-02;
-                        distCoeff.at<float>(2, 0) = -9.7303697830329119e-03;*/
-                camMatrix = cv::Mat(3, 3, CV_32F);
-                        camMatrix.at<float>(0, 0) = 8.5101024687735935e+02;
-                        camMatrix.at<float>(0, 1) = -2.2255059056366439e-01;
-                        camMatrix.at<float>(0, 2) = 6.5571465382877625e+02;
-                        camMatrix.at<float>(1, 0) = 0.0;
-                        camMatrix.at<float>(1, 1) = 8.5170243585411265e+02;;
-                        camMatrix.at<float>(1, 2) = 5.1216084358475405e+02;
-                        camMatrix.at<float>(2, 0) = 0.0;
-                        camMatrix.at<float>(2, 1) = 0.0;
-                        camMatrix.at<float>(2, 2) = 1.0;
-
-                        distCoeff = cv::Mat(4, 1, CV_32F);
-                        distCoeff.at<float>(0, 0) = -4.2648301140911193e-01;
-                        distCoeff.at<float>(1, 0) = 3.1105618959437248e-01;
-                        distCoeff.at<float>(2, 0) = -1.3775384616268102e-02;
-                distCoeff.at<float>(3, 0) = -1.9560559208606078e-03;
-                //distCoeff.at<float>(3, 0) = 0;
-                xi = cv::Mat(1, 1, CV_32FC1);
-                xi.at<float>(0, 0) = 1.5861076761699640e+00;
-              /*  distCoeff = cv::Mat(4, 1, CV_32F);
-                distCoeff.at<float>(0, 0) = -4.2648301140911193e-01;
-                distCoeff.at<float>(1, 0) = 3.1105618959437248e-01;
-                distCoeff.at<float>(2, 0) = -1.3775384616268102e-02;
-                distCoeff.at<float>(3, 0) = -1.9560559208606078e-03;*/
+        //Calibration of the omnidirectional camera
+        std::string calibration_file;
+        nh_private1_.param<std::string>("calibration_file",calibration_file,
+                                        CameraCalibration::defaultFile("doris_omni.yaml"));
+        CameraCalibration calibration;
+        if(!calibration.load(calibration_file) || !calibration.omni){
+            ROS_FATAL("Can't use %s as the calibration of the omnidirectional camera",calibration_file.c_str());
+            exit(1);
+        }
+        calibration.cameraMatrix().convertTo(camMatrix,CV_32F);
+        calibration.distortion().convertTo(distCoeff,CV_32F);
+        xi = cv::Mat(1, 1, CV_32FC1);
+        xi.at<float>(0, 0) = calibration.xi;
 
         this->loadTFCameras(cameras);
         this->LoadMap(maps,sectors,IDs,Centros);
@@ -216,51 +165,13 @@ using namespace cv;
 
     }
     void ParticleFilter::LoadCameraInfo(void){
-        switch (simulation){
-            case 1:
-        {
-        sensor_msgs::CameraInfo cam_inf_ed;
-        cam_inf_ed.header.frame_id="Doris/cam1";
-        cam_inf_ed.height=679;
-        cam_inf_ed.width=604;
-        cam_inf_ed.distortion_model="plumb_bob";
-        double Da[5]={-0.2601958609577983, 0.05505240192232372, 0.0, -0.0045449850126361765, 0.0};
-        boost::array<double, 9ul> K={ {174.746839097, 0.0, 906.0, 0.0, 174.746839097, 339.5, 0.0, 0.0, 1.0} } ;
-        boost::array<double, 9ul> R={ {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0} };
-        boost::array<double, 12ul> P={ {174.64077512103418, 0.0, 906.0, 0.0, 0.0, 174.64077512103418, 339.5, 0.0, 0.0, 0.0, 1.0, 0.0} };
-        std::vector<double> D(Da,Da +(sizeof(Da)/sizeof(Da[0])));
-        cam_inf_ed.D=D;
-        cam_inf_ed.K=K;
-        cam_inf_ed.R=R;
-        cam_inf_ed.P=P;
-        cam_inf_ed.binning_x=0.0;
-        cam_inf_ed.binning_y=0.0;
-        cam_inf_ed.roi.height=0;
-        cam_inf_ed.roi.width=0;
-
-        this->pin_model.fromCameraInfo(cam_inf_ed);
-        break;
-        }
-        case 0:
-            sensor_msgs::CameraInfo cam_inf_ed;
-            cam_inf_ed.header.frame_id="Doris/cam1";
-            cam_inf_ed.height=679;
-            cam_inf_ed.width=604;
-            cam_inf_ed.distortion_model="plumb_bob";
-            double Da[5]={-0.2601958609577983, 0.05505240192232372, 0.0, -0.0045449850126361765, 0.0};
-            boost::array<double, 9ul> K={ {174.746839097, 0.0, 906.0, 0.0, 174.746839097, 339.5, 0.0, 0.0, 1.0} } ;
-            boost::array<double, 9ul> R={ {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0} };
-            boost::array<double, 12ul> P={ {174.64077512103418, 0.0, 906.0, 0.0, 0.0, 174.64077512103418, 339.5, 0.0, 0.0, 0.0, 1.0, 0.0} };
-            std::vector<double> D(Da,Da +(sizeof(Da)/sizeof(Da[0])));
-            cam_inf_ed.D=D;
-            cam_inf_ed.K=K;
-            cam_inf_ed.R=R;
-            cam_inf_ed.P=P;
-            cam_inf_ed.binning_x=0.0;
-            cam_inf_ed.binning_y=0.0;
-            cam_inf_ed.roi.height=0;
-            cam_inf_ed.roi.width=0;
-        }
+        //Simulated pinhole cameras
+        std::string calibration_file;
+        nh_private1_.param<std::string>("pinhole_calibration_file",calibration_file,
+                                        CameraCalibration::defaultFile("doris_sim.yaml"));
+        CameraCalibration calibration;
+        if(calibration.load(calibration_file))
+            this->pin_model.fromCameraInfo(calibration.info);
     }
 
 
@@ -540,8 +451,7 @@ void ParticleFilter::ErrorCalc(){
     }
     std::vector<cv::Point2f>proyeccion;
     //cout<<"antes de proyectar"<<endl;
-    double x= 1.5861076761699640e+00;
-    cv::omnidir::projectPoints(rel,proyeccion,rvec,tvec,camMatrix,x,distCoeff);
+    cv::omnidir::projectPoints(rel,proyeccion,rvec,tvec,camMatrix,xi.at<float>(0, 0),distCoeff);
     //cout<<proyeccion[0].x<<" "<<proyeccion[0].y<<endl;
    line (this->imagen_filter,proyeccion[0], proyeccion[1],Scalar(0,0,255),4);
    line (this->imagen_filter,proyeccion[1], proyeccion[2],Scalar(0,0,255),4);